@@ -3,10 +3,12 @@
 
 #include "DeckLinkAPI.h"
 
+struct CaptureDevice;
+
 class DeckLinkCaptureDelegate : public IDeckLinkInputCallback
 {
 public:
-	DeckLinkCaptureDelegate();
+	DeckLinkCaptureDelegate(struct CaptureDevice *dev);
 	~DeckLinkCaptureDelegate();
 
 	virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
@@ -18,6 +20,7 @@ public:
 private:
 	ULONG				m_refCount;
 	pthread_mutex_t		m_mutex;
+	struct CaptureDevice	*m_dev;
 };
 
 #endif
@@ -0,0 +1,49 @@
+#ifndef __FRAMEPOOL_H__
+#define __FRAMEPOOL_H__
+
+#include <pthread.h>
+#include "DeckLinkAPI.h"
+
+/*
+ * Fixed size frame allocator handed to the SDK through
+ * SetVideoInputFrameMemoryAllocator().
+ *
+ * All the frames are carved out of a single mapping created up front,
+ * backed by 2MB pages when available, optionally bound to a NUMA node,
+ * locked and prefaulted, so capturing never allocates nor faults.
+ */
+class FramePool : public IDeckLinkMemoryAllocator
+{
+public:
+	FramePool(unsigned frameSize, unsigned frameCount, int numaNode);
+	~FramePool();
+
+	bool	IsValid() { return m_base != NULL; }
+	void	PrintStats(FILE *f);
+
+	unsigned	m_frameSize;
+	unsigned	m_frameCount;
+	unsigned	m_inUse;
+	unsigned	m_highWater;
+	unsigned	m_exhausted;
+	bool		m_hugePages;
+	bool		m_locked;
+
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+	virtual ULONG STDMETHODCALLTYPE AddRef(void);
+	virtual ULONG STDMETHODCALLTYPE Release(void);
+	virtual HRESULT STDMETHODCALLTYPE AllocateBuffer(uint32_t bufferSize, void **allocatedBuffer);
+	virtual HRESULT STDMETHODCALLTYPE ReleaseBuffer(void *buffer);
+	virtual HRESULT STDMETHODCALLTYPE Commit(void);
+	virtual HRESULT STDMETHODCALLTYPE Decommit(void);
+
+private:
+	ULONG				m_refCount;
+	pthread_mutex_t		m_mutex;
+	uint8_t				*m_base;
+	size_t				m_mapSize;
+	unsigned			*m_free;
+	unsigned			m_nbFree;
+};
+
+#endif
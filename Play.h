@@ -25,6 +25,7 @@
 ** -LICENSE-END-
 */
 
+#include <pthread.h>
 #include "DeckLinkAPI.h"
 
 enum OutputSignal {
@@ -57,18 +58,29 @@ protected:
 	BMDAudioSampleRate				m_audioSampleRate;
 	unsigned long					m_audioSampleDepth;
 
+	// Decoded frames are converted off the callback and handed over ready
+	pthread_t						m_decodeThread;
+	bool							m_decoding;
+	unsigned						m_owed;
+	int								m_scheduling;
+
 	// Generated message map functions
 
 	// Signal Generator Implementation
 	void			StartRunning (int videomode);
 	void			StopRunning ();
-	void			ScheduleNextFrame (bool prerolling);
+	void			ScheduleFrames (unsigned count);
+	bool			ScheduleReadyFrame ();
+	int				QueueFrame (struct AVFrame *frame, int64_t pts, int64_t duration);
+	bool			StartDecoding ();
+	void			StopDecoding ();
 	void			WriteNextAudioSamples ();
 
 	IDeckLinkDisplayMode *GetDisplayModeByIndex(int selectedIndex);
 
 public:
 	bool			Init(int videomode, int connection, int camera);
+	void			DecodeFrames ();
 
 	// *** DeckLink API implementation of IDeckLinkVideoOutputCallback IDeckLinkAudioOutputCallback *** //
 	// IUnknown needs only a dummy implementation
@@ -0,0 +1,301 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "affinity.h"
+
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT   0
+#endif
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#define MAX_NODES 1024
+
+void thread_placement_init(ThreadPlacement *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->policy = SCHED_OTHER;
+    p->node   = -1;
+}
+
+#ifdef __linux__
+int thread_placement_parse_cpus(ThreadPlacement *p, const char *list)
+{
+    const char *s = list;
+
+    CPU_ZERO(&p->cpus);
+    while (*s) {
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last  = first;
+
+        if (end == s || first < 0)
+            goto fail;
+        if (*end == '-') {
+            s    = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first)
+                goto fail;
+        }
+        if (last >= CPU_SETSIZE)
+            goto fail;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &p->cpus);
+
+        if (*end == ',' || *end == '\n')
+            end++;
+        else if (*end)
+            goto fail;
+        s = end;
+    }
+
+    p->has_cpus = CPU_COUNT(&p->cpus) > 0;
+    return p->has_cpus ? 0 : -1;
+
+fail:
+    fprintf(stderr, "Invalid cpu list '%s'\n", list);
+    return -1;
+}
+#else
+int thread_placement_parse_cpus(ThreadPlacement *p, const char *list)
+{
+    fprintf(stderr, "Thread affinity is not supported on this system\n");
+    return -1;
+}
+#endif
+
+int thread_placement_parse_sched(ThreadPlacement *p, const char *arg)
+{
+    const char *prio = strchr(arg, ':');
+    size_t len       = prio ? (size_t)(prio - arg) : strlen(arg);
+    int min, max;
+
+    if (len == 4 && !strncmp(arg, "fifo", 4))
+        p->policy = SCHED_FIFO;
+    else if (len == 2 && !strncmp(arg, "rr", 2))
+        p->policy = SCHED_RR;
+    else if (len == 5 && !strncmp(arg, "other", 5))
+        p->policy = SCHED_OTHER;
+    else
+        goto fail;
+
+    min = sched_get_priority_min(p->policy);
+    max = sched_get_priority_max(p->policy);
+    p->priority = prio ? atoi(prio + 1) : min;
+    if (p->priority < min || p->priority > max) {
+        fprintf(stderr, "The priority must be between %d and %d\n", min, max);
+        return -1;
+    }
+    return 0;
+
+fail:
+    fprintf(stderr, "Unknown scheduling policy '%s', use fifo:<priority>, "
+            "rr:<priority> or other\n", arg);
+    return -1;
+}
+
+int thread_placement_set_node(ThreadPlacement *p, int node)
+{
+#ifdef __linux__
+    char path[64], list[4096];
+    FILE *f;
+
+    if (node < 0 || node >= MAX_NODES) {
+        fprintf(stderr, "Invalid NUMA node %d\n", node);
+        return -1;
+    }
+    p->node = node;
+    if (p->has_cpus)
+        return 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    f = fopen(path, "r");
+    if (!f || !fgets(list, sizeof(list), f)) {
+        fprintf(stderr, "Could not read the cpus of NUMA node %d\n", node);
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    return thread_placement_parse_cpus(p, list);
+#else
+    fprintf(stderr, "NUMA placement is not supported on this system\n");
+    return -1;
+#endif
+}
+
+int thread_placement_is_set(const ThreadPlacement *p)
+{
+    return p->has_cpus || p->policy != SCHED_OTHER || p->node >= 0;
+}
+
+void thread_placement_save(ThreadPlacement *p)
+{
+    struct sched_param param;
+
+    thread_placement_init(p);
+#ifdef __linux__
+    if (!pthread_getaffinity_np(pthread_self(), sizeof(p->cpus), &p->cpus))
+        p->has_cpus = 1;
+#endif
+    if (!pthread_getschedparam(pthread_self(), &p->policy, &param))
+        p->priority = param.sched_priority;
+}
+
+int thread_placement_apply(const ThreadPlacement *p)
+{
+    struct sched_param param;
+    int ret = 0;
+    int err;
+
+#ifdef __linux__
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+
+    if (p->has_cpus &&
+        (err = pthread_setaffinity_np(pthread_self(), sizeof(p->cpus),
+                                      &p->cpus))) {
+        fprintf(stderr, "Could not set the thread affinity: %s\n",
+                strerror(err));
+        ret = -1;
+    }
+
+    if (p->node >= 0)
+        mask[p->node / (8 * sizeof(*mask))] |=
+            1UL << (p->node % (8 * sizeof(*mask)));
+    if (syscall(SYS_set_mempolicy, p->node >= 0 ? MPOL_PREFERRED : MPOL_DEFAULT,
+                p->node >= 0 ? mask : NULL, p->node >= 0 ? MAX_NODES : 0) < 0) {
+        fprintf(stderr, "Could not prefer memory from NUMA node %d: %s\n",
+                p->node, strerror(errno));
+        ret = -1;
+    }
+#endif
+
+    /* realtime needs CAP_SYS_NICE or an rtprio limit, carry on without */
+    param.sched_priority = p->priority;
+    if ((err = pthread_setschedparam(pthread_self(), p->policy, &param))) {
+        fprintf(stderr, "Could not set the scheduling policy: %s\n",
+                strerror(err));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+typedef struct ThreadStart {
+    ThreadPlacement placement;
+    void *(*fn)(void *);
+    void *arg;
+} ThreadStart;
+
+static void *placed_thread(void *ctx)
+{
+    ThreadStart start = *(ThreadStart *)ctx;
+
+    free(ctx);
+    thread_placement_apply(&start.placement);
+
+    return start.fn(start.arg);
+}
+
+int thread_create(pthread_t *th, const ThreadPlacement *p,
+                  void *(*fn)(void *), void *arg)
+{
+    ThreadStart *start;
+    int ret;
+
+    if (!p || !thread_placement_is_set(p))
+        return pthread_create(th, NULL, fn, arg);
+
+    start = (ThreadStart *)malloc(sizeof(*start));
+    if (!start)
+        return ENOMEM;
+    start->placement = *p;
+    start->fn        = fn;
+    start->arg       = arg;
+
+    ret = pthread_create(th, NULL, placed_thread, start);
+    if (ret)
+        free(start);
+
+    return ret;
+}
+
+static const char *policy_name(int policy)
+{
+    switch (policy) {
+    case SCHED_FIFO:
+        return "SCHED_FIFO";
+    case SCHED_RR:
+        return "SCHED_RR";
+    default:
+        return "SCHED_OTHER";
+    }
+}
+
+void thread_placement_report(const ThreadPlacement *p, const char *what,
+                             FILE *f)
+{
+    fprintf(f, "%s: ", what);
+
+#ifdef __linux__
+    if (p->has_cpus) {
+        const char *sep = "cpus ";
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            int last = cpu;
+
+            if (!CPU_ISSET(cpu, &p->cpus))
+                continue;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &p->cpus))
+                last++;
+            if (last == cpu)
+                fprintf(f, "%s%d", sep, cpu);
+            else
+                fprintf(f, "%s%d-%d", sep, cpu, last);
+            sep = ",";
+            cpu = last;
+        }
+    } else
+#endif
+        fprintf(f, "any cpu");
+
+    if (p->policy != SCHED_OTHER)
+        fprintf(f, " - %s priority %d", policy_name(p->policy), p->priority);
+    else
+        fprintf(f, " - %s", policy_name(p->policy));
+
+    if (p->node >= 0)
+        fprintf(f, " - memory on NUMA node %d\n", p->node);
+    else
+        fprintf(f, " - memory on any node\n");
+}
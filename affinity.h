@@ -0,0 +1,69 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef BMDTOOLS_AFFINITY_H
+#define BMDTOOLS_AFFINITY_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * Where a thread runs and where its memory comes from: a cpu set, a
+ * scheduling policy and priority and a NUMA node new pages are taken
+ * from first. Only Linux honours it, elsewhere threads keep the defaults.
+ *
+ * Threads created by a placed thread inherit its cpus, policy and node,
+ * so placing the thread that sets up a card covers the threads the SDK
+ * and libavcodec start for it.
+ */
+typedef struct ThreadPlacement {
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+    int has_cpus;
+    int policy;         /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+    int priority;
+    int node;           /* -1 for the default memory policy */
+} ThreadPlacement;
+
+void thread_placement_init(ThreadPlacement *p);
+/* "0-3,8,10-11" */
+int thread_placement_parse_cpus(ThreadPlacement *p, const char *list);
+/* "fifo:<priority>", "rr:<priority>" or "other" */
+int thread_placement_parse_sched(ThreadPlacement *p, const char *arg);
+/* Prefer memory from node, and its cpus if none were given */
+int thread_placement_set_node(ThreadPlacement *p, int node);
+int thread_placement_is_set(const ThreadPlacement *p);
+
+/* Read back the placement of the calling thread, to restore it later */
+void thread_placement_save(ThreadPlacement *p);
+int thread_placement_apply(const ThreadPlacement *p);
+
+/* pthread_create() with the new thread placed before fn runs */
+int thread_create(pthread_t *th, const ThreadPlacement *p,
+                  void *(*fn)(void *), void *arg);
+
+void thread_placement_report(const ThreadPlacement *p, const char *what,
+                             FILE *f);
+
+#endif /* BMDTOOLS_AFFINITY_H */
@@ -0,0 +1,300 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "audiomap.h"
+
+/* "<ch>[@<dB>],..." with the streams separated by '/' */
+int audio_map_parse(AudioMap *m, const char *arg)
+{
+    const char *p = arg;
+    AudioMapStream *st;
+
+    memset(m, 0, sizeof(*m));
+    m->nb_streams = 1;
+    st = &m->streams[0];
+
+    while (*p) {
+        char *end;
+        long ch = strtol(p, &end, 10);
+
+        if (end == p || ch < 0 || ch >= AUDIO_MAP_MAX_CHANNELS ||
+            st->nb_channels == AUDIO_MAP_MAX_CHANNELS)
+            goto fail;
+        st->map[st->nb_channels]  = ch;
+        st->gain[st->nb_channels] = 1.0f;
+
+        if (*end == '@') {
+            double db = strtod(end + 1, &end);
+
+            st->gain[st->nb_channels] = pow(10, db / 20);
+            if (db != 0)
+                st->has_gain = 1;
+        }
+        st->nb_channels++;
+
+        if (*end == '/') {
+            if (m->nb_streams == AUDIO_MAP_MAX_STREAMS)
+                goto fail;
+            st = &m->streams[m->nb_streams++];
+        } else if (*end && *end != ',') {
+            goto fail;
+        }
+        p = *end ? end + 1 : end;
+    }
+
+    for (int i = 0; i < m->nb_streams; i++)
+        if (!m->streams[i].nb_channels)
+            goto fail;
+
+    return 0;
+
+fail:
+    fprintf(stderr, "Invalid channel map '%s', expected e.g. 0,1/2@-6,3@-6\n",
+            arg);
+    return -1;
+}
+
+static int16_t clip_s16(float v)
+{
+    v = lrintf(v);
+    return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+}
+
+static int32_t clip_s32(double v)
+{
+    v = lrint(v);
+    return v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN : v;
+}
+
+static void remap_c(const AudioMapStream *st, const uint8_t *src,
+                    uint8_t *dst, int nb_samples)
+{
+    int in_channels = st->in_stride / st->sample_size;
+    int nb_channels = st->nb_channels;
+
+    if (st->sample_size == 2) {
+        const int16_t *s = (const int16_t *)src;
+        int16_t *d       = (int16_t *)dst;
+
+        for (int i = 0; i < nb_samples; i++, s += in_channels, d += nb_channels)
+            for (int c = 0; c < nb_channels; c++)
+                d[c] = st->has_gain ? clip_s16(s[st->map[c]] * st->gain[c])
+                                    : s[st->map[c]];
+    } else {
+        const int32_t *s = (const int32_t *)src;
+        int32_t *d       = (int32_t *)dst;
+
+        for (int i = 0; i < nb_samples; i++, s += in_channels, d += nb_channels)
+            for (int c = 0; c < nb_channels; c++)
+                d[c] = st->has_gain ? clip_s32(s[st->map[c]] *
+                                               (double)st->gain[c])
+                                    : s[st->map[c]];
+    }
+}
+
+#ifdef HAVE_X86
+/*
+ * Each output frame is gathered from the 16 byte chunks of the input
+ * frame with one shuffle per chunk. The loads read past the frame and
+ * the stores write past it, so the last frames are left to remap_c().
+ */
+static int simd_frames(const AudioMapStream *st, int nb_samples)
+{
+    int in_frames  = (st->nb_chunks * 16 + st->in_stride - 1) / st->in_stride;
+    int out_frames = (16 + st->out_stride - 1) / st->out_stride;
+    int n          = nb_samples - (in_frames > out_frames ? in_frames
+                                                          : out_frames) + 1;
+
+    return n > 0 ? n : 0;
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i gather_frame(const AudioMapStream *st,
+                                   const __m128i *mask, const uint8_t *src)
+{
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src),
+                                 mask[0]);
+
+    for (int j = 1; j < st->nb_chunks; j++)
+        v = _mm_or_si128(v, _mm_shuffle_epi8(
+                                _mm_loadu_si128((const __m128i *)(src + 16 * j)),
+                                mask[j]));
+    return v;
+}
+
+__attribute__((target("ssse3")))
+static void remap_ssse3(const AudioMapStream *st, const uint8_t *src,
+                        uint8_t *dst, int nb_samples)
+{
+    __m128i mask[4];
+    int n = simd_frames(st, nb_samples);
+    int i = 0;
+
+    for (int j = 0; j < st->nb_chunks; j++)
+        mask[j] = _mm_loadu_si128((const __m128i *)st->shuffle[j]);
+
+    for (; i < n; i++, src += st->in_stride, dst += st->out_stride)
+        _mm_storeu_si128((__m128i *)dst, gather_frame(st, mask, src));
+
+    remap_c(st, src, dst, nb_samples - i);
+}
+
+/* The gain is applied in float, packing back saturates */
+__attribute__((target("ssse3")))
+static void remap_gain_s16_ssse3(const AudioMapStream *st, const uint8_t *src,
+                                 uint8_t *dst, int nb_samples)
+{
+    const __m128 gain_lo = _mm_loadu_ps(st->lane_gain);
+    const __m128 gain_hi = _mm_loadu_ps(st->lane_gain + 4);
+    __m128i mask[4];
+    int n = simd_frames(st, nb_samples);
+    int i = 0;
+
+    for (int j = 0; j < st->nb_chunks; j++)
+        mask[j] = _mm_loadu_si128((const __m128i *)st->shuffle[j]);
+
+    for (; i < n; i++, src += st->in_stride, dst += st->out_stride) {
+        __m128i v  = gather_frame(st, mask, src);
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+        lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), gain_lo));
+        hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), gain_hi));
+        _mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(lo, hi));
+    }
+
+    remap_c(st, src, dst, nb_samples - i);
+}
+
+__attribute__((target("ssse3")))
+static void remap_gain_s32_ssse3(const AudioMapStream *st, const uint8_t *src,
+                                 uint8_t *dst, int nb_samples)
+{
+    const __m128 gain = _mm_loadu_ps(st->lane_gain);
+    const __m128 max  = _mm_set1_ps(2147483520.0f);
+    const __m128 min  = _mm_set1_ps(-2147483648.0f);
+    __m128i mask[4];
+    int n = simd_frames(st, nb_samples);
+    int i = 0;
+
+    for (int j = 0; j < st->nb_chunks; j++)
+        mask[j] = _mm_loadu_si128((const __m128i *)st->shuffle[j]);
+
+    for (; i < n; i++, src += st->in_stride, dst += st->out_stride) {
+        __m128 v = _mm_cvtepi32_ps(gather_frame(st, mask, src));
+
+        v = _mm_max_ps(_mm_min_ps(_mm_mul_ps(v, gain), max), min);
+        _mm_storeu_si128((__m128i *)dst, _mm_cvtps_epi32(v));
+    }
+
+    remap_c(st, src, dst, nb_samples - i);
+}
+
+static void init_shuffle(AudioMapStream *st)
+{
+    int last = 0;
+
+    memset(st->shuffle, 0x80, sizeof(st->shuffle));
+    for (int c = 0; c < st->nb_channels; c++) {
+        for (int b = 0; b < st->sample_size; b++) {
+            int in  = st->map[c] * st->sample_size + b;
+            int out = c * st->sample_size + b;
+
+            st->shuffle[in / 16][out] = in % 16;
+            if (in / 16 > last)
+                last = in / 16;
+        }
+        st->lane_gain[c] = st->gain[c];
+    }
+    st->nb_chunks = last + 1;
+}
+#endif
+
+int audio_map_init(AudioMap *m, int in_channels, int sample_size)
+{
+    int simd = 0;
+
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    simd = __builtin_cpu_supports("ssse3");
+#endif
+    m->name = simd ? "ssse3" : "c";
+
+    for (int i = 0; i < m->nb_streams; i++) {
+        AudioMapStream *st = &m->streams[i];
+
+        for (int c = 0; c < st->nb_channels; c++) {
+            if (st->map[c] >= in_channels) {
+                fprintf(stderr, "Channel %d is not captured, -c is %d\n",
+                        st->map[c], in_channels);
+                return -1;
+            }
+        }
+
+        st->sample_size = sample_size;
+        st->in_stride   = in_channels * sample_size;
+        st->out_stride  = st->nb_channels * sample_size;
+        st->remap       = remap_c;
+
+#ifdef HAVE_X86
+        if (!simd || st->out_stride > 16)
+            continue;
+        init_shuffle(st);
+        if (!st->has_gain)
+            st->remap = remap_ssse3;
+        else if (sample_size == 2)
+            st->remap = remap_gain_s16_ssse3;
+        else
+            st->remap = remap_gain_s32_ssse3;
+#endif
+    }
+
+    return 0;
+}
+
+int audio_map_channels(const AudioMap *m)
+{
+    int nb_channels = 0;
+
+    for (int i = 0; i < m->nb_streams; i++)
+        nb_channels += m->streams[i].nb_channels;
+
+    return nb_channels;
+}
+
+void audio_map_apply(const AudioMap *m, int stream, const uint8_t *src,
+                     uint8_t *dst, int nb_samples)
+{
+    const AudioMapStream *st = &m->streams[stream];
+
+    st->remap(st, src, dst, nb_samples);
+}
@@ -0,0 +1,76 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef BMDTOOLS_AUDIOMAP_H
+#define BMDTOOLS_AUDIOMAP_H
+
+#include <stdint.h>
+
+#define AUDIO_MAP_MAX_CHANNELS 16
+#define AUDIO_MAP_MAX_STREAMS  8
+
+struct AudioMapStream;
+
+typedef void (*AudioRemapFunc)(const struct AudioMapStream *st,
+                               const uint8_t *src, uint8_t *dst,
+                               int nb_samples);
+
+/* The channels of one output stream, picked from the captured ones */
+typedef struct AudioMapStream {
+    int nb_channels;
+    int map[AUDIO_MAP_MAX_CHANNELS];    /* source channel of each channel */
+    float gain[AUDIO_MAP_MAX_CHANNELS]; /* linear */
+    int has_gain;
+
+    /* set by audio_map_init() */
+    int sample_size;
+    int in_stride, out_stride;          /* bytes per sample frame */
+    int nb_chunks;                      /* 16 byte loads per input frame */
+    uint8_t shuffle[4][16];
+    float lane_gain[8];
+    AudioRemapFunc remap;
+} AudioMapStream;
+
+/*
+ * Select, reorder and scale the interleaved channels the card delivers,
+ * optionally splitting them in several streams, e.g. "0,1/4@-6,5@-6"
+ * makes a stereo stream of the first pair and one of the third pair
+ * 6 dB down.
+ *
+ * Output frames up to 16 bytes wide are gathered with byte shuffles
+ * when the cpu has SSSE3, the last frames and wider layouts use the
+ * C version.
+ */
+typedef struct AudioMap {
+    int nb_streams;
+    AudioMapStream streams[AUDIO_MAP_MAX_STREAMS];
+    const char *name;                   /* of the remap kernel */
+} AudioMap;
+
+int audio_map_parse(AudioMap *m, const char *arg);
+int audio_map_init(AudioMap *m, int in_channels, int sample_size);
+/* Channels over all the streams */
+int audio_map_channels(const AudioMap *m);
+void audio_map_apply(const AudioMap *m, int stream, const uint8_t *src,
+                     uint8_t *dst, int nb_samples);
+
+#endif /* BMDTOOLS_AUDIOMAP_H */
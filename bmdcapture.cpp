@@ -32,167 +32,336 @@
 #include "compat.h"
 #include "DeckLinkAPI.h"
 #include "Capture.h"
+#include "FramePool.h"
 #include "modes.h"
+#include "packetqueue.h"
+#include "spill.h"
+#include "encode.h"
+#include "v210.h"
+#include "filler.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+#include "directio.h"
+#include "segment.h"
+#include "affinity.h"
+#include "audiomap.h"
+#include "proxy.h"
+#include "crc32c.h"
+#include "datapoll.h"
+#include "replay.h"
 extern "C" {
 #include "libavformat/avformat.h"
 #include "libavutil/time.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/avstring.h"
 }
 
 pthread_mutex_t sleepMutex;
 pthread_cond_t sleepCond;
-int videoOutputFile = -1;
-int audioOutputFile = -1;
 
-IDeckLink *deckLink;
-IDeckLinkInput *deckLinkInput;
-IDeckLinkDisplayModeIterator *displayModeIterator;
-IDeckLinkDisplayMode *displayMode;
-IDeckLinkConfiguration *deckLinkConfiguration;
-
-static int g_videoModeIndex      = -1;
 static int g_audioChannels       = 2;
 static int g_audioSampleDepth    = 16;
-const char *g_videoOutputFile    = NULL;
-const char *g_audioOutputFile    = NULL;
 static int g_maxFrames           = -1;
-static int serial_fd             = -1;
 static int wallclock             = 0;
-static int draw_bars             = 1;
+static int g_binaryClock         = 0;
+static FILE *g_clockTrace        = NULL;
+static enum FillerType g_filler  = FILLER_BARS;
+static unsigned g_zeroCopyFrames = 0;
+static int g_poolFrames          = 0;
+static size_t g_directBuffer     = 0;
+static int g_directDepth         = 4;
+static int g_segment             = 0;
+static SegmentRule g_segmentRule;
+static int g_writerThreads       = 0;
+static const char *g_schedPolicy = NULL;
+/* With -a only the mapped channels are queued, in one or more streams */
+static AudioMap g_audioMap;
 bool g_verbose                   = false;
 unsigned long long g_memoryLimit = 1024 * 1024 * 1024;            // 1GByte(>50 sec)
 
-static unsigned long frameCount = 0;
-static unsigned int dropped     = 0, totaldropped = 0;
-static enum AVPixelFormat pix_fmt     = AV_PIX_FMT_UYVY422;
+enum OverflowPolicy {
+    OVERFLOW_ABORT,
+    OVERFLOW_DROP_OLDEST,
+    OVERFLOW_DROP_NTH,
+    OVERFLOW_BLOCK,
+};
+
+static const char *overflow_policy_names[] = {
+    "abort",
+    "drop oldest video",
+    "drop every Nth frame",
+    "block",
+};
+
+static enum OverflowPolicy g_overflowPolicy = OVERFLOW_ABORT;
+static int g_dropInterval                    = 2;
 static enum AVSampleFormat sample_fmt = AV_SAMPLE_FMT_S16;
-typedef struct AVPacketQueue {
-    AVPacketList *first_pkt, *last_pkt;
-    int nb_packets;
-    unsigned long long size;
-    int abort_request;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-} AVPacketQueue;
-
-static AVPacketQueue queue;
 
-static AVPacket flush_pkt;
-
-static void avpacket_queue_init(AVPacketQueue *q)
-{
-    memset(q, 0, sizeof(AVPacketQueue));
-    pthread_mutex_init(&q->mutex, NULL);
-    pthread_cond_init(&q->cond, NULL);
-}
+/* With -Q the spill thread sits between queue and the writer */
+static const char *g_spillFile       = NULL;
+static unsigned long long g_spillSize = 16 * 1024 * 1024 * 1024ULL;
 
-static void avpacket_queue_flush(AVPacketQueue *q)
-{
-    AVPacketList *pkt, *pkt1;
+/* With -e the video goes through an encoder thread before the muxers */
+static const char *g_encoder     = NULL;
+static AVDictionary *g_encoderOpts = NULL;
 
-    pthread_mutex_lock(&q->mutex);
-    for (pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
-        pkt1 = pkt->next;
-        av_free_packet(&pkt->pkt);
-        av_freep(&pkt);
-    }
-    q->last_pkt   = NULL;
-    q->first_pkt  = NULL;
-    q->nb_packets = 0;
-    q->size       = 0;
-    pthread_mutex_unlock(&q->mutex);
-}
+/* With -u the writer unpacks v210 to planar yuv422p10 */
+static int g_unpackThreads       = 0;
 
-static void avpacket_queue_end(AVPacketQueue *q)
-{
-    avpacket_queue_flush(q);
-    pthread_mutex_destroy(&q->mutex);
-    pthread_cond_destroy(&q->cond);
-}
+/* With -x the writer also feeds a downscaled proxy, -y sets how much */
+#define PROXY_QUEUE_FRAMES 4
+static int g_proxyFactor         = 2;
+static int g_proxyThreads        = 2;
 
-static int avpacket_queue_put(AVPacketQueue *q, AVPacket *pkt)
-{
-    AVPacketList *pkt1;
+/* With -O the last -I seconds are kept in memory, SIGUSR2 dumps them */
+static double g_replayWindow     = 10;
+static double g_replayPostRoll   = 0;
+static unsigned replay_requests  = 0;
 
-    /* duplicate the packet */
-    if (pkt != &flush_pkt && av_dup_packet(pkt) < 0) {
-        return -1;
-    }
+#define MAX_OUTPUTS 8
+#define MAX_DEVICES 16
 
-    pkt1 = (AVPacketList *)av_malloc(sizeof(AVPacketList));
-    if (!pkt1) {
-        return -1;
-    }
-    pkt1->pkt  = *pkt;
-    pkt1->next = NULL;
+/*
+ * Video is timed in 1/240000 s, a whole number of ticks per frame for
+ * every rate a card detects from 23.98 to 120 fps, so a format change
+ * to another rate keeps one time base for the whole capture.
+ */
+#define VIDEO_TIME_SCALE 240000
+
+struct CaptureDevice;
+
+/* Reused buffers for the card data that is copied, see copy_pool_get() */
+typedef struct CopyPool {
+    AVBufferPool *pool;
+    int size;
+} CopyPool;
+
+/* What a packet referencing a card buffer releases once it is done */
+typedef struct CardBuffer {
+    IUnknown *obj;
+    unsigned *held;
+    int in_use;
+} CardBuffer;
+
+/* One -f/-F/-o group, each output has its own writer thread and queue */
+typedef struct CaptureOutput {
+    struct CaptureDevice *dev;
+    const char *filename;
+    AVOutputFormat *fmt;
+    AVDictionary *opts;
+    AVFormatContext *oc;
+    AVPacketQueue queue;
+    pthread_t th;
+    int running;        /* th was started */
+    unsigned dropped;
+    int overflow;
+    DirectWriter *direct;
+    Segmenter *seg;     /* -R, oc only holds the stream layout then */
+} CaptureOutput;
 
-    pthread_mutex_lock(&q->mutex);
+/*
+ * Time each video packet spends in a stage: from the callback entry until
+ * it is queued, in the queue until the writer picks it up (the last queue
+ * before the writer with -Q) and from there until the muxer has taken it.
+ */
+enum LatencyStage {
+    LATENCY_ENQUEUE,
+    LATENCY_DEQUEUE,
+    LATENCY_WRITE,
+    LATENCY_STAGES,
+};
 
-    if (!q->last_pkt) {
-        q->first_pkt = pkt1;
-    } else {
-        q->last_pkt->next = pkt1;
-    }
+/*
+ * One card and what is recorded from it, -C starts the next one. The
+ * capture callback, the writer and the helper threads of a card only
+ * ever touch its own context.
+ */
+typedef struct CaptureDevice {
+    int card;                   /* -C */
+    int has_card;
+    char label[16];             /* log prefix, empty with a single card */
+    int mode_index;             /* -m */
+    const char *cpu_list;       /* -k */
+    int numa_node;              /* -N */
+    ThreadPlacement placement;  /* its threads and memory, from -k -r -N */
+    int aconnection, vconnection;
+    int serial_fd;
+    BMDPixelFormat pix;
+    enum AVPixelFormat pix_fmt;
 
-    q->last_pkt = pkt1;
-    q->nb_packets++;
-    q->size += pkt1->pkt.size + sizeof(*pkt1);
+    IDeckLink *deckLink;
+    IDeckLinkInput *deckLinkInput;
+    IDeckLinkConfiguration *deckLinkConfiguration;
+    IDeckLinkDisplayModeIterator *displayModeIterator;
+    IDeckLinkDisplayMode *displayMode;
+    FramePool *framePool;
+
+    CaptureOutput outputs[MAX_OUTPUTS];
+    int nb_outputs;
+
+    AVPacketQueue queue;
+    AVPacketQueue *write_queue;
+
+    AVPacketQueue spillqueue;
+    PacketSpill spill;
+    char spill_path[1024];
+    pthread_t spill_th;
+    int spill_running;
+
+    AVPacketQueue encodequeue;
+    VideoEncoder encoder;
+    pthread_t encode_th;
+    int encode_running;
+
+    V210Unpacker unpacker;
+    AVBufferPool *unpack_pool;
+    /* Size of the raw video as seen by the writer */
+    int frame_width, frame_height;
+
+    /* -x, scaled and muxed by its own thread, it never holds back the writer */
+    CaptureOutput proxy;
+    ProxyScaler scaler;
+    pthread_t proxy_th;
+    unsigned proxy_frames;      /* video frames waiting for the proxy thread */
+    int proxy_width, proxy_height;  /* size last handed to the proxy thread */
+
+    /* -S and -w, sampled by the poller and placed by the writer */
+    DataPoller poller;
+    /*
+     * -w: the poller fits the card hardware clock to the monotonic one,
+     * the callback the stream time of the frames to the hardware clock
+     * they arrived at, the writer maps the frame pts through both.
+     */
+    ClockFit hw_fit;
+    ClockFit frame_fit;
+    AVPacketQueue dataqueue;
+    AVPacket data_pending;
+    int64_t data_pending_stamp;
+    int has_data_pending;
+
+    /* -H, the crc of every packet the outputs get */
+    const char *hash_path;
+    HashLog hash;
+
+    /* -O, fed with what the outputs get */
+    const char *replay_pattern;
+    ReplayRing replay;
+    unsigned replay_seen;
+
+    /* The streams of the first output, the others share the same layout */
+    AVStream *video_st, *data_st, *clock_st;
+    AVStream *audio_st[AUDIO_MAP_MAX_STREAMS];
+    int nb_audio_streams;
+    /* Time bases the captured packets are timestamped in */
+    AVRational video_time_base, audio_time_base;
+    /* Of the current input mode, it differs after a format change */
+    int64_t frame_duration;
+
+    int64_t initial_video_pts, initial_audio_pts;
+    int64_t last_video_pts, last_audio_end;
+
+    /*
+     * Set by VideoInputFormatChanged(), the stream time may restart once
+     * the input is reconfigured so the next packets carry on from the
+     * last ones plus the time spent switching, and the next video packet
+     * tells the writer about the new size.
+     */
+    int64_t reconfig_start;
+    int rebase_video;
+    int rebase_audio;
+    int param_change;
+
+    int no_video;
+    int have_picture;
+
+    /* Cached frame no-signal packets reference, see -d */
+    AVBufferRef *filler_buf;
+    /* Last frame with a picture, -d 2 repeats it while the signal is gone */
+    AVBufferRef *freeze_buf;
+    int freeze_size;
+
+    /* Card buffers currently referenced by queued packets (-z) */
+    CardBuffer *video_cards;
+    CardBuffer *audio_cards;
+    unsigned held_video_frames;
+    unsigned held_audio_packets;
+    /* Where the card buffers that are not referenced are copied */
+    CopyPool video_copies;
+    CopyPool audio_copies;
+    CopyPool mapped_audio[AUDIO_MAP_MAX_STREAMS];
+
+    /* writer side */
+    unsigned long nth;
+    int overflow;
+    int reached_max;
+    int64_t last_report;
+
+    /* With -X the counters below are served on a Unix socket */
+    unsigned long frameCount;
+    unsigned int dropped, totaldropped;
+    /* -P 3 callbacks held back and for how long */
+    unsigned long stalls;
+    uint64_t stalled_us;
+    uint64_t written_bytes;
+    uint64_t written_packets;
+    LatencyHistogram latency[LATENCY_STAGES];
+} CaptureDevice;
+
+static CaptureDevice devices[MAX_DEVICES];
+static int nb_devices = 0;
 
-    pthread_cond_signal(&q->cond);
+/*
+ * The writer threads each drain the queues of a share of the cards, -j
+ * sets how many there are. A card is always served by the same thread
+ * since its queues have a single consumer.
+ */
+typedef struct CaptureWriter {
+    pthread_t th;
+    int running;
+    AVPacketQueueNotify notify;
+    CaptureDevice *devices[MAX_DEVICES];
+    int nb_devices;
+} CaptureWriter;
+
+static CaptureWriter writers[MAX_DEVICES];
+static int nb_writers = 0;
+static int running_writers = 0;    /* under sleepMutex */
+
+/* Cards done with -n, the capture stops once all are */
+static int finished_devices = 0;
+
+/* Set before the cards are stopped, releases a -P 3 callback */
+static int stopping = 0;
+/* SIGINT, SIGTERM and SIGHUP received, a second one skips the draining */
+static int exit_signals = 0;
+static int drain_given_up = 0;
+#define DRAIN_POLL 100000
+#define BLOCK_TIMEOUT 2000000
+#define BLOCK_POLL      50000
+
+static MetricsServer metrics;
+static const char *g_metricsSocket = NULL;
 
-    pthread_mutex_unlock(&q->mutex);
-    return 0;
-}
+/*
+ * Every card timestamps its packets from the first frame any card
+ * received, so that recordings started together line up.
+ */
+static int64_t capture_start = 0;
 
-static int avpacket_queue_get(AVPacketQueue *q, AVPacket *pkt, int block)
+static int64_t common_start(int64_t now)
 {
-    AVPacketList *pkt1;
-    int ret;
-
-    pthread_mutex_lock(&q->mutex);
-
-    for (;; ) {
-        pkt1 = q->first_pkt;
-        if (pkt1) {
-            if (pkt1->pkt.data == flush_pkt.data) {
-                ret = 0;
-                break;
-            }
-            q->first_pkt = pkt1->next;
-            if (!q->first_pkt) {
-                q->last_pkt = NULL;
-            }
-            q->nb_packets--;
-            q->size -= pkt1->pkt.size + sizeof(*pkt1);
-            *pkt     = pkt1->pkt;
-            av_free(pkt1);
-            ret = 1;
-            break;
-        } else if (!block) {
-            ret = 0;
-            break;
-        } else {
-            pthread_cond_wait(&q->cond, &q->mutex);
-        }
-    }
-    pthread_mutex_unlock(&q->mutex);
-    return ret;
-}
+    int64_t expected = 0;
 
-static unsigned long long avpacket_queue_size(AVPacketQueue *q)
-{
-    unsigned long long size;
-    pthread_mutex_lock(&q->mutex);
-    size = q->size;
-    pthread_mutex_unlock(&q->mutex);
-    return size;
+    if (__atomic_compare_exchange_n(&capture_start, &expected, now, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return now;
+    return expected;
 }
 
-AVOutputFormat *fmt = NULL;
-AVFormatContext *oc;
-AVStream *audio_st, *video_st, *data_st;
-BMDTimeValue frameRateDuration, frameRateScale;
-
-static AVStream *add_audio_stream(AVFormatContext *oc, enum AVCodecID codec_id)
+static AVStream *add_audio_stream(AVFormatContext *oc, enum AVCodecID codec_id,
+                                  int channels)
 {
     AVCodecParameters *par;
     AVStream *st;
@@ -210,13 +379,16 @@ static AVStream *add_audio_stream(AVFormatContext *oc, enum AVCodecID codec_id)
     /* put sample parameters */
     par->format      = sample_fmt;
     par->sample_rate = 48000;
-    par->channels    = g_audioChannels;
+    par->channels    = channels;
 
     return st;
 }
 
-static AVStream *add_video_stream(AVFormatContext *oc, enum AVCodecID codec_id)
+static AVStream *add_video_stream(CaptureDevice *dev, AVFormatContext *oc,
+                                  enum AVCodecID codec_id)
 {
+    BMDTimeValue frameRateDuration;
+    BMDTimeScale frameRateScale;
     AVCodecParameters *par;
     AVStream *st;
 
@@ -230,26 +402,25 @@ static AVStream *add_video_stream(AVFormatContext *oc, enum AVCodecID codec_id)
     par->codec_id   = codec_id;
     par->codec_type = AVMEDIA_TYPE_VIDEO;
 
-    par->width  = displayMode->GetWidth();
-    par->height = displayMode->GetHeight();
-    par->format = pix_fmt;
-    /* time base: this is the fundamental unit of time (in seconds) in terms
-     * of which frame timestamps are represented. for fixed-fps content,
-     * timebase should be 1/framerate and timestamp increments should be
-     * identically 1.*/
-    displayMode->GetFrameRate(&frameRateDuration, &frameRateScale);
-    st->time_base.den = frameRateScale;
-    st->time_base.num = frameRateDuration;
+    par->width  = dev->displayMode->GetWidth();
+    par->height = dev->displayMode->GetHeight();
+    par->format = dev->pix_fmt;
+    /* the frames step by their duration in the fine capture time base,
+     * the rate of the starting mode is only a hint for the muxer */
+    dev->displayMode->GetFrameRate(&frameRateDuration, &frameRateScale);
+    st->time_base      = dev->video_time_base;
+    st->avg_frame_rate = av_make_q(frameRateScale, frameRateDuration);
 
     if (codec_id == AV_CODEC_ID_V210 || codec_id == AV_CODEC_ID_R210)
         par->bits_per_coded_sample = 10;
     if (codec_id == AV_CODEC_ID_RAWVIDEO)
-        par->codec_tag = avcodec_pix_fmt_to_codec_tag(pix_fmt);
+        par->codec_tag = avcodec_pix_fmt_to_codec_tag(dev->pix_fmt);
 
     return st;
 }
 
-static AVStream *add_data_stream(AVFormatContext *oc, enum AVCodecID codec_id)
+static AVStream *add_data_stream(CaptureDevice *dev, AVFormatContext *oc,
+                                 enum AVCodecID codec_id)
 {
     AVCodecParameters *par;
     AVStream *st;
@@ -264,14 +435,13 @@ static AVStream *add_data_stream(AVFormatContext *oc, enum AVCodecID codec_id)
     par->codec_id = codec_id;
     par->codec_type = AVMEDIA_TYPE_DATA;
 
-    displayMode->GetFrameRate(&frameRateDuration, &frameRateScale);
-    st->time_base.den = frameRateScale;
-    st->time_base.num = frameRateDuration;
+    st->time_base = dev->video_time_base;
 
     return st;
 }
 
-DeckLinkCaptureDelegate::DeckLinkCaptureDelegate() : m_refCount(0)
+DeckLinkCaptureDelegate::DeckLinkCaptureDelegate(struct CaptureDevice *dev)
+    : m_refCount(0), m_dev(dev)
 {
     pthread_mutex_init(&m_mutex, NULL);
 }
@@ -304,26 +474,123 @@ ULONG DeckLinkCaptureDelegate::Release(void)
     return (ULONG)m_refCount;
 }
 
-int64_t initial_video_pts = AV_NOPTS_VALUE;
-int64_t initial_audio_pts = AV_NOPTS_VALUE;
+static void count_dropped(CaptureDevice *dev, unsigned frames)
+{
+    __atomic_add_fetch(&dev->dropped, frames, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dev->totaldropped, frames, __ATOMIC_RELAXED);
+}
+
+static void release_card_buffer(void *opaque, uint8_t *data)
+{
+    CardBuffer *b = (CardBuffer *)opaque;
+    unsigned *held = b->held;
 
-static int no_video = 0;
+    b->obj->Release();
+    /* free before the count drops, below -z a wrapper is always free */
+    __atomic_store_n(&b->in_use, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(held, 1, __ATOMIC_RELAXED);
+}
 
-void write_data_packet(char *data, int size, int64_t pts)
+/*
+ * Let pkt reference the card buffer instead of having it copied into a
+ * CopyPool. The wrappers come from the -z sized array allocated with the
+ * device. If too many buffers are already held the SDK would run out of
+ * frames to capture into, so fall back to copying.
+ */
+static int reference_card_buffer(AVPacket *pkt, IUnknown *obj,
+                                 CardBuffer *cards, unsigned *held)
 {
-    AVPacket pkt;
-    av_init_packet(&pkt);
+    CardBuffer *b = NULL;
 
-    pkt.flags        |= AV_PKT_FLAG_KEY;
-    pkt.stream_index  = data_st->index;
-    pkt.data          = (uint8_t*)data;
-    pkt.size          = size;
-    pkt.dts = pkt.pts = pts;
+    if (__atomic_load_n(held, __ATOMIC_RELAXED) >= g_zeroCopyFrames)
+        return -1;
+
+    for (unsigned i = 0; i < g_zeroCopyFrames && !b; i++)
+        if (!__atomic_exchange_n(&cards[i].in_use, 1, __ATOMIC_ACQUIRE))
+            b = &cards[i];
+    if (!b)
+        return -1;
+    b->obj  = obj;
+    b->held = held;
+
+    pkt->buf = av_buffer_create(pkt->data, pkt->size, release_card_buffer, b,
+                                AV_BUFFER_FLAG_READONLY);
+    if (!pkt->buf) {
+        __atomic_store_n(&b->in_use, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
 
-    avpacket_queue_put(&queue, &pkt);
+    obj->AddRef();
+    __atomic_fetch_add(held, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * A buffer of size bytes from the pool, the padding zeroed. The pool
+ * grows with the largest request, once the capture runs its buffers are
+ * reused.
+ */
+static AVBufferRef *copy_pool_get(CopyPool *c, int size)
+{
+    AVBufferRef *buf;
+
+    if (size > c->size) {
+        av_buffer_pool_uninit(&c->pool);
+        c->pool = av_buffer_pool_init(size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                      av_buffer_alloc);
+        c->size = c->pool ? size : 0;
+    }
+    if (!c->pool || !(buf = av_buffer_pool_get(c->pool)))
+        return NULL;
+
+    memset(buf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return buf;
+}
+
+/* Copy the card buffer pkt points to, the queue only takes references */
+static int copy_card_buffer(CopyPool *c, AVPacket *pkt)
+{
+    AVBufferRef *buf = copy_pool_get(c, pkt->size);
+
+    if (!buf)
+        return -1;
+
+    memcpy(buf->data, pkt->data, pkt->size);
+    pkt->buf  = buf;
+    pkt->data = buf->data;
+    return 0;
 }
 
-void write_audio_packet(IDeckLinkAudioInputPacket *audioFrame)
+/* One packet per -a stream, holding only its channels */
+static void write_mapped_audio(CaptureDevice *dev, const AVPacket *pkt,
+                               const uint8_t *src, int nb_samples)
+{
+    for (int i = 0; i < g_audioMap.nb_streams; i++) {
+        int size = nb_samples * g_audioMap.streams[i].out_stride;
+        AVBufferRef *buf = copy_pool_get(&dev->mapped_audio[i], size);
+        AVPacket out;
+
+        if (!buf)
+            return;
+        av_init_packet(&out);
+        out.buf  = buf;
+        out.data = buf->data;
+        out.size = size;
+        audio_map_apply(&g_audioMap, i, src, out.data, nb_samples);
+
+        out.pts          = pkt->pts;
+        out.dts          = pkt->dts;
+        out.flags        = pkt->flags;
+        out.stream_index = dev->audio_st[i]->index;
+
+        if (avpacket_queue_put(&dev->queue, &out) < 0)
+            av_packet_unref(&out);
+    }
+}
+
+static void write_audio_packet(CaptureDevice *dev,
+                               IDeckLinkAudioInputPacket *audioFrame,
+                               int64_t entry)
 {
     AVPacket pkt;
     BMDTimeValue audio_pts;
@@ -334,36 +601,64 @@ void write_audio_packet(IDeckLinkAudioInputPacket *audioFrame)
     pkt.size = audioFrame->GetSampleFrameCount() *
                g_audioChannels * (g_audioSampleDepth / 8);
     audioFrame->GetBytes(&audioFrameBytes);
-    audioFrame->GetPacketTime(&audio_pts, audio_st->time_base.den);
-    pkt.pts = audio_pts / audio_st->time_base.num;
+    audioFrame->GetPacketTime(&audio_pts, dev->audio_time_base.den);
+    pkt.pts = audio_pts / dev->audio_time_base.num;
 
-    if (initial_audio_pts == AV_NOPTS_VALUE) {
-        initial_audio_pts = pkt.pts;
+    if (dev->initial_audio_pts == AV_NOPTS_VALUE) {
+        dev->initial_audio_pts = pkt.pts -
+            av_rescale_q(entry - common_start(entry), AV_TIME_BASE_Q,
+                         dev->audio_time_base);
     }
 
-    pkt.pts -= initial_audio_pts;
+    pkt.pts -= dev->initial_audio_pts;
+
+    if (dev->rebase_audio) {
+        if (dev->last_audio_end != AV_NOPTS_VALUE) {
+            int64_t expected = dev->last_audio_end +
+                av_rescale_q(av_gettime_relative() - dev->reconfig_start,
+                             AV_TIME_BASE_Q, dev->audio_time_base);
+            dev->initial_audio_pts += pkt.pts - expected;
+            pkt.pts = expected;
+        }
+        dev->rebase_audio = 0;
+    }
+    dev->last_audio_end = pkt.pts + audioFrame->GetSampleFrameCount();
     pkt.dts = pkt.pts;
 
     pkt.flags       |= AV_PKT_FLAG_KEY;
-    pkt.stream_index = audio_st->index;
+
+    if (g_audioMap.nb_streams) {
+        write_mapped_audio(dev, &pkt, (const uint8_t *)audioFrameBytes,
+                           audioFrame->GetSampleFrameCount());
+        return;
+    }
+
+    pkt.stream_index = dev->audio_st[0]->index;
     pkt.data         = (uint8_t *)audioFrameBytes;
 
-    avpacket_queue_put(&queue, &pkt);
+    if (reference_card_buffer(&pkt, audioFrame, dev->audio_cards,
+                              &dev->held_audio_packets) < 0)
+        copy_card_buffer(&dev->audio_copies, &pkt);
+
+    if (avpacket_queue_put(&dev->queue, &pkt) < 0)
+        av_packet_unref(&pkt);
 }
 
-void write_video_packet(IDeckLinkVideoInputFrame *videoFrame,
-                        int64_t pts, int64_t duration)
+static void write_video_packet(CaptureDevice *dev,
+                               IDeckLinkVideoInputFrame *videoFrame,
+                               int64_t pts, int64_t duration, int64_t stamp)
 {
     AVPacket pkt;
     void *frameBytes;
+    uint8_t *sd = NULL;
     time_t cur_time;
 
     av_init_packet(&pkt);
-    if (g_verbose && frameCount % 25 == 0) {
-        unsigned long long qsize = avpacket_queue_size(&queue);
+    if (g_verbose && dev->frameCount % 25 == 0) {
+        unsigned long long qsize = avpacket_queue_size(&dev->queue);
         fprintf(stderr,
-                "Frame received (#%lu) - Valid (%liB) - QSize %f\n",
-                frameCount,
+                "%sFrame received (#%lu) - Valid (%liB) - QSize %f\n",
+                dev->label, dev->frameCount,
                 videoFrame->GetRowBytes() * videoFrame->GetHeight(),
                 (double)qsize / 1024 / 1024);
     }
@@ -371,38 +666,31 @@ void write_video_packet(IDeckLinkVideoInputFrame *videoFrame,
     videoFrame->GetBytes(&frameBytes);
 
     if (videoFrame->GetFlags() & bmdFrameHasNoInputSource) {
-        if (pix_fmt == AV_PIX_FMT_UYVY422 && draw_bars) {
-            unsigned bars[8] = {
-                0xEA80EA80, 0xD292D210, 0xA910A9A5, 0x90229035,
-                0x6ADD6ACA, 0x51EF515A, 0x286D28EF, 0x10801080 };
-            int width  = videoFrame->GetWidth();
-            int height = videoFrame->GetHeight();
-            unsigned *p = (unsigned *)frameBytes;
-
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x += 2)
-                    *p++ = bars[(x * 8) / width];
-            }
-        }
-        if (!no_video) {
+        if (!dev->no_video) {
             time(&cur_time);
-            fprintf(stderr,"%s "
+            fprintf(stderr,"%s %s"
                     "Frame received (#%lu) - No input signal detected "
                     "- Frames dropped %u - Total dropped %u\n",
-                    ctime(&cur_time),
-                    frameCount, ++dropped, ++totaldropped);
+                    ctime(&cur_time), dev->label,
+                    dev->frameCount,
+                    __atomic_add_fetch(&dev->dropped, 1, __ATOMIC_RELAXED),
+                    __atomic_add_fetch(&dev->totaldropped, 1,
+                                       __ATOMIC_RELAXED));
         }
-        no_video = 1;
+        __atomic_store_n(&dev->no_video, 1, __ATOMIC_RELAXED);
     } else {
-        if (no_video) {
+        if (dev->no_video) {
             time(&cur_time);
-            fprintf(stderr, "%s "
+            fprintf(stderr, "%s %s"
                     "Frame received (#%lu) - Input returned "
                     "- Frames dropped %u - Total dropped %u\n",
-                    ctime(&cur_time),
-                    frameCount, ++dropped, ++totaldropped);
+                    ctime(&cur_time), dev->label,
+                    dev->frameCount,
+                    __atomic_add_fetch(&dev->dropped, 1, __ATOMIC_RELAXED),
+                    __atomic_add_fetch(&dev->totaldropped, 1,
+                                       __ATOMIC_RELAXED));
         }
-        no_video = 0;
+        __atomic_store_n(&dev->no_video, 0, __ATOMIC_RELAXED);
     }
 
     pkt.dts = pkt.pts = pts;
@@ -410,20 +698,106 @@ void write_video_packet(IDeckLinkVideoInputFrame *videoFrame,
     pkt.duration = duration;
     //To be made sure it still applies
     pkt.flags       |= AV_PKT_FLAG_KEY;
-    pkt.stream_index = video_st->index;
+    pkt.stream_index = dev->video_st->index;
     pkt.data         = (uint8_t *)frameBytes;
     pkt.size         = videoFrame->GetRowBytes() *
                        videoFrame->GetHeight();
     //fprintf(stderr,"Video Frame size %d ts %d\n", pkt.size, pkt.pts);
-    avpacket_queue_put(&queue, &pkt);
+
+    if (!dev->no_video) {
+        if (reference_card_buffer(&pkt, videoFrame, dev->video_cards,
+                                  &dev->held_video_frames) < 0)
+            copy_card_buffer(&dev->video_copies, &pkt);
+        dev->have_picture = 1;
+    } else if (g_filler == FILLER_FREEZE && dev->have_picture) {
+        /* an empty packet, the writer repeats the last frame */
+        pkt.data = NULL;
+        pkt.size = 0;
+    } else if (dev->filler_buf &&
+               (pkt.buf = av_buffer_ref(dev->filler_buf))) {
+        pkt.data = dev->filler_buf->data;
+        pkt.size = dev->filler_buf->size;
+    } else {
+        copy_card_buffer(&dev->video_copies, &pkt);
+    }
+
+    if (dev->param_change) {
+        sd = av_packet_new_side_data(&pkt, AV_PKT_DATA_PARAM_CHANGE, 12);
+        if (sd) {
+            AV_WL32(sd,     AV_SIDE_DATA_PARAM_CHANGE_DIMENSIONS);
+            AV_WL32(sd + 4, videoFrame->GetWidth());
+            AV_WL32(sd + 8, videoFrame->GetHeight());
+        }
+    }
+
+    if (avpacket_queue_put_stamp(&dev->queue, &pkt, stamp) < 0) {
+        av_packet_unref(&pkt);
+        count_dropped(dev, 1);
+        return;
+    }
+
+    latency_record(&dev->latency[LATENCY_ENQUEUE],
+                   av_gettime_relative() - stamp);
+    if (sd)
+        dev->param_change = 0;
+}
+
+
+/* No syscall, the SDK latched the hardware time as the frame arrived */
+static void fit_frame_clock(CaptureDevice *dev,
+                            IDeckLinkVideoInputFrame *videoFrame, int64_t pts)
+{
+    BMDTimeValue hw, duration;
+    int64_t t;
+
+    if (videoFrame->GetHardwareReferenceTimestamp(AV_TIME_BASE, &hw,
+                                                  &duration) != S_OK)
+        return;
+
+    t = av_rescale_q(pts, dev->video_time_base, AV_TIME_BASE_Q);
+    clock_fit_add(&dev->frame_fit, t, hw);
+    /* the poller thread writes the trace */
+    data_poller_trace_frame(&dev->poller, t, hw);
 }
 
+/*
+ * Hold the card callback until the writer catches up. This stalls the
+ * card on purpose: the SDK delivers audio and format changes on the same
+ * thread, so they wait as well, and the frames it discards meanwhile show
+ * up as gaps in the stream time. Every stall is counted, see -X. The wait
+ * is bounded so a stalled writer cannot keep StopStreams() from
+ * returning, past BLOCK_TIMEOUT the frame is queued over the limit.
+ */
+static void hold_card(CaptureDevice *dev)
+{
+    int64_t start    = av_gettime_relative();
+    int64_t deadline = start + BLOCK_TIMEOUT;
+    int held         = 0;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED) &&
+           av_gettime_relative() < deadline &&
+           avpacket_queue_wait_size_timeout(&dev->queue, g_memoryLimit,
+                                            BLOCK_POLL) > 0)
+        held = 1;
+
+    if (held) {
+        __atomic_add_fetch(&dev->stalls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&dev->stalled_us, av_gettime_relative() - start,
+                           __ATOMIC_RELAXED);
+    }
+}
 
 HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(
     IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
 {
+    CaptureDevice *dev = m_dev;
+    int64_t entry      = av_gettime_relative();
+
+    TRACE_BEGIN("VideoInputFrameArrived");
+    __atomic_add_fetch(&dev->frameCount, 1, __ATOMIC_RELAXED);
 
-    frameCount++;
+    if (g_overflowPolicy == OVERFLOW_BLOCK)
+        hold_card(dev);
 
     // Handle Video Frame
     if (videoFrame) {
@@ -431,47 +805,194 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(
         BMDTimeValue frameDuration;
         int64_t pts;
         videoFrame->GetStreamTime(&frameTime, &frameDuration,
-                                  video_st->time_base.den);
+                                  VIDEO_TIME_SCALE);
+        pts = frameTime;
 
-        pts = frameTime / video_st->time_base.num;
-
-        if (initial_video_pts == AV_NOPTS_VALUE) {
-            initial_video_pts = pts;
+        if (dev->initial_video_pts == AV_NOPTS_VALUE) {
+            dev->initial_video_pts = pts -
+                av_rescale_q(entry - common_start(entry), AV_TIME_BASE_Q,
+                             dev->video_time_base);
         }
 
-        pts -= initial_video_pts;
+        pts -= dev->initial_video_pts;
+
+        if (dev->rebase_video) {
+            if (dev->last_video_pts != AV_NOPTS_VALUE) {
+                int64_t expected = dev->last_video_pts +
+                    FFMAX(frameDuration,
+                          av_rescale_q(av_gettime_relative() -
+                                       dev->reconfig_start,
+                                       AV_TIME_BASE_Q,
+                                       dev->video_time_base));
+                dev->initial_video_pts += pts - expected;
+                pts = expected;
+            }
+            dev->rebase_video = 0;
+            clock_fit_reset(&dev->frame_fit);
+            fprintf(stderr, "%sFirst frame %.1f ms after the format change\n",
+                    dev->label,
+                    (av_gettime_relative() - dev->reconfig_start) / 1000.0);
+        }
 
-        write_video_packet(videoFrame, pts, frameDuration);
+        if (dev->last_video_pts != AV_NOPTS_VALUE) {
+            int64_t gap = pts - dev->last_video_pts;
 
-        if (serial_fd > 0) {
-            char line[8] = {0};
-            int count = read(serial_fd, line, 7);
-            if (count > 0)
-                fprintf(stderr, "read %d bytes: %s  \n", count, line);
-            else line[0] = ' ';
-            write_data_packet(line, 7, pts);
+            /* the frames the SDK skipped, in frames of the current mode */
+            if (gap > frameDuration + frameDuration / 2)
+                count_dropped(dev, (gap - frameDuration / 2) / frameDuration);
+            /* keep the pts strictly increasing, never lose the frame */
+            else if (gap <= 0)
+                pts = dev->last_video_pts + 1;
         }
+        dev->last_video_pts = pts;
 
-        if (wallclock) {
-            int64_t t = av_gettime();
-            char line[20];
-            snprintf(line, sizeof(line), "%" PRId64, t);
-            write_data_packet(line, strlen(line), pts);
-        }
+        write_video_packet(dev, videoFrame, pts, frameDuration, entry);
+
+        if (wallclock)
+            fit_frame_clock(dev, videoFrame, pts);
     }
 
     // Handle Audio Frame
     if (audioFrame)
-        write_audio_packet(audioFrame);
+        write_audio_packet(dev, audioFrame, entry);
 
+    TRACE_END("VideoInputFrameArrived");
 
     return S_OK;
 }
 
+/*
+ * The -B pool is sized for the mode it was made for, swap in a larger one
+ * while the streams are paused. The frames still out keep the old pool
+ * alive until they are released.
+ */
+static int grow_frame_pool(CaptureDevice *dev, IDeckLinkDisplayMode *mode)
+{
+    unsigned size = mode->GetHeight() * get_row_bytes(dev->pix,
+                                                      mode->GetWidth());
+    FramePool *pool;
+    HRESULT result;
+
+    if (size <= dev->framePool->m_frameSize)
+        return 0;
+
+    pool = new FramePool(size, dev->framePool->m_frameCount,
+                         dev->placement.node);
+    if (!pool->IsValid()) {
+        fprintf(stderr, "%sCould not allocate the frame pool\n", dev->label);
+        pool->Release();
+        return -1;
+    }
+    result = dev->deckLinkInput->SetVideoInputFrameMemoryAllocator(pool);
+    if (result != S_OK) {
+        fprintf(stderr, "%sFailed to set the frame allocator - result = %08x\n",
+                dev->label, result);
+        pool->Release();
+        return -1;
+    }
+
+    fprintf(stderr, "%s", dev->label);
+    dev->framePool->PrintStats(stderr);
+    dev->framePool->Release();
+    dev->framePool = pool;
+    fprintf(stderr, "%s", dev->label);
+    pool->PrintStats(stderr);
+
+    return 0;
+}
+
+/*
+ * Whether every output can take frames of another size: a segmented one
+ * starts a new file, nut records the PARAM_CHANGE side data and the
+ * encoder scales back to its own size. Any other muxer would keep the
+ * size of the header it already wrote.
+ */
+static int follows_size_change(CaptureDevice *dev)
+{
+    for (int i = 0; !g_encoder && i < dev->nb_outputs; i++) {
+        CaptureOutput *out = &dev->outputs[i];
+
+        if (!out->seg && strcmp(out->fmt->name, "nut"))
+            return 0;
+    }
+
+    return !dev->proxy.oc || !strcmp(dev->proxy.fmt->name, "nut");
+}
+
 HRESULT DeckLinkCaptureDelegate::VideoInputFormatChanged(
     BMDVideoInputFormatChangedEvents events, IDeckLinkDisplayMode *mode,
     BMDDetectedVideoInputFormatFlags)
 {
+    CaptureDevice *dev = m_dev;
+    int64_t start      = av_gettime_relative();
+    BMDTimeValue duration;
+    BMDTimeScale scale;
+    BMDProbeString name;
+    AVBufferRef *filler;
+    time_t cur_time;
+
+    if (!(events & bmdVideoInputDisplayModeChanged) ||
+        mode->GetDisplayMode() == dev->displayMode->GetDisplayMode())
+        return S_OK;
+
+    if ((mode->GetWidth()  != dev->displayMode->GetWidth() ||
+         mode->GetHeight() != dev->displayMode->GetHeight()) &&
+        !follows_size_change(dev)) {
+        fprintf(stderr, "%sThe input changed to %ldx%ld, the outputs cannot "
+                "record another size, keeping the current format\n",
+                dev->label, mode->GetWidth(), mode->GetHeight());
+        return S_OK;
+    }
+
+    dev->deckLinkInput->PauseStreams();
+    if (dev->framePool && grow_frame_pool(dev, mode) < 0) {
+        fprintf(stderr, "%sCannot capture the new format, keeping the "
+                "current one\n", dev->label);
+        dev->deckLinkInput->StartStreams();
+        return S_OK;
+    }
+    if (dev->deckLinkInput->EnableVideoInput(mode->GetDisplayMode(), dev->pix,
+                                             bmdVideoInputEnableFormatDetection) != S_OK) {
+        fprintf(stderr, "%sFailed to switch the input to the detected format\n",
+                dev->label);
+        dev->deckLinkInput->StartStreams();
+        return S_OK;
+    }
+
+    filler = filler_frame_alloc(dev->pix, mode->GetWidth(), mode->GetHeight(),
+                                g_filler == FILLER_BARS ? FILLER_BARS
+                                                        : FILLER_BLACK);
+    av_buffer_unref(&dev->filler_buf);
+    dev->filler_buf = filler;
+
+    mode->GetFrameRate(&duration, &scale);
+    if (av_rescale(duration, VIDEO_TIME_SCALE, scale) != dev->frame_duration)
+        fprintf(stderr, "%sFrame rate changed to %g fps\n", dev->label,
+                (double)scale / duration);
+    dev->frame_duration = av_rescale(duration, VIDEO_TIME_SCALE, scale);
+
+    mode->AddRef();
+    dev->displayMode->Release();
+    dev->displayMode = mode;
+
+    dev->reconfig_start = start;
+    dev->rebase_video   = 1;
+    dev->rebase_audio   = 1;
+    dev->param_change   = 1;
+    dev->have_picture   = 0;
+
+    dev->deckLinkInput->FlushStreams();
+    dev->deckLinkInput->StartStreams();
+
+    time(&cur_time);
+    if (mode->GetName(&name) == S_OK) {
+        fprintf(stderr, "%s %sInput format changed to %s (%ldx%ld) - "
+                "reconfigured in %.1f ms\n", ctime(&cur_time), dev->label,
+                ToStr(name), mode->GetWidth(), mode->GetHeight(),
+                (av_gettime_relative() - start) / 1000.0);
+        FreeStr(name);
+    }
+
     return S_OK;
 }
 
@@ -484,6 +1005,8 @@ int usage(int status)
 
     fprintf(stderr,
             "Usage: bmdcapture -m <mode id> [OPTIONS]\n"
+            "       bmdcapture -C <num> -m <mode id> -f <file> "
+            "-C <num> -m <mode id> -f <file> ...\n"
             "\n"
             "    -m <mode id>:\n"
             );
@@ -531,13 +1054,58 @@ int usage(int status)
         stderr,
         "    -v                   Be verbose (report each 25 frames)\n"
         "    -f <filename>        Filename raw video will be written to\n"
+        "                         may be repeated to record several outputs,\n"
+        "                         the -F and -o before it apply to it\n"
         "    -F <format>          Define the file format to be used\n"
         "    -c <channels>        Audio Channels (2, 8 or 16 - default is 2)\n"
         "    -s <depth>           Audio Sample Depth (16 or 32 - default is 16)\n"
+        "    -a <map>             Keep only these channels, in this order, e.g.\n"
+        "                         0,1/4@-6,5@-6: a stream of channels 0 and 1 and\n"
+        "                         one of channels 4 and 5 attenuated by 6 dB\n"
         "    -p <pixel>           PixelFormat (yuv8, yuv10, rgb10)\n"
         "    -n <frames>          Number of frames to capture (default is unlimited)\n"
         "    -M <memlimit>        Maximum queue size in GB (default is 1 GB)\n"
-        "    -C <num>             number of card to be used\n"
+        "    -P <policy>[:<n>]    What to do when the queue exceeds the limit:\n"
+        "                         0: abort the capture (default)\n"
+        "                         1: drop the oldest video, keep audio\n"
+        "                         2: drop every <n>th video frame (default 2)\n"
+        "                         3: block until the writer catches up,\n"
+        "                            holding the card callback, and its\n"
+        "                            audio and format changes, up to 2 s\n"
+        "    -Q <file>[:<size>]   Spill to <file> (size in GB, default 16) once\n"
+        "                         the queue exceeds the limit, on exit it is\n"
+        "                         written out unless interrupted again\n"
+        "    -u <threads>         Unpack 10 bit video to planar yuv422p10\n"
+        "                         using <threads> threads\n"
+        "    -b                   Benchmark the -u unpacker and exit\n"
+        "    -x <filename>        Also record a downscaled 8 bit proxy of the card\n"
+        "    -y <factor>[:<threads>] Proxy size divisor (default 2) and the\n"
+        "                         threads scaling it (default 2)\n"
+        "    -H <filename>        Log the crc32c of every packet recorded\n"
+        "    -O <pattern>         Keep the last seconds of the card in memory and\n"
+        "                         dump them to <pattern> (with a %%d) on SIGUSR2,\n"
+        "                         without -f nothing else is recorded\n"
+        "    -I <secs>[:<post>]   Seconds kept for -O (default 10) and seconds\n"
+        "                         of the live input added to each dump\n"
+        "    -e <encoder>         Encode the video with <encoder> before muxing\n"
+        "    -E <optionstring>    Encoder options (e.g. threads=8:level=3)\n"
+        "    -z <frames>          Queue up to <frames> card buffers by reference\n"
+        "                         instead of copying them (default is 0)\n"
+        "    -B <frames>          Capture into a preallocated, locked pool of\n"
+        "                         <frames> buffers (plus the -z ones)\n"
+        "    -N <node>            NUMA node of the card: the frame pool, queues and\n"
+        "                         threads use its memory and, without -k, its cpus\n"
+        "    -k <cpus>            Run the threads of the card on <cpus> (e.g. 0-3,8)\n"
+        "    -r <policy>[:<prio>] Scheduling of the capture threads: fifo, rr or other\n"
+        "    -R <limit>[,...]     Split the outputs named with a %%d in segments of\n"
+        "                         <n>s seconds, <n>f frames or <n>M/<n>G bytes\n"
+        "    -W <MB>[:<depth>]    Write file outputs with O_DIRECT in <MB> buffers,\n"
+        "                         <depth> writes in flight (default 4)\n"
+        "    -C <num>             number of card to be used, repeat it to capture\n"
+        "                         several cards, the -m, -p, -A, -V, -S, -N, -k,\n"
+        "                         -F, -o, -f, -x, -H and -O after it apply to that card\n"
+        "    -j <threads>         Writer threads shared by the cards\n"
+        "                         (default is one per card)\n"
         "    -S <serial_device>   data input serial\n"
         "    -A <audio-in>        Audio input:\n"
         "                         1: Analog (RCA or XLR)\n"
@@ -552,9 +1120,17 @@ int usage(int status)
         "                         6: S-Video\n"
         "    -o <optionstring>    AVFormat options\n"
         "    -w                   Embed a wallclock stream\n"
-        "    -d <filler>          When the source is offline draw a black frame or color bars\n"
+        "    -l                   Store the wallclock as 64 bit little endian\n"
+        "                         microseconds instead of text (implies -w)\n"
+        "    -K <file>            Record the -w clock samples to <file>\n"
+        "    -q <file>            Refit the samples recorded with -K, print the\n"
+        "                         monotonic time of each frame and exit\n"
+        "    -X <socket>          Serve live metrics on the Unix socket <socket>\n"
+        "    -T <file>            Write a Chrome trace to <file> on exit or SIGUSR1\n"
+        "    -d <filler>          What to record while the source is offline\n"
         "                         0: black frame\n"
-        "                         1: color bars\n"
+        "                         1: color bars (default)\n"
+        "                         2: the last frame received\n"
         "Capture video and audio to a file.\n"
         "Raw video and audio can be sent to a pipe to avconv or vlc e.g.:\n"
         "\n"
@@ -564,81 +1140,1669 @@ int usage(int status)
     exit(status);
 }
 
-static void *push_packet(void *ctx)
+/* Log when the queue crosses the memory limit, writer thread only */
+static void report_overflow(CaptureDevice *dev, int over)
+{
+    time_t cur_time;
+
+    if (over == dev->overflow)
+        return;
+    dev->overflow = over;
+
+    time(&cur_time);
+    fprintf(stderr, "%s %s"
+            "Queue %s the memory limit - Policy %s "
+            "- Frames dropped %u - Total dropped %u\n",
+            ctime(&cur_time), dev->label,
+            over ? "exceeded" : "back under",
+            overflow_policy_names[g_overflowPolicy],
+            __atomic_load_n(&dev->dropped, __ATOMIC_RELAXED),
+            __atomic_load_n(&dev->totaldropped, __ATOMIC_RELAXED));
+}
+
+/* since is when the writer dequeued a video packet, 0 otherwise */
+static void write_output_packet(CaptureOutput *out, AVPacket *pkt,
+                                int64_t since)
+{
+    CaptureDevice *dev = out->dev;
+    AVStream *st       = out->oc->streams[pkt->stream_index];
+
+    __atomic_add_fetch(&dev->written_bytes, pkt->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dev->written_packets, 1, __ATOMIC_RELAXED);
+
+    TRACE_BEGIN("av_interleaved_write_frame");
+    if (out->seg) {
+        segmenter_write(out->seg, pkt);
+    } else {
+        av_packet_rescale_ts(pkt, st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO ?
+                                  dev->audio_time_base : dev->video_time_base,
+                             st->time_base);
+        av_interleaved_write_frame(out->oc, pkt);
+    }
+    TRACE_END("av_interleaved_write_frame");
+
+    if (since)
+        latency_record(&dev->latency[LATENCY_WRITE],
+                       av_gettime_relative() - since);
+}
+
+static void *output_thread(void *ctx)
 {
-    AVFormatContext *s = (AVFormatContext *)ctx;
+    CaptureOutput *out = (CaptureOutput *)ctx;
     AVPacket pkt;
-    int ret;
 
-    while (avpacket_queue_get(&queue, &pkt, 1)) {
-        av_interleaved_write_frame(s, &pkt);
-        if ((g_maxFrames > 0 && frameCount >= g_maxFrames) ||
-            avpacket_queue_size(&queue) > g_memoryLimit) {
-            pthread_cond_signal(&sleepCond);
+    while (avpacket_queue_get(&out->queue, &pkt, 1))
+        write_output_packet(out, &pkt, avpacket_queue_last_stamp(&out->queue));
+
+    return NULL;
+}
+
+/*
+ * Set the scaler up again for the size a video packet announces, only
+ * the proxy thread uses it. The proxy keeps its header like the full
+ * size outputs do, the packets carry the new size.
+ */
+static int resize_proxy(CaptureDevice *dev, int width, int height)
+{
+    ProxyScaler *s         = &dev->scaler;
+    AVCodecParameters *par = dev->proxy.oc->streams[0]->codecpar;
+    unsigned long frames   = s->frames;
+    int64_t cpu_time       = s->cpu_time;
+
+    proxy_scaler_close(s);
+    if (proxy_scaler_init(s, dev->pix == bmdFormat10BitYUV, width, height,
+                          get_row_bytes(dev->pix, width), g_proxyFactor,
+                          g_proxyThreads) < 0) {
+        fprintf(stderr, "%sCould not set up the proxy scaler for %dx%d, "
+                "the proxy gets no video\n", dev->label, width, height);
+        return -1;
+    }
+    s->frames   = frames;
+    s->cpu_time = cpu_time;
+    par->width  = s->width;
+    par->height = s->height;
+
+    return 0;
+}
+
+/* Scale the queued frames down and mux them with the audio */
+static void *proxy_thread(void *ctx)
+{
+    CaptureDevice *dev = (CaptureDevice *)ctx;
+    ProxyScaler *s     = &dev->scaler;
+    int scaling        = 1;
+    AVPacket pkt, out;
+
+    while (avpacket_queue_get(&dev->proxy.queue, &pkt, 1)) {
+        int width, height, resized = 0;
+
+        if (pkt.stream_index != dev->video_st->index) {
+            write_output_packet(&dev->proxy, &pkt, 0);
+            continue;
         }
+
+        if (packet_dimensions(&pkt, &width, &height) &&
+            (width != s->src_width || height != s->src_height)) {
+            scaling = resize_proxy(dev, width, height) == 0;
+            resized = scaling;
+        }
+
+        TRACE_BEGIN("proxy_scale_frame");
+        if (scaling && pkt.size >= s->src_stride * s->src_height &&
+            av_new_packet(&out, s->stride * s->height) == 0) {
+            proxy_scale_frame(s, pkt.data, out.data);
+            if (resized)
+                packet_set_dimensions(&out, s->width, s->height);
+            out.stream_index = pkt.stream_index;
+            out.pts          = pkt.pts;
+            out.dts          = pkt.dts;
+            out.duration     = pkt.duration;
+            out.flags        = pkt.flags;
+            write_output_packet(&dev->proxy, &out, 0);
+        } else {
+            __atomic_add_fetch(&dev->proxy.dropped, 1, __ATOMIC_RELAXED);
+        }
+        TRACE_END("proxy_scale_frame");
+
+        av_packet_unref(&pkt);
+        __atomic_sub_fetch(&dev->proxy_frames, 1, __ATOMIC_SEQ_CST);
     }
 
     return NULL;
 }
 
-static void exit_handler(int sig)
+/*
+ * Hand a reference of pkt to every output. An output that falls more
+ * than -M behind loses video, never audio, and does not hold back the
+ * others.
+ */
+static void fan_out_packet(CaptureDevice *dev, AVPacket *pkt, int64_t stamp)
 {
-   pthread_cond_signal(&sleepCond);
+    time_t cur_time;
+
+    for (int i = 0; i < dev->nb_outputs; i++) {
+        CaptureOutput *out = &dev->outputs[i];
+        int over = pkt->stream_index == dev->video_st->index &&
+                   avpacket_queue_size(&out->queue) > g_memoryLimit;
+        AVPacket ref;
+
+        if (over != out->overflow) {
+            time(&cur_time);
+            fprintf(stderr, "%s Output %s is %s - Frames dropped %u\n",
+                    ctime(&cur_time), out->filename,
+                    over ? "falling behind" : "back in time",
+                    out->dropped);
+            out->overflow = over;
+        }
+
+        if (over || av_packet_ref(&ref, pkt) < 0) {
+            out->dropped++;
+            continue;
+        }
+        if (avpacket_queue_put_stamp(&out->queue, &ref, stamp) < 0) {
+            av_packet_unref(&ref);
+            out->dropped++;
+        }
+    }
+
+    av_packet_unref(pkt);
 }
 
-static void set_signal()
+static void deliver_stamped_packet(CaptureDevice *dev, AVPacket *pkt,
+                                   int64_t stamp)
 {
-    signal(SIGINT , exit_handler);
-    signal(SIGTERM, exit_handler);
-    signal(SIGHUP,  exit_handler);
+    if (dev->hash.f) {
+        TRACE_BEGIN("hash_log_write");
+        if (hash_log_write(&dev->hash, pkt->stream_index, pkt->pts,
+                           pkt->flags, pkt->data, pkt->size) < 0 &&
+            dev->hash.failed == 1)
+            fprintf(stderr, "%sCannot write to %s, the hashes are incomplete\n",
+                    dev->label, dev->hash_path);
+        TRACE_END("hash_log_write");
+    }
+
+    if (dev->replay_pattern) {
+        unsigned requests = __atomic_load_n(&replay_requests, __ATOMIC_RELAXED);
+
+        if (requests != dev->replay_seen) {
+            dev->replay_seen = requests;
+            replay_ring_dump(&dev->replay);
+        }
+        replay_ring_push(&dev->replay, pkt);
+    }
+
+    if (dev->nb_outputs == 1)
+        write_output_packet(&dev->outputs[0], pkt, stamp);
+    else
+        fan_out_packet(dev, pkt, stamp);
 }
 
-int main(int argc, char *argv[])
+/* The encoder output is not stamped, it is delayed by the encoder anyway */
+static void deliver_packet(void *opaque, AVPacket *pkt)
 {
-    IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
-    DeckLinkCaptureDelegate *delegate;
-    BMDDisplayMode selectedDisplayMode = bmdModeNTSC;
-    int displayModeCount               = 0;
-    int exitStatus                     = 1;
-    int aconnection                    = 0, vconnection = 0, camera = 0, i = 0;
-    int ch;
-    AVDictionary *opts = NULL;
-    BMDPixelFormat pix = bmdFormat8BitYUV;
-    HRESULT result;
-    pthread_t th;
+    deliver_stamped_packet((CaptureDevice *)opaque, pkt, 0);
+}
 
-    pthread_mutex_init(&sleepMutex, NULL);
-    pthread_cond_init(&sleepCond, NULL);
-    av_register_all();
+enum DeviceMetric {
+    METRIC_FRAMES,
+    METRIC_DROPPED,
+    METRIC_TOTALDROPPED,
+    METRIC_QUEUE_BYTES,
+    METRIC_QUEUE_PACKETS,
+    METRIC_WRITTEN_BYTES,
+    METRIC_WRITTEN_PACKETS,
+    METRIC_NO_SIGNAL,
+    METRIC_STALLS,
+    METRIC_STALLED,
+    METRIC_DIRECT_BYTES,
+    METRIC_DIRECT_INFLIGHT,
+    METRIC_DIRECT_P99,
+    METRIC_NB,
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    const char *type;
+} device_metrics[METRIC_NB] = {
+    { "bmdcapture_frames_captured_total",
+      "Video frames received from the card", "counter" },
+    { "bmdcapture_frames_dropped_total",
+      "Video frames dropped", "counter" },
+    { "bmdcapture_frames_totaldropped_total",
+      "Video frames dropped over the whole capture", "counter" },
+    { "bmdcapture_queue_bytes",
+      "Bytes waiting to be written", "gauge" },
+    { "bmdcapture_queue_packets",
+      "Packets waiting to be written", "gauge" },
+    { "bmdcapture_written_bytes_total",
+      "Bytes handed to the muxers", "counter" },
+    { "bmdcapture_written_packets_total",
+      "Packets handed to the muxers", "counter" },
+    { "bmdcapture_no_signal",
+      "1 while the input has no signal", "gauge" },
+    { "bmdcapture_card_stalls_total",
+      "Card callbacks held back by -P 3", "counter" },
+    { "bmdcapture_card_stalled_seconds_total",
+      "Time the card callbacks were held back by -P 3", "counter" },
+    { "bmdcapture_direct_written_bytes_total",
+      "Bytes written to disk with O_DIRECT", "counter" },
+    { "bmdcapture_direct_writes_inflight",
+      "Disk writes submitted and not completed", "gauge" },
+    { "bmdcapture_direct_write_latency_p99_us",
+      "99th percentile disk write latency", "gauge" },
+};
+
+static void device_metrics_values(CaptureDevice *dev, double *v)
+{
+    unsigned long long bytes = avpacket_queue_size(&dev->queue);
+    unsigned packets         = avpacket_queue_nb_packets(&dev->queue);
+    uint64_t direct_bytes    = 0;
+    int inflight             = 0;
+    int64_t p99              = 0;
+
+    if (g_spillFile) {
+        bytes   += avpacket_queue_size(&dev->spillqueue) +
+                   packet_spill_depth(&dev->spill);
+        packets += avpacket_queue_nb_packets(&dev->spillqueue) +
+                   packet_spill_nb_packets(&dev->spill);
+    }
+    if (g_encoder) {
+        bytes   += avpacket_queue_size(&dev->encodequeue);
+        packets += avpacket_queue_nb_packets(&dev->encodequeue);
+    }
 
-    if (!deckLinkIterator) {
-        fprintf(stderr,
-                "This application requires the DeckLink drivers installed.\n");
-        goto bail;
+    for (int i = 0; i < dev->nb_outputs; i++) {
+        DirectWriter *w = dev->outputs[i].direct;
+        Segmenter *seg  = dev->outputs[i].seg;
+
+        /* the segment files come and go, they add up in the segmenter */
+        if (seg) {
+            DirectStats *st = &seg->direct_stats;
+
+            direct_bytes += __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+            inflight     += __atomic_load_n(&st->inflight, __ATOMIC_RELAXED);
+            p99           = FFMAX(p99, latency_percentile(&st->latency, 99));
+            continue;
+        }
+        if (!w)
+            continue;
+        direct_bytes += __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+        inflight     += __atomic_load_n(&w->inflight, __ATOMIC_RELAXED);
+        p99           = FFMAX(p99, latency_percentile(&w->latency, 99));
     }
 
-    // Parse command line options
-    while ((ch = getopt(argc, argv, "?hvc:s:f:a:m:n:p:M:F:C:A:V:o:w:S:d:")) != -1) {
-        switch (ch) {
-        case 'v':
-            g_verbose = true;
-            break;
-        case 'm':
-            g_videoModeIndex = atoi(optarg);
-            break;
-        case 'c':
-            g_audioChannels = atoi(optarg);
-            if (g_audioChannels != 2 &&
-                g_audioChannels != 8 &&
-                g_audioChannels != 16) {
-                fprintf(
-                    stderr,
-                    "Invalid argument: Audio Channels must be either 2, 8 or 16\n");
-                goto bail;
-            }
-            break;
-        case 's':
-            g_audioSampleDepth = atoi(optarg);
+    v[METRIC_FRAMES]       = __atomic_load_n(&dev->frameCount, __ATOMIC_RELAXED);
+    v[METRIC_DROPPED]      = __atomic_load_n(&dev->dropped, __ATOMIC_RELAXED);
+    v[METRIC_TOTALDROPPED] = __atomic_load_n(&dev->totaldropped,
+                                             __ATOMIC_RELAXED);
+    v[METRIC_QUEUE_BYTES]     = bytes;
+    v[METRIC_QUEUE_PACKETS]   = packets;
+    v[METRIC_WRITTEN_BYTES]   = __atomic_load_n(&dev->written_bytes,
+                                                __ATOMIC_RELAXED);
+    v[METRIC_WRITTEN_PACKETS] = __atomic_load_n(&dev->written_packets,
+                                                __ATOMIC_RELAXED);
+    v[METRIC_NO_SIGNAL]       = __atomic_load_n(&dev->no_video,
+                                                __ATOMIC_RELAXED);
+    v[METRIC_STALLS]          = __atomic_load_n(&dev->stalls,
+                                                __ATOMIC_RELAXED);
+    v[METRIC_STALLED]         = __atomic_load_n(&dev->stalled_us,
+                                                __ATOMIC_RELAXED) / 1e6;
+    v[METRIC_DIRECT_BYTES]    = direct_bytes;
+    v[METRIC_DIRECT_INFLIGHT] = inflight;
+    v[METRIC_DIRECT_P99]      = p99;
+}
+
+/* Each metric has a sample per card, labelled with its -C number */
+static void write_metrics(FILE *f)
+{
+    double values[MAX_DEVICES][METRIC_NB];
+    int nb_metrics = g_directBuffer ? METRIC_NB : METRIC_DIRECT_BYTES;
+    char labels[32];
+
+    for (int i = 0; i < nb_devices; i++)
+        device_metrics_values(&devices[i], values[i]);
+
+    for (int m = 0; m < nb_metrics; m++) {
+        metrics_describe(f, device_metrics[m].name, device_metrics[m].help,
+                         device_metrics[m].type);
+        for (int i = 0; i < nb_devices; i++) {
+            snprintf(labels, sizeof(labels), "card=\"%d\"", devices[i].card);
+            metrics_sample(f, device_metrics[m].name, labels, values[i][m]);
+        }
+    }
+}
+
+static void report_latency(CaptureDevice *dev)
+{
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        fprintf(stderr, "%s", dev->label);
+        latency_report(&dev->latency[i], stderr);
+    }
+}
+
+static void report_direct(CaptureDevice *dev)
+{
+    for (int i = 0; i < dev->nb_outputs; i++)
+        if (dev->outputs[i].direct)
+            direct_writer_report(dev->outputs[i].direct, stderr);
+}
+
+/* Bytes waiting to be written, the encoder input counts too */
+static unsigned long long queued_size(CaptureDevice *dev)
+{
+    unsigned long long size = avpacket_queue_size(&dev->queue);
+
+    if (g_encoder)
+        size += avpacket_queue_size(&dev->encodequeue);
+
+    return size;
+}
+
+static void report_encoder(CaptureDevice *dev)
+{
+    fprintf(stderr, "%sEncoder queue %u packets (%.1f MB) - ", dev->label,
+            avpacket_queue_nb_packets(&dev->encodequeue),
+            (double)avpacket_queue_size(&dev->encodequeue) / 1024 / 1024);
+    video_encoder_report(&dev->encoder, stderr);
+}
+
+/* Encode the video, audio and data pass through in order */
+static void *encode_packets(void *ctx)
+{
+    CaptureDevice *dev = (CaptureDevice *)ctx;
+    AVPacket pkt;
+    int64_t last_report = av_gettime_relative();
+
+    while (avpacket_queue_get(&dev->encodequeue, &pkt, 1)) {
+        if (pkt.stream_index != dev->video_st->index) {
+            deliver_packet(dev, &pkt);
+            continue;
+        }
+
+        if (video_encoder_encode(&dev->encoder, &pkt, deliver_packet) < 0)
+            count_dropped(dev, 1);
+
+        if (g_verbose && av_gettime_relative() - last_report > 5000000) {
+            report_encoder(dev);
+            last_report = av_gettime_relative();
+        }
+    }
+
+    video_encoder_flush(&dev->encoder, deliver_packet);
+    report_encoder(dev);
+
+    return NULL;
+}
+
+static int unpack_pool_init(CaptureDevice *dev, int width, int height)
+{
+    av_buffer_pool_uninit(&dev->unpack_pool);
+    dev->unpack_pool = av_buffer_pool_init(
+        av_image_get_buffer_size(AV_PIX_FMT_YUV422P10, width, height, 1),
+        av_buffer_alloc);
+
+    return dev->unpack_pool ? 0 : -1;
+}
+
+/*
+ * Follow a size change signalled by the capture callback. A segmented
+ * output starts a new segment, the others are nut, which records the
+ * AV_PKT_DATA_PARAM_CHANGE side data, see follows_size_change().
+ */
+static int apply_param_change(CaptureDevice *dev, AVPacket *pkt)
+{
+    int width, height;
+
+    if (!packet_dimensions(pkt, &width, &height) ||
+        (width == dev->frame_width && height == dev->frame_height))
+        return 0;
+
+    fprintf(stderr, "%sVideo size changed from %dx%d to %dx%d\n", dev->label,
+            dev->frame_width, dev->frame_height, width, height);
+    dev->frame_width  = width;
+    dev->frame_height = height;
+
+    if (g_unpackThreads && unpack_pool_init(dev, width, height) < 0)
+        return -1;
+
+    /* the encoder scales back to the size it was opened with */
+    if (!g_encoder) {
+        for (int i = 0; i < dev->nb_outputs; i++) {
+            CaptureOutput *out     = &dev->outputs[i];
+            AVCodecParameters *par = out->oc->streams[0]->codecpar;
+
+            if (out->seg) {
+                segmenter_set_video_size(out->seg, width, height);
+                continue;
+            }
+            par->width  = width;
+            par->height = height;
+        }
+        if (dev->replay_pattern)
+            replay_ring_set_video_size(&dev->replay, width, height);
+    }
+
+    return 0;
+}
+
+/* Whether buf references a card frame, see reference_card_buffer() */
+static int is_card_buffer(CaptureDevice *dev, AVBufferRef *buf)
+{
+    CardBuffer *b = (CardBuffer *)av_buffer_get_opaque(buf);
+
+    for (unsigned i = 0; dev->video_cards && i < g_zeroCopyFrames; i++)
+        if (b == &dev->video_cards[i])
+            return 1;
+    return 0;
+}
+
+static int freeze_video_packet(CaptureDevice *dev, AVPacket *pkt)
+{
+    AVBufferRef *buf;
+
+    if (pkt->size) {
+        av_buffer_unref(&dev->freeze_buf);
+        dev->freeze_buf  = av_buffer_ref(pkt->buf);
+        dev->freeze_size = pkt->size;
+        return 0;
+    }
+
+    if (!dev->freeze_buf)
+        return -1;
+
+    /* the signal is gone, do not keep a card frame out of the SDK pool
+     * for the whole outage */
+    if (is_card_buffer(dev, dev->freeze_buf)) {
+        buf = av_buffer_alloc(dev->freeze_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!buf)
+            return -1;
+        memcpy(buf->data, dev->freeze_buf->data, dev->freeze_size);
+        memset(buf->data + dev->freeze_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        av_buffer_unref(&dev->freeze_buf);
+        dev->freeze_buf = buf;
+    }
+
+    if (!(buf = av_buffer_ref(dev->freeze_buf)))
+        return -1;
+
+    av_buffer_unref(&pkt->buf);
+    pkt->buf  = buf;
+    pkt->data = buf->data;
+    pkt->size = dev->freeze_size;
+
+    return 0;
+}
+
+/* Swap the v210 payload of pkt for a pooled yuv422p10 frame */
+static int unpack_video_packet(CaptureDevice *dev, AVPacket *pkt)
+{
+    int width      = dev->frame_width;
+    int height     = dev->frame_height;
+    int src_stride = get_row_bytes(bmdFormat10BitYUV, width);
+    uint8_t *data[4];
+    int linesize[4];
+    AVBufferRef *buf;
+
+    if (pkt->size < src_stride * height)
+        return -1;
+
+    buf = av_buffer_pool_get(dev->unpack_pool);
+    if (!buf)
+        return -1;
+
+    av_image_fill_arrays(data, linesize, buf->data, AV_PIX_FMT_YUV422P10,
+                         width, height, 1);
+    v210_unpack_frame(&dev->unpacker, pkt->data, src_stride, data, linesize,
+                      width, height);
+
+    av_buffer_unref(&pkt->buf);
+    pkt->buf  = buf;
+    pkt->data = buf->data;
+    pkt->size = buf->size;
+
+    return 0;
+}
+
+/*
+ * Queue a reference of pkt for the proxy thread. Video is skipped while
+ * PROXY_QUEUE_FRAMES frames are still waiting, the full size outputs
+ * never wait. The first frame queued after a size change carries it, the
+ * proxy thread sets its scaler up again from it.
+ */
+static void feed_proxy(CaptureDevice *dev, const AVPacket *pkt)
+{
+    int video   = pkt->stream_index == dev->video_st->index;
+    int resized = 0;
+    int width, height;
+    AVPacket ref;
+
+    if ((dev->data_st && pkt->stream_index == dev->data_st->index) ||
+        (dev->clock_st && pkt->stream_index == dev->clock_st->index))
+        return;
+
+    /* the writer is the only one adding, the proxy thread takes away */
+    if (video) {
+        if (!pkt->size ||
+            __atomic_load_n(&dev->proxy_frames, __ATOMIC_SEQ_CST) >=
+            PROXY_QUEUE_FRAMES) {
+            __atomic_add_fetch(&dev->proxy.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_add_fetch(&dev->proxy_frames, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (av_packet_ref(&ref, pkt) == 0) {
+        if (video && (dev->frame_width  != dev->proxy_width ||
+                      dev->frame_height != dev->proxy_height))
+            resized = packet_dimensions(&ref, &width, &height) ||
+                      packet_set_dimensions(&ref, dev->frame_width,
+                                            dev->frame_height) == 0;
+        if (avpacket_queue_put(&dev->proxy.queue, &ref) == 0) {
+            if (resized) {
+                dev->proxy_width  = dev->frame_width;
+                dev->proxy_height = dev->frame_height;
+            }
+            return;
+        }
+        av_packet_unref(&ref);
+    }
+
+    if (video)
+        __atomic_sub_fetch(&dev->proxy_frames, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&dev->proxy.dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void route_packet(CaptureDevice *dev, AVPacket *pkt, int64_t stamp)
+{
+    if (!g_encoder) {
+        deliver_stamped_packet(dev, pkt, stamp);
+    } else if (avpacket_queue_put(&dev->encodequeue, pkt) < 0) {
+        av_packet_unref(pkt);
+        count_dropped(dev, 1);
+    }
+}
+
+/*
+ * The wallclock of a frame from the clock fits, free of the scheduling
+ * jitter of the callback, or from the callback entry until they settle.
+ */
+static int64_t frame_wallclock(CaptureDevice *dev, int64_t pts, int64_t stamp)
+{
+    int64_t t = av_rescale_q(pts, dev->video_time_base, AV_TIME_BASE_Q);
+    int64_t hw, mono;
+
+    if (clock_fit_map(&dev->frame_fit, t, &hw) == 0 &&
+        clock_fit_map(&dev->hw_fit, hw, &mono) == 0)
+        return data_poller_wallclock(&dev->poller, mono);
+
+    return stamp ? data_poller_wallclock(&dev->poller, stamp) : av_gettime();
+}
+
+/*
+ * Give the serial messages that arrived closer to this frame than to the
+ * next one, and the wallclock at its capture, the pts of the frame.
+ * Without a stamp the messages pending go out with it.
+ */
+static void attach_data(CaptureDevice *dev, int64_t pts, int64_t duration,
+                        int64_t stamp)
+{
+    int64_t limit = stamp + av_rescale_q(duration, dev->video_time_base,
+                                         AV_TIME_BASE_Q) / 2;
+    AVPacket *msg = &dev->data_pending;
+    AVPacket pkt;
+
+    while (dev->data_st) {
+        if (!dev->has_data_pending) {
+            if (!avpacket_queue_get(&dev->dataqueue, msg, 0))
+                break;
+            dev->data_pending_stamp = avpacket_queue_last_stamp(&dev->dataqueue);
+            dev->has_data_pending   = 1;
+        }
+        if (stamp && dev->data_pending_stamp > limit)
+            break;
+
+        msg->pts = msg->dts = pts;
+        dev->has_data_pending = 0;
+        route_packet(dev, msg, 0);
+    }
+
+    if (dev->clock_st) {
+        int64_t t = frame_wallclock(dev, pts, stamp);
+        char line[21];
+        int size = g_binaryClock ? 8 : snprintf(line, sizeof(line),
+                                                "%" PRId64, t);
+
+        if (av_new_packet(&pkt, size) < 0)
+            return;
+        if (g_binaryClock)
+            AV_WL64(pkt.data, t);
+        else
+            memcpy(pkt.data, line, size);
+        pkt.stream_index = dev->clock_st->index;
+        pkt.flags       |= AV_PKT_FLAG_KEY;
+        pkt.pts = pkt.dts = pts;
+        route_packet(dev, &pkt, 0);
+    }
+}
+
+/* Hand one packet of dev to its outputs or its encoder */
+static void write_packet(CaptureDevice *dev, AVPacket *pkt)
+{
+    int64_t stamp    = avpacket_queue_last_stamp(dev->write_queue);
+    int64_t dequeued = stamp ? av_gettime_relative() : 0;
+    int over         = queued_size(dev) > g_memoryLimit;
+    int video        = pkt->stream_index == dev->video_st->index;
+
+    if (stamp)
+        latency_record(&dev->latency[LATENCY_DEQUEUE],
+                       dequeued -
+                       avpacket_queue_last_queued(dev->write_queue));
+
+    if (g_verbose && av_gettime_relative() - dev->last_report > 5000000) {
+        report_latency(dev);
+        report_direct(dev);
+        dev->last_report = av_gettime_relative();
+    }
+
+    report_overflow(dev, over);
+
+    if (video && (dev->data_st || dev->clock_st))
+        attach_data(dev, pkt->pts, pkt->duration, stamp);
+
+    if ((over && video &&
+         (g_overflowPolicy == OVERFLOW_DROP_OLDEST ||
+          (g_overflowPolicy == OVERFLOW_DROP_NTH &&
+           ++dev->nth % g_dropInterval == 0))) ||
+        (video && apply_param_change(dev, pkt) < 0) ||
+        (video && g_filler == FILLER_FREEZE &&
+         freeze_video_packet(dev, pkt) < 0)) {
+        av_packet_unref(pkt);
+        count_dropped(dev, 1);
+        return;
+    }
+
+    if (dev->proxy.oc)
+        feed_proxy(dev, pkt);
+
+    if (video && g_unpackThreads && unpack_video_packet(dev, pkt) < 0) {
+        av_packet_unref(pkt);
+        count_dropped(dev, 1);
+        return;
+    }
+
+    route_packet(dev, pkt, dequeued);
+
+    if (g_maxFrames > 0 && !dev->reached_max &&
+        __atomic_load_n(&dev->frameCount, __ATOMIC_RELAXED) >= g_maxFrames) {
+        dev->reached_max = 1;
+        if (__atomic_add_fetch(&finished_devices, 1, __ATOMIC_SEQ_CST) ==
+            nb_devices)
+            pthread_cond_signal(&sleepCond);
+    }
+    if (g_overflowPolicy == OVERFLOW_ABORT && queued_size(dev) > g_memoryLimit)
+        pthread_cond_signal(&sleepCond);
+}
+
+/*
+ * Drain the queues of the cards assigned to w. Every put on them bumps
+ * the writer notify word, so the thread only sleeps once a pass over all
+ * of them came back empty and nothing was queued since it started.
+ */
+static void *writer_thread(void *ctx)
+{
+    CaptureWriter *w = (CaptureWriter *)ctx;
+    AVPacket pkt;
+
+    for (;;) {
+        unsigned seq = avpacket_queue_notify_seq(&w->notify);
+        int active   = 0;
+        int written  = 0;
+
+        for (int i = 0; i < w->nb_devices; i++) {
+            CaptureDevice *dev = w->devices[i];
+
+            /* drained, or what is left is discarded by avpacket_queue_end() */
+            if (avpacket_queue_aborted(dev->write_queue) ||
+                avpacket_queue_finished(dev->write_queue))
+                continue;
+            active++;
+
+            if (avpacket_queue_get(dev->write_queue, &pkt, 0)) {
+                write_packet(dev, &pkt);
+                written++;
+            }
+        }
+
+        if (!active)
+            break;
+        if (!written)
+            avpacket_queue_notify_wait(&w->notify, seq);
+    }
+
+    /* main() waits for the last one while draining */
+    pthread_mutex_lock(&sleepMutex);
+    running_writers--;
+    pthread_cond_signal(&sleepCond);
+    pthread_mutex_unlock(&sleepMutex);
+
+    return NULL;
+}
+
+/* Move spilled packets back to memory while there is room, in order */
+static int unspill_packets(CaptureDevice *dev)
+{
+    AVPacket pkt;
+    int64_t stamp;
+    int ret;
+
+    while (packet_spill_depth(&dev->spill) &&
+           avpacket_queue_size(&dev->spillqueue) < g_memoryLimit &&
+           avpacket_queue_nb_packets(&dev->spillqueue) <
+           dev->spillqueue.nb_slots) {
+        ret = packet_spill_read(&dev->spill, &pkt, &stamp);
+        if (ret <= 0)
+            return ret;
+        avpacket_queue_put_stamp(&dev->spillqueue, &pkt, stamp);
+    }
+
+    return 0;
+}
+
+/*
+ * The card is stopped and its queue drained, hand the rest of the spill
+ * file to the writer as it makes room, then let it finish.
+ */
+static void drain_spill(CaptureDevice *dev)
+{
+    while (packet_spill_depth(&dev->spill)) {
+        if (avpacket_queue_wait_budget(&dev->spillqueue, g_memoryLimit / 2,
+                                       INT64_MAX) < 0)
+            return;
+        if (unspill_packets(dev) < 0) {
+            fprintf(stderr, "%sCannot read the spill file back, %u packets "
+                    "lost\n", dev->label, packet_spill_nb_packets(&dev->spill));
+            count_dropped(dev, packet_spill_nb_packets(&dev->spill));
+            break;
+        }
+    }
+    avpacket_queue_finish(&dev->spillqueue);
+}
+
+/*
+ * Forward captured packets to the writer, once the writer is more than
+ * -M behind append them to the spill file instead and feed them back as
+ * it catches up. Nothing is forwarded directly while the spill is not
+ * empty so the order is kept.
+ */
+static void *spill_packets(void *ctx)
+{
+    CaptureDevice *dev = (CaptureDevice *)ctx;
+    AVPacket pkt;
+    int64_t last_report = av_gettime_relative();
+    int full = 0;
+    int ret;
+
+    for (;;) {
+        unspill_packets(dev);
+
+        /* poll while spilling, the writer draining is not signalled */
+        ret = avpacket_queue_get_timeout(&dev->queue, &pkt,
+                                         packet_spill_depth(&dev->spill) ?
+                                         10000 : -1);
+        if (ret < 0) {
+            if (!avpacket_queue_aborted(&dev->queue))
+                drain_spill(dev);
+            break;
+        }
+
+        if (ret > 0) {
+            int64_t stamp = avpacket_queue_last_stamp(&dev->queue);
+
+            if (!packet_spill_depth(&dev->spill) &&
+                avpacket_queue_size(&dev->spillqueue) + pkt.size <=
+                g_memoryLimit &&
+                avpacket_queue_put_stamp(&dev->spillqueue, &pkt, stamp) == 0) {
+                full = 0;
+            } else {
+                while ((ret = packet_spill_write(&dev->spill, &pkt,
+                                                 stamp)) == -1) {
+                    if (!full++)
+                        fprintf(stderr, "%sSpill file full, waiting for the "
+                                "writer\n", dev->label);
+                    if (avpacket_queue_wait_size(&dev->spillqueue,
+                                                 g_memoryLimit / 2) < 0)
+                        break;
+                    unspill_packets(dev);
+                }
+                if (ret == -2)
+                    fprintf(stderr, "%sDropping a %d bytes packet, larger "
+                            "than the spill file\n", dev->label, pkt.size);
+                /* -1 once the spill queue is aborted while the file is full */
+                if (ret < 0) {
+                    dev->spill.dropped++;
+                    count_dropped(dev, 1);
+                }
+                av_packet_unref(&pkt);
+            }
+        }
+
+        if ((packet_spill_depth(&dev->spill) || g_verbose) &&
+            av_gettime_relative() - last_report > 5000000) {
+            fprintf(stderr, "%s", dev->label);
+            packet_spill_report(&dev->spill, stderr);
+            last_report = av_gettime_relative();
+        }
+    }
+
+    fprintf(stderr, "%s", dev->label);
+    packet_spill_report(&dev->spill, stderr);
+    return NULL;
+}
+
+static void exit_handler(int sig)
+{
+   __atomic_add_fetch(&exit_signals, 1, __ATOMIC_SEQ_CST);
+   pthread_cond_signal(&sleepCond);
+}
+
+/*
+ * Let the writers empty the queues and the spill files of the stopped
+ * cards, a signal meanwhile gives up on what is left and returns -1.
+ */
+static int wait_for_writers(void)
+{
+    int signals = __atomic_load_n(&exit_signals, __ATOMIC_SEQ_CST);
+    int64_t last_report = av_gettime_relative();
+    struct timespec ts;
+    int ret;
+
+    pthread_mutex_lock(&sleepMutex);
+    while (running_writers &&
+           __atomic_load_n(&exit_signals, __ATOMIC_SEQ_CST) == signals) {
+        if (av_gettime_relative() - last_report > 5000000) {
+            fprintf(stderr, "Writing out the queued packets, interrupt again "
+                    "to drop them\n");
+            last_report = av_gettime_relative();
+        }
+        /* the signal handler cannot take the mutex, do not rely on it */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += DRAIN_POLL * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&sleepCond, &sleepMutex, &ts);
+    }
+    ret = running_writers ? -1 : 0;
+    pthread_mutex_unlock(&sleepMutex);
+
+    return ret;
+}
+
+/* Let the thread consuming q write out the rest, unless given up on */
+static void end_queue_input(AVPacketQueue *q)
+{
+    if (drain_given_up)
+        avpacket_queue_abort(q);
+    else
+        avpacket_queue_finish(q);
+}
+
+/* Picked up by the thread delivering the packets of each card */
+static void replay_handler(int sig)
+{
+    __atomic_add_fetch(&replay_requests, 1, __ATOMIC_RELAXED);
+}
+
+static void set_signal()
+{
+    signal(SIGINT , exit_handler);
+    signal(SIGTERM, exit_handler);
+    signal(SIGHUP,  exit_handler);
+    signal(SIGUSR2, replay_handler);
+}
+
+static void device_init(CaptureDevice *dev, int index)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->mode_index        = -1;
+    dev->serial_fd         = -1;
+    dev->pix               = bmdFormat8BitYUV;
+    dev->pix_fmt           = AV_PIX_FMT_UYVY422;
+    dev->write_queue       = &dev->queue;
+    dev->initial_video_pts = AV_NOPTS_VALUE;
+    dev->initial_audio_pts = AV_NOPTS_VALUE;
+    dev->last_video_pts    = AV_NOPTS_VALUE;
+    dev->last_audio_end    = AV_NOPTS_VALUE;
+    dev->card              = index;
+    dev->numa_node         = -1;
+    thread_placement_init(&dev->placement);
+    clock_fit_init(&dev->hw_fit, 50);
+    clock_fit_init(&dev->frame_fit, 50);
+}
+
+/* -F and -o given after the last -f of a card still apply to it */
+static void finish_outputs(CaptureDevice *dev, AVOutputFormat **fmt,
+                           AVDictionary **opts)
+{
+    CaptureOutput *last;
+
+    if (!dev->nb_outputs)
+        return;
+    last = &dev->outputs[dev->nb_outputs - 1];
+
+    if (*fmt && !last->fmt) {
+        last->fmt = *fmt;
+        *fmt      = NULL;
+    }
+    if (*opts && !last->opts) {
+        last->opts = *opts;
+        *opts      = NULL;
+    }
+}
+
+/* Find the -C card, configure its inputs and enable the -m mode */
+static int open_device(CaptureDevice *dev)
+{
+    IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
+    IDeckLinkConfiguration *deckLinkConfiguration;
+    DeckLinkCaptureDelegate *delegate;
+    BMDDisplayMode selectedDisplayMode = bmdModeNTSC;
+    int displayModeCount               = 0;
+    HRESULT result;
+    int i = 0;
+
+    if (!deckLinkIterator) {
+        fprintf(stderr,
+                "This application requires the DeckLink drivers installed.\n");
+        return -1;
+    }
+
+    while ((result = deckLinkIterator->Next(&dev->deckLink)) == S_OK &&
+           i++ < dev->card)
+        dev->deckLink->Release();
+    deckLinkIterator->Release();
+
+    if (result != S_OK) {
+        dev->deckLink = NULL;
+        fprintf(stderr, "%sNo DeckLink PCI cards found.\n", dev->label);
+        return -1;
+    }
+
+    if (dev->deckLink->QueryInterface(IID_IDeckLinkInput,
+                                      (void **)&dev->deckLinkInput) != S_OK) {
+        dev->deckLinkInput = NULL;
+        return -1;
+    }
+
+    result = dev->deckLink->QueryInterface(IID_IDeckLinkConfiguration,
+                                           (void **)&dev->deckLinkConfiguration);
+    if (result != S_OK) {
+        dev->deckLinkConfiguration = NULL;
+        fprintf(
+            stderr,
+            "%sCould not obtain the IDeckLinkConfiguration interface - result = %08x\n",
+            dev->label, result);
+        return -1;
+    }
+    deckLinkConfiguration = dev->deckLinkConfiguration;
+
+    result = S_OK;
+    switch (dev->aconnection) {
+    case 1:
+        result = DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
+        break;
+    case 2:
+        result = DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
+        break;
+    case 3:
+        result = DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAESEBU);
+        break;
+    default:
+        // do not change it
+        break;
+    }
+    if (result != S_OK) {
+        fprintf(stderr, "%sFailed to set audio input - result = %08x\n",
+                dev->label, result);
+        return -1;
+    }
+
+    result = S_OK;
+    switch (dev->vconnection) {
+    case 1:
+        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComposite);
+        break;
+    case 2:
+        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComponent);
+        break;
+    case 3:
+        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionHDMI);
+        break;
+    case 4:
+        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionSDI);
+        break;
+    case 5:
+        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionOpticalSDI);
+        break;
+    case 6:
+        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionSVideo);
+        break;
+    default:
+        // do not change it
+        break;
+    }
+    if (result != S_OK) {
+        fprintf(stderr, "%sFailed to set video input - result %08x\n",
+                dev->label, result);
+        return -1;
+    }
+
+    delegate = new DeckLinkCaptureDelegate(dev);
+    dev->deckLinkInput->SetCallback(delegate);
+
+    // Obtain an IDeckLinkDisplayModeIterator to enumerate the display modes supported on output
+    result = dev->deckLinkInput->GetDisplayModeIterator(&dev->displayModeIterator);
+    if (result != S_OK) {
+        dev->displayModeIterator = NULL;
+        fprintf(
+            stderr,
+            "%sCould not obtain the video output display mode iterator - result = %08x\n",
+            dev->label, result);
+        return -1;
+    }
+
+    while (dev->displayModeIterator->Next(&dev->displayMode) == S_OK) {
+        if (dev->mode_index == displayModeCount) {
+            selectedDisplayMode = dev->displayMode->GetDisplayMode();
+            break;
+        }
+        displayModeCount++;
+        dev->displayMode->Release();
+        dev->displayMode = NULL;
+    }
+
+    if (!dev->displayMode) {
+        fprintf(stderr, "%sUnknown video mode %d\n", dev->label,
+                dev->mode_index);
+        return -1;
+    }
+
+    if (g_zeroCopyFrames) {
+        size_t size = g_zeroCopyFrames * sizeof(CardBuffer);
+
+        dev->video_cards = (CardBuffer *)av_mallocz(size);
+        dev->audio_cards = (CardBuffer *)av_mallocz(size);
+        if (!dev->video_cards || !dev->audio_cards) {
+            fprintf(stderr, "%sCould not allocate the -z buffers\n",
+                    dev->label);
+            return -1;
+        }
+    }
+
+    if (g_poolFrames > 0) {
+        dev->framePool = new FramePool(dev->displayMode->GetHeight() *
+                                       get_row_bytes(dev->pix,
+                                                     dev->displayMode->GetWidth()),
+                                       g_poolFrames + g_zeroCopyFrames,
+                                       dev->placement.node);
+        if (!dev->framePool->IsValid()) {
+            fprintf(stderr, "%sCould not allocate the frame pool\n",
+                    dev->label);
+            return -1;
+        }
+        result = dev->deckLinkInput->SetVideoInputFrameMemoryAllocator(dev->framePool);
+        if (result != S_OK) {
+            fprintf(stderr, "%sFailed to set the frame allocator - result = %08x\n",
+                    dev->label, result);
+            return -1;
+        }
+        dev->framePool->PrintStats(stderr);
+    }
+
+    result = dev->deckLinkInput->EnableVideoInput(selectedDisplayMode, dev->pix,
+                                                  bmdVideoInputEnableFormatDetection);
+    if (result != S_OK) {
+        fprintf(stderr, "%sInput format detection not available, "
+                "staying on the -m mode\n", dev->label);
+        result = dev->deckLinkInput->EnableVideoInput(selectedDisplayMode,
+                                                      dev->pix,
+                                                      bmdVideoInputFlagDefault);
+    }
+    if (result != S_OK) {
+        fprintf(stderr,
+                "%sFailed to enable video input. Is another application using "
+                "the card?\n", dev->label);
+        return -1;
+    }
+
+    result = dev->deckLinkInput->EnableAudioInput(bmdAudioSampleRate48kHz,
+                                                  g_audioSampleDepth,
+                                                  g_audioChannels);
+    if (result != S_OK) {
+        fprintf(stderr,
+                "%sFailed to enable audio input. Is another application using "
+                "the card?\n", dev->label);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* -x: the layout of the outputs, with the video scaled down to 8 bit uyvy */
+static int setup_proxy(CaptureDevice *dev, enum AVCodecID audio_codec)
+{
+    CaptureOutput *out = &dev->proxy;
+    ProxyScaler *s     = &dev->scaler;
+    int width          = dev->displayMode->GetWidth();
+    int height         = dev->displayMode->GetHeight();
+    AVCodecParameters *par;
+    AVFormatContext *oc;
+
+    if (proxy_scaler_init(s, dev->pix == bmdFormat10BitYUV, width, height,
+                          get_row_bytes(dev->pix, width), g_proxyFactor,
+                          g_proxyThreads) < 0) {
+        fprintf(stderr, "%sCould not set up the proxy scaler\n", dev->label);
+        return -1;
+    }
+    dev->proxy_width  = width;
+    dev->proxy_height = height;
+
+    oc = out->oc = avformat_alloc_context();
+    oc->oformat  = out->fmt;
+    snprintf(oc->filename, sizeof(oc->filename), "%s", out->filename);
+
+    par = add_video_stream(dev, oc, AV_CODEC_ID_RAWVIDEO)->codecpar;
+    par->width     = s->width;
+    par->height    = s->height;
+    par->format    = AV_PIX_FMT_UYVY422;
+    par->codec_tag = avcodec_pix_fmt_to_codec_tag(AV_PIX_FMT_UYVY422);
+    par->bits_per_coded_sample = 0;
+    for (int j = 0; j < dev->nb_audio_streams; j++)
+        add_audio_stream(oc, audio_codec,
+                         g_audioMap.nb_streams ?
+                         g_audioMap.streams[j].nb_channels : g_audioChannels);
+
+    if (output_open(oc, oc->filename, &out->opts, g_directBuffer,
+                    g_directDepth, &out->direct, NULL) < 0)
+        return -1;
+
+    if (avpacket_queue_init(&out->queue, 4 * PROXY_QUEUE_FRAMES * 4) < 0) {
+        fprintf(stderr, "Could not allocate the packet queue\n");
+        return -1;
+    }
+
+    fprintf(stderr, "%sProxy %dx%d to %s\n", dev->label, s->width, s->height,
+            out->filename);
+
+    return 0;
+}
+
+/* Set up the outputs, queues and helpers of a card opened by open_device() */
+static int setup_device(CaptureDevice *dev)
+{
+    enum AVCodecID video_codec = AV_CODEC_ID_RAWVIDEO, audio_codec;
+    BMDTimeValue frameRateDuration;
+    BMDTimeScale frameRateScale;
+    int global_header = 0;
+    int nb_segmented  = 0;
+    unsigned nb_slots;
+
+    switch (dev->pix) {
+    case bmdFormat8BitARGB:
+    case bmdFormat8BitYUV:
+        video_codec = AV_CODEC_ID_RAWVIDEO;
+        break;
+    case bmdFormat10BitYUV:
+        video_codec = g_unpackThreads ? AV_CODEC_ID_RAWVIDEO : AV_CODEC_ID_V210;
+        break;
+    case bmdFormat10BitRGB:
+        video_codec = AV_CODEC_ID_R210;
+        break;
+    }
+
+    audio_codec = (sample_fmt == AV_SAMPLE_FMT_S16 ? AV_CODEC_ID_PCM_S16LE : AV_CODEC_ID_PCM_S32LE);
+
+    dev->displayMode->GetFrameRate(&frameRateDuration, &frameRateScale);
+    dev->video_time_base = av_make_q(1, VIDEO_TIME_SCALE);
+    dev->frame_duration  = av_rescale(frameRateDuration, VIDEO_TIME_SCALE,
+                                      frameRateScale);
+    dev->audio_time_base = av_make_q(1, 48000);
+
+    dev->nb_audio_streams = g_audioMap.nb_streams ? g_audioMap.nb_streams : 1;
+
+    latency_init(&dev->latency[LATENCY_ENQUEUE], "enqueue");
+    latency_init(&dev->latency[LATENCY_DEQUEUE], "dequeue");
+    latency_init(&dev->latency[LATENCY_WRITE],   "write");
+
+    for (int i = 0; i < dev->nb_outputs; i++) {
+        CaptureOutput *out = &dev->outputs[i];
+        AVFormatContext *oc;
+
+        oc = out->oc = avformat_alloc_context();
+        oc->oformat  = out->fmt;
+
+        snprintf(oc->filename, sizeof(oc->filename), "%s", out->filename);
+
+        dev->video_st = add_video_stream(dev, oc, video_codec);
+        for (int j = 0; j < dev->nb_audio_streams; j++)
+            dev->audio_st[j] = add_audio_stream(oc, audio_codec,
+                                                g_audioMap.nb_streams ?
+                                                g_audioMap.streams[j].nb_channels :
+                                                g_audioChannels);
+
+        if (dev->serial_fd >= 0)
+            dev->data_st = add_data_stream(dev, oc, AV_CODEC_ID_TEXT);
+        if (wallclock)
+            dev->clock_st = add_data_stream(dev, oc, g_binaryClock ?
+                                                     AV_CODEC_ID_BIN_DATA :
+                                                     AV_CODEC_ID_TEXT);
+
+        if (out->fmt->flags & AVFMT_GLOBALHEADER)
+            global_header = 1;
+    }
+
+    if (g_encoder) {
+        AVDictionary *opts = NULL;
+        int ret;
+
+        av_dict_copy(&opts, g_encoderOpts, 0);
+        ret = video_encoder_open(&dev->encoder, g_encoder, &opts,
+                                 dev->outputs[0].oc->streams[0]->codecpar,
+                                 dev->video_time_base,
+                                 av_make_q(frameRateScale, frameRateDuration),
+                                 global_header);
+        av_dict_free(&opts);
+        if (ret < 0)
+            return -1;
+        dev->encoder.stream_index = 0;
+        dev->encoder.opaque       = dev;
+        for (int i = 0; i < dev->nb_outputs; i++) {
+            AVStream *st = dev->outputs[i].oc->streams[0];
+            avcodec_parameters_from_context(st->codecpar, dev->encoder.enc);
+            st->time_base = dev->video_time_base;
+        }
+    }
+
+    for (int i = 0; i < dev->nb_outputs; i++) {
+        CaptureOutput *out = &dev->outputs[i];
+        AVFormatContext *oc = out->oc;
+
+        if (g_segment && segment_pattern_valid(oc->filename)) {
+            out->seg = (Segmenter *)av_mallocz(sizeof(*out->seg));
+            if (!out->seg ||
+                segmenter_open(out->seg, oc, out->filename, out->opts,
+                               &g_segmentRule, g_directBuffer, g_directDepth,
+                               dev->video_time_base, dev->audio_time_base) < 0)
+                exit(1);
+            nb_segmented++;
+        } else if (output_open(oc, oc->filename, &out->opts, g_directBuffer,
+                               g_directDepth, &out->direct, NULL) < 0) {
+            exit(1);
+        }
+    }
+    if (g_segment && !nb_segmented) {
+        fprintf(stderr, "%s-R needs an output name with a %%d for the "
+                "segment number\n", dev->label);
+        return -1;
+    }
+
+    /* All the outputs have the same streams, in the same order */
+    dev->video_st = dev->outputs[0].oc->streams[0];
+    for (int j = 0; j < dev->nb_audio_streams; j++)
+        dev->audio_st[j] = dev->outputs[0].oc->streams[1 + j];
+    if (dev->data_st)
+        dev->data_st = dev->outputs[0].oc->streams[1 + dev->nb_audio_streams];
+    if (dev->clock_st)
+        dev->clock_st = dev->outputs[0].oc->streams[1 + dev->nb_audio_streams +
+                                                    !!dev->data_st];
+
+    if ((dev->data_st || dev->clock_st) &&
+        avpacket_queue_init(&dev->dataqueue, 256) < 0) {
+        fprintf(stderr, "Could not allocate the packet queue\n");
+        return -1;
+    }
+
+    /* Enough slots for a video, audio and data packet per frame that
+     * fits in the memory limit, so the ring never fills before -M does. */
+    nb_slots = 3 * (g_memoryLimit / (dev->displayMode->GetWidth() *
+                                     dev->displayMode->GetHeight() * 2) + 1);
+    if (avpacket_queue_init(&dev->queue, nb_slots) < 0) {
+        fprintf(stderr, "Could not allocate the packet queue\n");
+        return -1;
+    }
+
+    if (g_encoder && avpacket_queue_init(&dev->encodequeue, nb_slots) < 0) {
+        fprintf(stderr, "Could not allocate the packet queue\n");
+        return -1;
+    }
+
+    for (int i = 0; dev->nb_outputs > 1 && i < dev->nb_outputs; i++) {
+        if (avpacket_queue_init(&dev->outputs[i].queue, nb_slots) < 0) {
+            fprintf(stderr, "Could not allocate the packet queue\n");
+            return -1;
+        }
+    }
+
+    dev->filler_buf = filler_frame_alloc(dev->pix,
+                                         dev->displayMode->GetWidth(),
+                                         dev->displayMode->GetHeight(),
+                                         g_filler == FILLER_BARS ? FILLER_BARS
+                                                                 : FILLER_BLACK);
+    if (!dev->filler_buf) {
+        fprintf(stderr, "Could not allocate the filler frame\n");
+        return -1;
+    }
+
+    dev->frame_width  = dev->displayMode->GetWidth();
+    dev->frame_height = dev->displayMode->GetHeight();
+
+    if (g_unpackThreads) {
+        if (unpack_pool_init(dev, dev->frame_width, dev->frame_height) < 0 ||
+            v210_unpacker_init(&dev->unpacker, g_unpackThreads) < 0) {
+            fprintf(stderr, "Could not set up the v210 unpacker\n");
+            return -1;
+        }
+    }
+
+    if (dev->proxy.filename && setup_proxy(dev, audio_codec) < 0)
+        return -1;
+
+    if (dev->hash_path && hash_log_open(&dev->hash, dev->hash_path) < 0)
+        return -1;
+
+    if (dev->replay_pattern &&
+        replay_ring_open(&dev->replay, dev->outputs[0].oc, dev->replay_pattern,
+                         g_replayWindow, g_replayPostRoll,
+                         dev->video_time_base, dev->audio_time_base,
+                         dev->video_st->avg_frame_rate,
+                         g_zeroCopyFrames > 0) < 0)
+        return -1;
+
+    if (g_spillFile) {
+        /* the first card keeps the -Q name, the others get a suffix */
+        if (dev == &devices[0])
+            snprintf(dev->spill_path, sizeof(dev->spill_path), "%s",
+                     g_spillFile);
+        else
+            snprintf(dev->spill_path, sizeof(dev->spill_path), "%s.%d",
+                     g_spillFile, dev->card);
+        if (avpacket_queue_init(&dev->spillqueue, nb_slots) < 0 ||
+            packet_spill_open(&dev->spill, dev->spill_path, g_spillSize) < 0) {
+            fprintf(stderr, "Could not set up the spill file\n");
+            return -1;
+        }
+        dev->write_queue = &dev->spillqueue;
+    }
+
+    dev->last_report = av_gettime_relative();
+
+    return 0;
+}
+
+static int read_hardware_clock(void *opaque, int64_t *hw)
+{
+    CaptureDevice *dev = (CaptureDevice *)opaque;
+    BMDTimeValue t, in_frame, per_frame;
+
+    if (dev->deckLinkInput->GetHardwareReferenceClock(AV_TIME_BASE, &t,
+                                                      &in_frame,
+                                                      &per_frame) != S_OK)
+        return -1;
+    *hw = t;
+
+    return 0;
+}
+
+/*
+ * Start the helper threads of a card, its writer is started separately.
+ * What did start is flagged, stop_device() only joins those on failure.
+ */
+static int start_device(CaptureDevice *dev)
+{
+    for (int i = 0; dev->nb_outputs > 1 && i < dev->nb_outputs; i++) {
+        if (thread_create(&dev->outputs[i].th, &dev->placement,
+                          output_thread, &dev->outputs[i]))
+            return -1;
+        dev->outputs[i].running = 1;
+    }
+
+    if (g_encoder) {
+        if (thread_create(&dev->encode_th, &dev->placement,
+                          encode_packets, dev))
+            return -1;
+        dev->encode_running = 1;
+    }
+
+    if (g_spillFile) {
+        if (thread_create(&dev->spill_th, &dev->placement,
+                          spill_packets, dev))
+            return -1;
+        dev->spill_running = 1;
+    }
+
+    if (dev->proxy.oc) {
+        if (thread_create(&dev->proxy_th, &dev->placement,
+                          proxy_thread, dev))
+            return -1;
+        dev->proxy.running = 1;
+    }
+
+    if (dev->data_st || dev->clock_st) {
+        DataClock clock = { 0 };
+
+        if (dev->clock_st) {
+            clock.read   = read_hardware_clock;
+            clock.opaque = dev;
+            clock.fit    = &dev->hw_fit;
+            clock.trace  = g_clockTrace;
+            clock.card   = dev->card;
+        }
+        if (data_poller_start(&dev->poller, dev->serial_fd,
+                              dev->data_st ? dev->data_st->index : -1,
+                              &dev->dataqueue, &clock, &dev->placement) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Wind down the helper threads once the writers are gone */
+static void stop_device(CaptureDevice *dev)
+{
+    avpacket_queue_end(&dev->queue);
+    av_buffer_unref(&dev->freeze_buf);
+    if (g_unpackThreads) {
+        fprintf(stderr, "%s", dev->label);
+        v210_unpacker_report(&dev->unpacker, stderr);
+        v210_unpacker_close(&dev->unpacker);
+    }
+    if (dev->stalls)
+        fprintf(stderr, "%sCard held back %lu times, %.1f s in all\n",
+                dev->label, dev->stalls, dev->stalled_us / 1e6);
+    /* the encoder empties its queue and flushes into the outputs first */
+    if (g_encoder) {
+        end_queue_input(&dev->encodequeue);
+        if (dev->encode_running)
+            pthread_join(dev->encode_th, NULL);
+        avpacket_queue_end(&dev->encodequeue);
+        video_encoder_close(&dev->encoder);
+    }
+    for (int i = 0; dev->nb_outputs > 1 && i < dev->nb_outputs; i++) {
+        CaptureOutput *out = &dev->outputs[i];
+
+        end_queue_input(&out->queue);
+        if (out->running)
+            pthread_join(out->th, NULL);
+        avpacket_queue_end(&out->queue);
+        if (out->dropped)
+            fprintf(stderr, "Output %s dropped %u packets\n",
+                    out->filename, out->dropped);
+    }
+    if (dev->proxy.oc) {
+        end_queue_input(&dev->proxy.queue);
+        if (dev->proxy.running)
+            pthread_join(dev->proxy_th, NULL);
+        avpacket_queue_end(&dev->proxy.queue);
+        fprintf(stderr, "%s", dev->label);
+        proxy_scaler_report(&dev->scaler, stderr);
+        if (dev->proxy.dropped)
+            fprintf(stderr, "%sProxy %s dropped %u packets\n", dev->label,
+                    dev->proxy.filename, dev->proxy.dropped);
+        proxy_scaler_close(&dev->scaler);
+    }
+    if (dev->poller.running) {
+        data_poller_stop(&dev->poller);
+        fprintf(stderr, "%s", dev->label);
+        data_poller_report(&dev->poller, stderr);
+    }
+    if (dev->clock_st) {
+        fprintf(stderr, "%s", dev->label);
+        clock_fit_report(&dev->hw_fit, "Hardware clock", stderr);
+        fprintf(stderr, "%s", dev->label);
+        clock_fit_report(&dev->frame_fit, "Input clock", stderr);
+        if (dev->poller.trace_dropped)
+            fprintf(stderr, "%sClock trace: %lu frame samples dropped\n",
+                    dev->label, dev->poller.trace_dropped);
+    }
+    if (dev->data_st || dev->clock_st) {
+        if (dev->has_data_pending)
+            av_packet_unref(&dev->data_pending);
+        avpacket_queue_end(&dev->dataqueue);
+    }
+    if (dev->hash.f) {
+        fprintf(stderr, "%s", dev->label);
+        hash_log_report(&dev->hash, stderr);
+    }
+    report_latency(dev);
+    if (g_spillFile) {
+        avpacket_queue_end(&dev->spillqueue);
+        packet_spill_close(&dev->spill);
+    }
+}
+
+/*
+ * The muxer may still hold packets referencing card buffers, flush it
+ * before releasing the input.
+ */
+static int close_device(CaptureDevice *dev)
+{
+    int ret = 0;
+
+    for (int i = 0; i < dev->nb_outputs; i++) {
+        CaptureOutput *out  = &dev->outputs[i];
+        AVFormatContext *oc = out->oc;
+
+        if (oc == NULL)
+            continue;
+        if (out->seg) {
+            segmenter_close(out->seg);
+            av_freep(&out->seg);
+            continue;
+        }
+        if (g_verbose && out->direct)
+            direct_writer_report(out->direct, stderr);
+        if (output_close(oc, &out->direct) < 0)
+            ret = -1;
+    }
+    if (dev->proxy.oc) {
+        if (g_verbose && dev->proxy.direct)
+            direct_writer_report(dev->proxy.direct, stderr);
+        if (output_close(dev->proxy.oc, &dev->proxy.direct) < 0)
+            ret = -1;
+    }
+    if (dev->replay_pattern)
+        replay_ring_close(&dev->replay);
+    clock_fit_close(&dev->hw_fit);
+    clock_fit_close(&dev->frame_fit);
+    if (hash_log_close(&dev->hash) < 0) {
+        fprintf(stderr, "%sCould not write %s\n", dev->label, dev->hash_path);
+        ret = -1;
+    }
+    av_buffer_pool_uninit(&dev->unpack_pool);
+    av_buffer_pool_uninit(&dev->video_copies.pool);
+    av_buffer_pool_uninit(&dev->audio_copies.pool);
+    for (int i = 0; i < AUDIO_MAP_MAX_STREAMS; i++)
+        av_buffer_pool_uninit(&dev->mapped_audio[i].pool);
+    av_buffer_unref(&dev->filler_buf);
+
+    if (dev->displayMode != NULL) {
+        dev->displayMode->Release();
+        dev->displayMode = NULL;
+    }
+
+    if (dev->displayModeIterator != NULL) {
+        dev->displayModeIterator->Release();
+        dev->displayModeIterator = NULL;
+    }
+
+    if (dev->deckLinkConfiguration != NULL) {
+        dev->deckLinkConfiguration->Release();
+        dev->deckLinkConfiguration = NULL;
+    }
+
+    if (dev->deckLinkInput != NULL) {
+        dev->deckLinkInput->Release();
+        dev->deckLinkInput = NULL;
+    }
+
+    if (dev->deckLink != NULL) {
+        dev->deckLink->Release();
+        dev->deckLink = NULL;
+    }
+
+    if (dev->framePool != NULL) {
+        dev->framePool->Release();
+        dev->framePool = NULL;
+    }
+    av_freep(&dev->video_cards);
+    av_freep(&dev->audio_cards);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    CaptureDevice *dev = &devices[0];
+    int exitStatus     = 1;
+    int ch, policy, benchmark = 0;
+    const char *clock_check = NULL;
+    AVDictionary *opts = NULL;
+    AVOutputFormat *fmt = NULL;
+    ThreadPlacement main_placement;
+    int started = 0;
+    int i, ret;
+
+    pthread_mutex_init(&sleepMutex, NULL);
+    pthread_cond_init(&sleepCond, NULL);
+    av_register_all();
+
+    device_init(dev, 0);
+    nb_devices = 1;
+
+    // Parse command line options
+    while ((ch = getopt(argc, argv, "?hvc:s:f:a:m:n:p:M:F:C:A:V:o:w:S:d:z:B:N:P:Q:e:E:u:bX:T:W:R:j:k:r:x:y:H:lI:O:K:q:")) != -1) {
+        switch (ch) {
+        case 'v':
+            g_verbose = true;
+            break;
+        case 'm':
+            dev->mode_index = atoi(optarg);
+            break;
+        case 'c':
+            g_audioChannels = atoi(optarg);
+            if (g_audioChannels != 2 &&
+                g_audioChannels != 8 &&
+                g_audioChannels != 16) {
+                fprintf(
+                    stderr,
+                    "Invalid argument: Audio Channels must be either 2, 8 or 16\n");
+                goto bail;
+            }
+            break;
+        case 's':
+            g_audioSampleDepth = atoi(optarg);
             switch (g_audioSampleDepth) {
             case 16:
                 sample_fmt = AV_SAMPLE_FMT_S16;
@@ -657,32 +2821,32 @@ int main(int argc, char *argv[])
         case 'p':
             switch (atoi(optarg)) {
             case  8:
-                pix     = bmdFormat8BitYUV;
-                pix_fmt = AV_PIX_FMT_UYVY422;
+                dev->pix     = bmdFormat8BitYUV;
+                dev->pix_fmt = AV_PIX_FMT_UYVY422;
                 break;
             case 10:
-                pix     = bmdFormat10BitYUV;
-                pix_fmt = AV_PIX_FMT_YUV422P10;
+                dev->pix     = bmdFormat10BitYUV;
+                dev->pix_fmt = AV_PIX_FMT_YUV422P10;
                 break;
             default:
                 if (!strcmp("rgb10", optarg)) {
-                    pix     = bmdFormat10BitRGB;
-                    pix_fmt = AV_PIX_FMT_RGB48;
+                    dev->pix     = bmdFormat10BitRGB;
+                    dev->pix_fmt = AV_PIX_FMT_RGB48;
                     break;
                 }
                 if (!strcmp("yuv10", optarg)) {
-                    pix     = bmdFormat10BitYUV;
-                    pix_fmt = AV_PIX_FMT_YUV422P10;
+                    dev->pix     = bmdFormat10BitYUV;
+                    dev->pix_fmt = AV_PIX_FMT_YUV422P10;
                     break;
                 }
                 if (!strcmp("yuv8", optarg)) {
-                    pix     = bmdFormat8BitYUV;
-                    pix_fmt = AV_PIX_FMT_UYVY422;
+                    dev->pix     = bmdFormat8BitYUV;
+                    dev->pix_fmt = AV_PIX_FMT_UYVY422;
                     break;
                 }
                 if (!strcmp("rgb8", optarg)) {
-                    pix     = bmdFormat8BitARGB;
-                    pix_fmt = AV_PIX_FMT_ARGB;
+                    dev->pix     = bmdFormat8BitARGB;
+                    dev->pix_fmt = AV_PIX_FMT_ARGB;
                     break;
                 }
 
@@ -692,12 +2856,30 @@ int main(int argc, char *argv[])
                 goto bail;
             }
             break;
-        case 'f':
-            g_videoOutputFile = optarg;
+        case 'f': {
+            CaptureOutput *out;
+
+            if (dev->nb_outputs == MAX_OUTPUTS) {
+                fprintf(stderr, "Too many outputs, at most %d are supported\n",
+                        MAX_OUTPUTS);
+                goto bail;
+            }
+            out = &dev->outputs[dev->nb_outputs++];
+            out->dev      = dev;
+            out->filename = optarg;
+            out->fmt      = fmt;
+            out->opts     = opts;
+            fmt  = NULL;
+            opts = NULL;
             break;
+        }
         case 'n':
             g_maxFrames = atoi(optarg);
             break;
+        case 'a':
+            if (audio_map_parse(&g_audioMap, optarg) < 0)
+                goto bail;
+            break;
         case 'M':
             g_memoryLimit = atoi(optarg) * 1024 * 1024 * 1024L;
             break;
@@ -705,16 +2887,39 @@ int main(int argc, char *argv[])
             fmt = av_guess_format(optarg, NULL, NULL);
             break;
         case 'A':
-            aconnection = atoi(optarg);
+            dev->aconnection = atoi(optarg);
             break;
         case 'V':
-            vconnection = atoi(optarg);
+            dev->vconnection = atoi(optarg);
             break;
         case 'C':
-            camera = atoi(optarg);
+            /* a second -C starts the next card */
+            if (dev->has_card) {
+                if (nb_devices == MAX_DEVICES) {
+                    fprintf(stderr, "Too many cards, at most %d are "
+                            "supported\n", MAX_DEVICES);
+                    goto bail;
+                }
+                finish_outputs(dev, &fmt, &opts);
+                dev = &devices[nb_devices];
+                device_init(dev, nb_devices++);
+            }
+            dev->card     = atoi(optarg);
+            dev->has_card = 1;
+            break;
+        case 'j':
+            g_writerThreads = atoi(optarg);
+            if (g_writerThreads < 1) {
+                fprintf(stderr, "Invalid argument: -j needs at least 1 thread\n");
+                goto bail;
+            }
             break;
         case 'S':
-            serial_fd = open(optarg, O_RDWR | O_NONBLOCK);
+            dev->serial_fd = open(optarg, O_RDWR | O_NONBLOCK);
+            if (dev->serial_fd < 0) {
+                fprintf(stderr, "Cannot open the serial device %s\n", optarg);
+                goto bail;
+            }
             break;
         case 'o':
             if (av_dict_parse_string(&opts, optarg, "=", ":", 0) < 0) {
@@ -726,8 +2931,141 @@ int main(int argc, char *argv[])
         case 'w':
             wallclock = true;
             break;
+        case 'l':
+            wallclock     = true;
+            g_binaryClock = 1;
+            break;
+        case 'K':
+            g_clockTrace = fopen(optarg, "w");
+            if (!g_clockTrace) {
+                fprintf(stderr, "Cannot open the clock trace %s\n", optarg);
+                goto bail;
+            }
+            setvbuf(g_clockTrace, NULL, _IOFBF, 1 << 20);
+            break;
+        case 'q':
+            clock_check = optarg;
+            break;
         case 'd':
-            draw_bars = atoi(optarg);
+            g_filler = (enum FillerType)atoi(optarg);
+            if (g_filler < FILLER_BLACK || g_filler > FILLER_FREEZE) {
+                fprintf(stderr, "Invalid argument: -d must be 0, 1 or 2\n");
+                goto bail;
+            }
+            break;
+        case 'z':
+            g_zeroCopyFrames = atoi(optarg);
+            break;
+        case 'P':
+            if (sscanf(optarg, "%d:%d", &policy, &g_dropInterval) < 1 ||
+                policy < OVERFLOW_ABORT || policy > OVERFLOW_BLOCK ||
+                g_dropInterval <= 0) {
+                fprintf(stderr, "Invalid argument: Unknown policy %s\n",
+                        optarg);
+                goto bail;
+            }
+            g_overflowPolicy = (enum OverflowPolicy)policy;
+            break;
+        case 'R':
+            if (segment_rule_parse(&g_segmentRule, optarg) < 0) {
+                fprintf(stderr, "Invalid argument: -R %s\n", optarg);
+                goto bail;
+            }
+            g_segment = 1;
+            break;
+        case 'W': {
+            char *depth = strrchr(optarg, ':');
+            if (depth) {
+                *depth++      = '\0';
+                g_directDepth = atoi(depth);
+            }
+            g_directBuffer = atoi(optarg) * 1024 * 1024ULL;
+            if (!g_directBuffer || g_directDepth < 2 ||
+                g_directDepth > DIRECT_MAX_DEPTH) {
+                fprintf(stderr, "Invalid argument: -W needs a buffer size and "
+                        "2 to %d writes in flight\n", DIRECT_MAX_DEPTH);
+                goto bail;
+            }
+            break;
+        }
+        case 'Q': {
+            char *size = strrchr(optarg, ':');
+            if (size) {
+                *size++     = '\0';
+                g_spillSize = atoi(size) * 1024 * 1024 * 1024ULL;
+            }
+            g_spillFile = optarg;
+            break;
+        }
+        case 'e':
+            g_encoder = optarg;
+            break;
+        case 'E':
+            if (av_dict_parse_string(&g_encoderOpts, optarg, "=", ":", 0) < 0) {
+                fprintf(stderr, "Cannot parse option string %s\n",
+                        optarg);
+                goto bail;
+            }
+            break;
+        case 'B':
+            g_poolFrames = atoi(optarg);
+            break;
+        case 'N':
+            dev->numa_node = atoi(optarg);
+            break;
+        case 'k':
+            dev->cpu_list = optarg;
+            break;
+        case 'r':
+            g_schedPolicy = optarg;
+            break;
+        case 'x':
+            dev->proxy.dev      = dev;
+            dev->proxy.filename = optarg;
+            break;
+        case 'H':
+            dev->hash_path = optarg;
+            break;
+        case 'O':
+            if (!segment_pattern_valid(optarg)) {
+                fprintf(stderr, "Invalid argument: -O needs a %%d for the "
+                        "replay number\n");
+                goto bail;
+            }
+            dev->replay_pattern = optarg;
+            break;
+        case 'I':
+            if (sscanf(optarg, "%lf:%lf", &g_replayWindow,
+                       &g_replayPostRoll) < 1 ||
+                g_replayWindow <= 0 || g_replayPostRoll < 0) {
+                fprintf(stderr, "Invalid argument: -I %s\n", optarg);
+                goto bail;
+            }
+            break;
+        case 'y':
+            if (sscanf(optarg, "%d:%d", &g_proxyFactor, &g_proxyThreads) < 1 ||
+                g_proxyFactor < 1 || g_proxyThreads < 1) {
+                fprintf(stderr, "Invalid argument: -y needs a divisor and "
+                        "at least 1 thread\n");
+                goto bail;
+            }
+            break;
+        case 'u':
+            g_unpackThreads = atoi(optarg);
+            if (g_unpackThreads < 1) {
+                fprintf(stderr, "Invalid argument: -u needs at least 1 thread\n");
+                goto bail;
+            }
+            break;
+        case 'b':
+            benchmark = 1;
+            break;
+        case 'X':
+            g_metricsSocket = optarg;
+            break;
+        case 'T':
+            if (trace_init(optarg) < 0)
+                goto bail;
             break;
         case '?':
         case 'h':
@@ -735,231 +3073,230 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (serial_fd > 0 && wallclock) {
-        fprintf(stderr, "%s",
-                "Wallclock and serial are not supported together\n"
-                "Please disable either.\n");
-        exit(1);
-    }
-
-    /* Connect to the first DeckLink instance */
-    do
-        result = deckLinkIterator->Next(&deckLink);
-    while (i++ < camera);
-
-    if (result != S_OK) {
-        fprintf(stderr, "No DeckLink PCI cards found.\n");
-        goto bail;
-    }
-
-    if (deckLink->QueryInterface(IID_IDeckLinkInput,
-                                 (void **)&deckLinkInput) != S_OK) {
+    if (benchmark) {
+        exitStatus = v210_benchmark(g_unpackThreads ? g_unpackThreads : 1,
+                                    stderr) < 0;
         goto bail;
     }
 
-    result = deckLink->QueryInterface(IID_IDeckLinkConfiguration,
-                                      (void **)&deckLinkConfiguration);
-    if (result != S_OK) {
-        fprintf(
-            stderr,
-            "Could not obtain the IDeckLinkConfiguration interface - result = %08x\n",
-            result);
+    if (clock_check) {
+        exitStatus = clock_fit_check(clock_check, stdout, stderr) < 0;
         goto bail;
     }
 
-    result = S_OK;
-    switch (aconnection) {
-    case 1:
-        result = DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
-        break;
-    case 2:
-        result = DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
-        break;
-    case 3:
-        result = DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAESEBU);
-        break;
-    default:
-        // do not change it
-        break;
-    }
-    if (result != S_OK) {
-        fprintf(stderr, "Failed to set audio input - result = %08x\n", result);
-        goto bail;
-    }
+    finish_outputs(dev, &fmt, &opts);
 
-    result = S_OK;
-    switch (vconnection) {
-    case 1:
-        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComposite);
-        break;
-    case 2:
-        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComponent);
-        break;
-    case 3:
-        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionHDMI);
-        break;
-    case 4:
-        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionSDI);
-        break;
-    case 5:
-        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionOpticalSDI);
-        break;
-    case 6:
-        result = DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionSVideo);
-        break;
-    default:
-        // do not change it
-        break;
-    }
-    if (result != S_OK) {
-        fprintf(stderr, "Failed to set video input - result %08x\n", result);
-        goto bail;
+    if (g_audioMap.nb_streams) {
+        if (audio_map_init(&g_audioMap, g_audioChannels,
+                           g_audioSampleDepth / 8) < 0)
+            goto bail;
+        fprintf(stderr, "Audio map: %d of %d channels in %d stream%s (%s)\n",
+                audio_map_channels(&g_audioMap), g_audioChannels,
+                g_audioMap.nb_streams, g_audioMap.nb_streams > 1 ? "s" : "",
+                g_audioMap.name);
     }
 
-    delegate = new DeckLinkCaptureDelegate();
-    deckLinkInput->SetCallback(delegate);
-
-    // Obtain an IDeckLinkDisplayModeIterator to enumerate the display modes supported on output
-    result = deckLinkInput->GetDisplayModeIterator(&displayModeIterator);
-    if (result != S_OK) {
-        fprintf(
-            stderr,
-            "Could not obtain the video output display mode iterator - result = %08x\n",
-            result);
-        goto bail;
-    }
+    for (i = 0; i < nb_devices; i++) {
+        dev = &devices[i];
 
-    if (!g_videoOutputFile) {
-        fprintf(stderr,
-                "Missing argument: Please specify output path using -f\n");
-        goto bail;
-    }
+        if (nb_devices > 1)
+            snprintf(dev->label, sizeof(dev->label), "Card %d: ", dev->card);
 
-    if (!fmt) {
-        fmt = av_guess_format(NULL, g_videoOutputFile, NULL);
-        if (!fmt) {
-            fprintf(
-                stderr,
-                "Unable to guess output format, please specify explicitly using -F\n");
+        if (g_unpackThreads && dev->pix != bmdFormat10BitYUV) {
+            fprintf(stderr, "%sUnpacking (-u) needs 10 bit yuv input "
+                    "(-p yuv10)\n", dev->label);
             goto bail;
         }
-    }
 
-    if (g_videoModeIndex < 0) {
-        fprintf(stderr, "No video mode specified\n");
-        usage(0);
-    }
+        if (dev->proxy.filename) {
+            if (dev->pix != bmdFormat8BitYUV && dev->pix != bmdFormat10BitYUV) {
+                fprintf(stderr, "%sThe proxy (-x) needs yuv input\n",
+                        dev->label);
+                goto bail;
+            }
+            dev->proxy.fmt = av_guess_format(NULL, dev->proxy.filename, NULL);
+            if (!dev->proxy.fmt) {
+                fprintf(stderr, "%sUnable to guess the proxy format from %s\n",
+                        dev->label, dev->proxy.filename);
+                goto bail;
+            }
+        }
 
-    while (displayModeIterator->Next(&displayMode) == S_OK) {
-        if (g_videoModeIndex == displayModeCount) {
-            selectedDisplayMode = displayMode->GetDisplayMode();
-            break;
+        /* only the replay ring is recorded */
+        if (!dev->nb_outputs && dev->replay_pattern) {
+            CaptureOutput *out = &dev->outputs[dev->nb_outputs++];
+
+            out->dev      = dev;
+            out->filename = "/dev/null";
+            out->fmt      = av_guess_format("null", NULL, NULL);
         }
-        displayModeCount++;
-        displayMode->Release();
-    }
 
-    result = deckLinkInput->EnableVideoInput(selectedDisplayMode, pix, 0);
-    if (result != S_OK) {
-        fprintf(stderr,
-                "Failed to enable video input. Is another application using "
-                "the card?\n");
-        goto bail;
-    }
+        if (!dev->nb_outputs) {
+            fprintf(stderr,
+                    "%sMissing argument: Please specify output path using -f\n",
+                    dev->label);
+            goto bail;
+        }
 
-    result = deckLinkInput->EnableAudioInput(bmdAudioSampleRate48kHz,
-                                             g_audioSampleDepth,
-                                             g_audioChannels);
-    if (result != S_OK) {
-        fprintf(stderr,
-                "Failed to enable audio input. Is another application using "
-                "the card?\n");
-        goto bail;
-    }
+        for (int j = 0; j < dev->nb_outputs; j++) {
+            CaptureOutput *out = &dev->outputs[j];
 
-    oc          = avformat_alloc_context();
-    oc->oformat = fmt;
+            if (!out->fmt)
+                out->fmt = av_guess_format(NULL, out->filename, NULL);
+            if (!out->fmt) {
+                fprintf(
+                    stderr,
+                    "Unable to guess output format, please specify explicitly using -F\n");
+                goto bail;
+            }
+        }
 
-    snprintf(oc->filename, sizeof(oc->filename), "%s", g_videoOutputFile);
+        if (dev->mode_index < 0) {
+            fprintf(stderr, "%sNo video mode specified\n", dev->label);
+            usage(0);
+        }
 
+        if ((dev->cpu_list &&
+             thread_placement_parse_cpus(&dev->placement, dev->cpu_list) < 0) ||
+            (g_schedPolicy &&
+             thread_placement_parse_sched(&dev->placement, g_schedPolicy) < 0) ||
+            (dev->numa_node >= 0 &&
+             thread_placement_set_node(&dev->placement, dev->numa_node) < 0))
+            goto bail;
+        if (thread_placement_is_set(&dev->placement)) {
+            char what[32];
+
+            if (nb_devices > 1)
+                snprintf(what, sizeof(what), "Card %d threads", dev->card);
+            else
+                snprintf(what, sizeof(what), "Capture threads");
+            thread_placement_report(&dev->placement, what, stderr);
+        }
+    }
 
-    switch (pix) {
-    case bmdFormat8BitARGB:
-    case bmdFormat8BitYUV:
-        fmt->video_codec = AV_CODEC_ID_RAWVIDEO;
-        break;
-    case bmdFormat10BitYUV:
-        fmt->video_codec = AV_CODEC_ID_V210;
-        break;
-    case bmdFormat10BitRGB:
-        fmt->video_codec = AV_CODEC_ID_R210;
-        break;
+    /*
+     * The main thread takes the placement of each card while setting it
+     * up, so the allocations land on its node and the threads the SDK,
+     * the encoder and the writers start for it inherit its cpus.
+     */
+    thread_placement_save(&main_placement);
+
+    for (i = 0; i < nb_devices; i++) {
+        int placed = thread_placement_is_set(&devices[i].placement);
+
+        if (placed)
+            thread_placement_apply(&devices[i].placement);
+        ret = open_device(&devices[i]) < 0 || setup_device(&devices[i]) < 0;
+        if (placed)
+            thread_placement_apply(&main_placement);
+        if (ret)
+            goto bail;
     }
 
-    fmt->audio_codec = (sample_fmt == AV_SAMPLE_FMT_S16 ? AV_CODEC_ID_PCM_S16LE : AV_CODEC_ID_PCM_S32LE);
+    /* Share the cards among the writers, round robin */
+    nb_writers = g_writerThreads ? FFMIN(g_writerThreads, nb_devices)
+                                 : nb_devices;
+    for (i = 0; i < nb_writers; i++)
+        avpacket_queue_notify_init(&writers[i].notify);
+    for (i = 0; i < nb_devices; i++) {
+        CaptureWriter *w = &writers[i % nb_writers];
 
-    video_st = add_video_stream(oc, fmt->video_codec);
-    audio_st = add_audio_stream(oc, fmt->audio_codec);
+        w->devices[w->nb_devices++] = &devices[i];
+        avpacket_queue_set_notify(devices[i].write_queue, &w->notify);
+    }
 
-    if (serial_fd > 0 || wallclock)
-        data_st = add_data_stream(oc, AV_CODEC_ID_TEXT);
+    if (g_metricsSocket &&
+        metrics_server_start(&metrics, g_metricsSocket, write_metrics) < 0)
+        goto bail;
 
-    if (!(fmt->flags & AVFMT_NOFILE)) {
-        if (avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
-            fprintf(stderr, "Could not open '%s'\n", oc->filename);
-            exit(1);
-        }
+    for (i = 0; i < nb_devices; i++) {
+        int placed = thread_placement_is_set(&devices[i].placement);
+
+        if (placed)
+            thread_placement_apply(&devices[i].placement);
+        ret = devices[i].deckLinkInput->StartStreams() != S_OK;
+        if (placed)
+            thread_placement_apply(&main_placement);
+        if (ret)
+            goto stop;
+        started++;
     }
 
-    avformat_write_header(oc, &opts);
-    avpacket_queue_init(&queue);
+    for (i = 0; i < nb_devices; i++) {
+        if (start_device(&devices[i]) < 0)
+            goto stop;
+    }
 
-    result = deckLinkInput->StartStreams();
-    if (result != S_OK) {
-        goto bail;
+    for (i = 0; i < nb_writers; i++) {
+        pthread_mutex_lock(&sleepMutex);
+        running_writers++;
+        pthread_mutex_unlock(&sleepMutex);
+        if (thread_create(&writers[i].th, &writers[i].devices[0]->placement,
+                          writer_thread, &writers[i])) {
+            pthread_mutex_lock(&sleepMutex);
+            running_writers--;
+            pthread_mutex_unlock(&sleepMutex);
+            goto stop;
+        }
+        writers[i].running = 1;
     }
     // All Okay.
     exitStatus = 0;
 
-    if (pthread_create(&th, NULL, push_packet, oc))
-        goto bail;
-
     // Block main thread until signal occurs
     pthread_mutex_lock(&sleepMutex);
     set_signal();
     pthread_cond_wait(&sleepCond, &sleepMutex);
     pthread_mutex_unlock(&sleepMutex);
-    deckLinkInput->StopStreams();
+
+stop:
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < started; i++)
+        devices[i].deckLinkInput->StopStreams();
     fprintf(stderr, "Stopping Capture\n");
-    avpacket_queue_end(&queue);
+    metrics_server_stop(&metrics);
+    for (i = 0; i < nb_devices; i++) {
+        dev = &devices[i];
 
-bail:
-    if (displayModeIterator != NULL) {
-        displayModeIterator->Release();
-        displayModeIterator = NULL;
+        if (dev->framePool) {
+            fprintf(stderr, "%s", dev->label);
+            dev->framePool->PrintStats(stderr);
+        }
+        /* the cards are stopped, the rest is written out */
+        avpacket_queue_finish(&dev->queue);
+        if (g_spillFile && !dev->spill_running)
+            avpacket_queue_finish(&dev->spillqueue);
     }
-
-    if (deckLinkInput != NULL) {
-        deckLinkInput->Release();
-        deckLinkInput = NULL;
+    drain_given_up = wait_for_writers() < 0;
+    for (i = 0; i < nb_devices; i++) {
+        dev = &devices[i];
+
+        avpacket_queue_abort(&dev->queue);
+        if (g_spillFile) {
+            avpacket_queue_abort(&dev->spillqueue);
+            if (dev->spill_running)
+                pthread_join(dev->spill_th, NULL);
+        }
     }
-
-    if (deckLink != NULL) {
-        deckLink->Release();
-        deckLink = NULL;
+    for (i = 0; i < nb_writers; i++) {
+        if (writers[i].running)
+            pthread_join(writers[i].th, NULL);
     }
+    for (i = 0; i < nb_devices; i++)
+        stop_device(&devices[i]);
 
-    if (deckLinkIterator != NULL) {
-        deckLinkIterator->Release();
-    }
+bail:
+    metrics_server_stop(&metrics);
+    trace_close();
 
-    if (oc != NULL) {
-        av_write_trailer(oc);
-        if (!(fmt->flags & AVFMT_NOFILE)) {
-            /* close the output file */
-            avio_close(oc->pb);
-        }
+    for (i = 0; i < nb_devices; i++) {
+        if (close_device(&devices[i]) < 0)
+            exitStatus = 1;
     }
+    for (i = 0; i < nb_writers; i++)
+        avpacket_queue_notify_end(&writers[i].notify);
+    if (g_clockTrace)
+        fclose(g_clockTrace);
 
     return exitStatus;
 }
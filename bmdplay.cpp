@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
 #include <string.h>
 #include <libgen.h>
 #include <signal.h>
@@ -43,6 +44,10 @@ extern "C" {
 #include "Play.h"
 
 #include "modes.h"
+#include "metrics.h"
+#include "trace.h"
+#include "affinity.h"
+#include "packetqueue.h"
 
 pthread_mutex_t sleepMutex;
 pthread_cond_t sleepCond;
@@ -63,129 +68,135 @@ static enum AVPixelFormat pix_fmt = AV_PIX_FMT_UYVY422;
 static BMDPixelFormat pix         = bmdFormat8BitYUV;
 
 static int buffer    = 2000 * 1000;
+static int64_t queue_span = 0; /* default: the pre-buffer plus a second */
 static int serial_fd = -1;
 
 const unsigned long kAudioWaterlevel = 48000 / 4;      /* small */
 
-typedef struct PacketQueue {
-    AVPacketList *first_pkt, *last_pkt;
-    uint64_t nb_packets;
-    int size;
-    int abort_request;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-} PacketQueue;
-
-PacketQueue audioqueue;
-PacketQueue videoqueue;
-PacketQueue dataqueue;
+/*
+ * Each stream gets a bounded ring, the reader blocks once the ring holds
+ * more than max_bytes or more than max_span microseconds of packets, so
+ * what is resident does not depend on the length of the input.
+ */
+typedef struct PlayQueue {
+    AVPacketQueue q;
+    const char *name;
+    unsigned nb_slots;
+    unsigned long long max_bytes;
+    int64_t max_span;
+    int64_t last_stamp;
+} PlayQueue;
+
+PlayQueue audioqueue = { {}, "audio", 1024, 32 << 20, 0, 0 };
+PlayQueue videoqueue = { {}, "video", 1024, 512 << 20, 0, 0 };
+PlayQueue dataqueue  = { {}, "data",   256, 1 << 20, 0, 0 };
+
+/* Converted frames, from the decoder thread to the completion callback */
+static AVPacketQueue readyqueue;
+static AVPacketQueueNotify ready_notify;
+static unsigned decode_ahead  = 8;
+#define READY_POLL 100000
+static int decode_threads     = 0;
 struct SwsContext *sws;
 
-static void packet_queue_init(PacketQueue *q)
+/* With -X the counters below are served on a Unix socket */
+static MetricsServer metrics;
+static const char *metrics_socket      = NULL;
+static uint64_t frames_scheduled       = 0;
+static uint64_t frames_completed       = 0;
+static uint64_t frames_late            = 0;
+static uint64_t frames_dropped         = 0;
+static unsigned buffered_audio_samples = 0;
+
+static void write_metrics(FILE *f)
 {
-    memset(q, 0, sizeof(PacketQueue));
-    pthread_mutex_init(&q->mutex, NULL);
-    pthread_cond_init(&q->cond, NULL);
+    metrics_gauge(f, "bmdplay_videoqueue_packets", "Video packets queued",
+                  avpacket_queue_nb_packets(&videoqueue.q));
+    metrics_gauge(f, "bmdplay_videoqueue_bytes", "Video bytes queued",
+                  avpacket_queue_size(&videoqueue.q));
+    metrics_gauge(f, "bmdplay_audioqueue_packets", "Audio packets queued",
+                  avpacket_queue_nb_packets(&audioqueue.q));
+    metrics_gauge(f, "bmdplay_audioqueue_bytes", "Audio bytes queued",
+                  avpacket_queue_size(&audioqueue.q));
+    metrics_gauge(f, "bmdplay_readyqueue_frames",
+                  "Decoded frames ready to be scheduled",
+                  avpacket_queue_nb_packets(&readyqueue));
+    metrics_counter(f, "bmdplay_frames_completed_total",
+                    "Scheduled frames the card is done with",
+                    __atomic_load_n(&frames_completed, __ATOMIC_RELAXED));
+    metrics_counter(f, "bmdplay_frames_late_total",
+                    "Frames displayed late",
+                    __atomic_load_n(&frames_late, __ATOMIC_RELAXED));
+    metrics_counter(f, "bmdplay_frames_dropped_total",
+                    "Frames dropped by the card",
+                    __atomic_load_n(&frames_dropped, __ATOMIC_RELAXED));
+    metrics_gauge(f, "bmdplay_buffered_audio_samples",
+                  "Audio sample frames buffered on the card",
+                  __atomic_load_n(&buffered_audio_samples, __ATOMIC_RELAXED));
 }
 
-static void packet_queue_flush(PacketQueue *q)
+static int play_queue_init(PlayQueue *q)
 {
-    AVPacketList *pkt, *pkt1;
-
-    pthread_mutex_lock(&q->mutex);
-    for (pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
-        pkt1 = pkt->next;
-        av_packet_unref(&pkt->pkt);
-        av_freep(&pkt);
+    if (!q->max_span)
+        q->max_span = queue_span;
+    q->last_stamp = 0;
+    if (avpacket_queue_init(&q->q, q->nb_slots) < 0) {
+        fprintf(stderr, "Cannot allocate the %s queue\n", q->name);
+        return -1;
     }
-    q->last_pkt   = NULL;
-    q->first_pkt  = NULL;
-    q->nb_packets = 0;
-    q->size       = 0;
-    pthread_mutex_unlock(&q->mutex);
+    return 0;
 }
 
-static void packet_queue_end(PacketQueue *q)
+static void play_queue_end(PlayQueue *q)
 {
-    packet_queue_flush(q);
-    pthread_mutex_lock(&q->mutex);
-    q->abort_request = -1;
-    pthread_cond_signal(&q->cond);
-    pthread_mutex_unlock(&q->mutex);
-    pthread_mutex_destroy(&q->mutex);
-    pthread_cond_destroy(&q->cond);
+    if (q->q.slots)
+        avpacket_queue_end(&q->q);
 }
 
-static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+/*
+ * Called by the reader only, waits for room within the budget and queues
+ * pkt stamped with its pts in microseconds. Packets without a pts take
+ * the stamp of the previous one. Returns -1 once the queue is aborted.
+ */
+static int play_queue_put(PlayQueue *q, AVPacket *pkt, AVStream *st)
 {
-    AVPacketList *pkt1;
-
-    pkt1 = (AVPacketList *)av_malloc(sizeof(AVPacketList));
-    if (!pkt1)
+    if (pkt->pts != AV_NOPTS_VALUE)
+        q->last_stamp = av_rescale_q(pkt->pts, st->time_base,
+                                     AV_TIME_BASE_Q);
+
+    /* the demuxer may hand out its own data, the queue only moves
+     * reference counted packets */
+    if (av_dup_packet(pkt) < 0 ||
+        avpacket_queue_wait_budget(&q->q, q->max_bytes, q->max_span) < 0 ||
+        avpacket_queue_put_stamp(&q->q, pkt, q->last_stamp) < 0) {
+        av_packet_unref(pkt);
         return -1;
-    pkt1->pkt  = *pkt;
-    pkt1->next = NULL;
-
-    pthread_mutex_lock(&q->mutex);
-
-    if (!q->last_pkt)
-
-        q->first_pkt = pkt1;
-    else
-        q->last_pkt->next = pkt1;
-    q->last_pkt = pkt1;
-    q->nb_packets++;
-    if (q->nb_packets > 5000)
-        fprintf(stderr,
-                "%" PRId64 " storing %p, %s - is the input faster than realtime?\n",
-                q->nb_packets,
-                q,
-                q == &videoqueue ? "videoqueue" : "audioqueue");
-    q->size += pkt1->pkt.size + sizeof(*pkt1);
-
-    pthread_cond_signal(&q->cond);
-
-    pthread_mutex_unlock(&q->mutex);
+    }
     return 0;
 }
 
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+static int parse_queue_budget(const char *arg)
 {
-    AVPacketList *pkt1;
-    int ret;
-
-    pthread_mutex_lock(&q->mutex);
-
-    for (;; ) {
-        pkt1 = q->first_pkt;
-        if (pkt1) {
-            q->first_pkt = pkt1->next;
-            if (!q->first_pkt)
-                q->last_pkt = NULL;
-            q->nb_packets--;
-            if (q->nb_packets > 5000)
-                fprintf(stderr, "pulling %" PRId64 " from %p %s\n",
-                        q->nb_packets,
-                        q,
-                        q == &videoqueue ? "videoqueue" : "audioqueue");
-            q->size -= pkt1->pkt.size + sizeof(*pkt1);
-            *pkt     = pkt1->pkt;
-            av_free(pkt1);
-            ret = 1;
-            break;
-        } else if (!block) {
-            ret = 0;
-            break;
-        } else {
-            if (q->abort_request) {
-                ret = -1;
-                break;
-            }
-            pthread_cond_wait(&q->cond, &q->mutex);
-        }
+    PlayQueue *q;
+    double mbytes;
+    int ms = 0;
+
+    switch (arg[0]) {
+    case 'a': q = &audioqueue; break;
+    case 'v': q = &videoqueue; break;
+    case 'd': q = &dataqueue;  break;
+    default:  q = NULL;        break;
     }
-    pthread_mutex_unlock(&q->mutex);
-    return ret;
+    if (!q || arg[1] != ':' ||
+        sscanf(arg + 2, "%lf:%d", &mbytes, &ms) < 1 || mbytes <= 0 || ms < 0) {
+        fprintf(stderr, "Invalid queue budget %s, use <a|v|d>:<MiB>[:<ms>]\n",
+                arg);
+        return -1;
+    }
+    q->max_bytes = mbytes * (1 << 20);
+    if (ms)
+        q->max_span = ms * 1000LL;
+    return 0;
 }
 
 int64_t first_audio_pts = AV_NOPTS_VALUE;
@@ -193,23 +204,53 @@ int64_t first_video_pts = AV_NOPTS_VALUE;
 int64_t first_pts       = AV_NOPTS_VALUE;
 int fill_me             = 1;
 
+/*
+ * Set by the decoder once it drained the codec at the end of the input,
+ * then by the callbacks once all of it is played out.
+ */
+static int decoded_all = 0;
+static int played_out  = 0;
+
+static int interrupt_cb(void *unused)
+{
+    return !__atomic_load_n(&fill_me, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called by the callbacks, wakes main() once the decoder is done and the
+ * queues and the card have nothing left of what was read.
+ */
+static void check_played_out(void)
+{
+    if (!__atomic_load_n(&decoded_all, __ATOMIC_SEQ_CST) ||
+        avpacket_queue_nb_packets(&audioqueue.q) ||
+        avpacket_queue_nb_packets(&readyqueue) ||
+        __atomic_load_n(&frames_completed, __ATOMIC_RELAXED) <
+        __atomic_load_n(&frames_scheduled, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&sleepMutex);
+    played_out = 1;
+    pthread_cond_signal(&sleepCond);
+    pthread_mutex_unlock(&sleepMutex);
+}
+
 void *fill_queues(void *unused)
 {
     AVPacket pkt;
     AVStream *st;
-    int once = 0;
+    int ret = 0;
 
-    while (fill_me) {
+    while (fill_me && ret >= 0) {
         int err = av_read_frame(ic, &pkt);
         if (err) {
-            pthread_cond_signal(&sleepCond);
+            /* an empty packet tells the decoder to drain the codec */
+            av_init_packet(&pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+            play_queue_put(&videoqueue, &pkt, video.st);
             return NULL;
         }
-        if (videoqueue.nb_packets > 1000) {
-            if (!once++)
-                fprintf(stderr, "Queue size %d problems ahead\n",
-                        videoqueue.size);
-        }
         st = ic->streams[pkt.stream_index];
         switch (st->codecpar->codec_type) {
         case AVMEDIA_TYPE_VIDEO:
@@ -224,7 +265,7 @@ void *fill_queues(void *unused)
                 }
                 pkt.pts -= first_video_pts;
             }
-            packet_queue_put(&videoqueue, &pkt);
+            ret = play_queue_put(&videoqueue, &pkt, st);
             break;
         case AVMEDIA_TYPE_AUDIO:
             if (pkt.pts != AV_NOPTS_VALUE) {
@@ -236,10 +277,14 @@ void *fill_queues(void *unused)
                 }
                 pkt.pts -= first_audio_pts;
             }
-            packet_queue_put(&audioqueue, &pkt);
+            ret = play_queue_put(&audioqueue, &pkt, st);
             break;
         case AVMEDIA_TYPE_DATA:
-	    packet_queue_put(&dataqueue, &pkt);
+            /* nothing would ever drain it without a serial port */
+            if (serial_fd > 0)
+                ret = play_queue_put(&dataqueue, &pkt, st);
+            else
+                av_packet_unref(&pkt);
             break;
         default:
             av_packet_unref(&pkt);
@@ -251,6 +296,8 @@ void *fill_queues(void *unused)
 
 void sigfunc(int signum)
 {
+    /* also ends a preroll still waiting in StartDecoding() */
+    __atomic_store_n(&fill_me, 0, __ATOMIC_SEQ_CST);
     pthread_cond_signal(&sleepCond);
 }
 
@@ -312,6 +359,17 @@ int usage(int status)
         "    -b <num>             Milliseconds of pre-buffering before playback (default = 2000 ms)\n"
         "    -p <pixel>           PixelFormat Depth (8 or 10 - default is 8)\n"
         "    -S <port>            Serial device (i.e: /dev/ttyS0, /dev/ttyUSB0)\n"
+        "    -q <s>:<MiB>[:<ms>]  Bytes and milliseconds the reader queues ahead for\n"
+        "                         stream <s>: a(udio), v(ideo) or d(ata)\n"
+        "                         (defaults a:32, v:512, d:1, ms = -b + 1000)\n"
+        "    -d <frames>          Decoded frames kept ready for the card (default 8)\n"
+        "    -t <threads>         Decoder threads (default 0 = one per cpu)\n"
+        "    -X <socket>          Serve live metrics on the Unix socket <socket>\n"
+        "    -T <file>            Write a Chrome trace to <file> on exit or SIGUSR1\n"
+        "    -k <cpus>            Run the reader and decoder threads on <cpus> (e.g. 0-3)\n"
+        "    -r <policy>[:<prio>] Scheduling of those threads: fifo, rr or other\n"
+        "    -N <node>            NUMA node of the card, its memory and, without -k,\n"
+        "                         its cpus are used\n"
         "    -O <output>          Output connection:\n"
         "                         1: Composite video + analog audio\n"
         "                         2: Components video + analog audio\n"
@@ -329,8 +387,11 @@ int main(int argc, char *argv[])
     int connection = 0;
     int camera     = 0;
     char *filename = NULL;
+    const char *cpu_list = NULL, *policy = NULL;
+    int numa_node  = -1;
+    ThreadPlacement placement;
 
-    while ((ch = getopt(argc, argv, "?hs:f:a:m:n:F:C:O:b:p:S:")) != -1) {
+    while ((ch = getopt(argc, argv, "?hs:f:a:m:n:F:C:O:b:p:S:X:T:k:r:N:q:d:t:")) != -1) {
         switch (ch) {
         case 'p':
             switch (atoi(optarg)) {
@@ -367,6 +428,36 @@ int main(int argc, char *argv[])
         case 'S':
             serial_fd = open(optarg, O_RDWR | O_NONBLOCK);
             break;
+        case 'q':
+            if (parse_queue_budget(optarg) < 0)
+                return 1;
+            break;
+        case 'd':
+            decode_ahead = atoi(optarg);
+            if (decode_ahead < 2) {
+                fprintf(stderr, "Invalid argument: -d needs at least 2 frames\n");
+                return usage(1);
+            }
+            break;
+        case 't':
+            decode_threads = atoi(optarg);
+            break;
+        case 'X':
+            metrics_socket = optarg;
+            break;
+        case 'T':
+            if (trace_init(optarg) < 0)
+                return 1;
+            break;
+        case 'k':
+            cpu_list = optarg;
+            break;
+        case 'r':
+            policy = optarg;
+            break;
+        case 'N':
+            numa_node = atoi(optarg);
+            break;
         case '?':
         case 'h':
             return usage(0);
@@ -376,8 +467,25 @@ int main(int argc, char *argv[])
     if (!filename)
         return usage(1);
 
+    queue_span = buffer + 1000 * 1000LL;
+
+    /*
+     * The decoder threads libavcodec starts, the card threads and the
+     * reader all come from the main thread and inherit its placement.
+     */
+    thread_placement_init(&placement);
+    if ((cpu_list && thread_placement_parse_cpus(&placement, cpu_list) < 0) ||
+        (policy && thread_placement_parse_sched(&placement, policy) < 0) ||
+        (numa_node >= 0 && thread_placement_set_node(&placement, numa_node) < 0))
+        return 1;
+    if (thread_placement_is_set(&placement)) {
+        thread_placement_report(&placement, "Playback threads", stderr);
+        thread_placement_apply(&placement);
+    }
+
     av_register_all();
     ic = avformat_alloc_context();
+    ic->interrupt_callback.callback = interrupt_cb;
 
     avformat_open_input(&ic, filename, NULL, NULL);
     avformat_find_stream_info(ic, NULL);
@@ -396,6 +504,10 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
+                if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+                    avctx->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+                    avctx->thread_count = decode_threads;
+                }
                 if (avcodec_parameters_to_context(avctx, par) < 0 ||
                     avcodec_open2(avctx, codec, NULL) < 0) {
                     avcodec_free_context(&avctx);
@@ -455,10 +567,11 @@ int main(int argc, char *argv[])
     ret = generator.Init(videomode, connection, camera);
 
     avformat_close_input(&ic);
+    trace_close();
 
-    fprintf(stderr, "video %" PRId64 " audio %" PRId64 "\n",
-            videoqueue.nb_packets,
-            audioqueue.nb_packets);
+    fprintf(stderr, "video %u audio %u\n",
+            avpacket_queue_nb_packets(&videoqueue.q),
+            avpacket_queue_nb_packets(&audioqueue.q));
 
     return ret;
 }
@@ -468,6 +581,9 @@ Player::Player()
     m_audioSampleRate = bmdAudioSampleRate48kHz;
     m_running         = false;
     m_outputSignal    = kOutputSignalDrop;
+    m_decoding        = false;
+    m_owed            = 0;
+    m_scheduling      = 0;
 }
 
 bool Player::Init(int videomode, int connection, int camera)
@@ -475,6 +591,8 @@ bool Player::Init(int videomode, int connection, int camera)
     // Initialize the DeckLink API
     IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
     HRESULT result;
+    pthread_t th;
+    bool reading = false;
     int i = 0;
 
     if (!deckLinkIterator) {
@@ -561,25 +679,39 @@ bool Player::Init(int videomode, int connection, int camera)
 
     avframe = av_frame_alloc();
 
-    packet_queue_init(&audioqueue);
-    packet_queue_init(&videoqueue);
-    packet_queue_init(&dataqueue);
-    pthread_t th;
+    if (metrics_socket &&
+        metrics_server_start(&metrics, metrics_socket, write_metrics) < 0)
+        goto bail;
+
+    if (play_queue_init(&audioqueue) < 0 ||
+        play_queue_init(&videoqueue) < 0 ||
+        play_queue_init(&dataqueue) < 0)
+        goto bail;
     pthread_create(&th, NULL, fill_queues, NULL);
+    reading = true;
 
     usleep(buffer); // You can add the microseconds you need for pre-buffering before start playing
     // Start playing
     StartRunning(videomode);
 
     pthread_mutex_lock(&sleepMutex);
-    pthread_cond_wait(&sleepCond, &sleepMutex);
+    if (!played_out && __atomic_load_n(&fill_me, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&sleepCond, &sleepMutex);
     pthread_mutex_unlock(&sleepMutex);
-    fill_me = 0;
+    __atomic_store_n(&fill_me, 0, __ATOMIC_RELAXED);
     fprintf(stderr, "Exiting, cleaning up\n");
-    packet_queue_end(&audioqueue);
-    packet_queue_end(&videoqueue);
+    metrics_server_stop(&metrics);
+
+    /* wake the reader if it is waiting for room */
+    avpacket_queue_abort(&audioqueue.q);
+    avpacket_queue_abort(&videoqueue.q);
+    avpacket_queue_abort(&dataqueue.q);
+    pthread_join(th, NULL);
+    reading = false;
+    StopDecoding();
 
 bail:
+    metrics_server_stop(&metrics);
     if (m_running == true) {
         StopRunning();
     } else {
@@ -598,6 +730,23 @@ bail:
     if (deckLinkIterator != NULL)
         deckLinkIterator->Release();
 
+    /* the callbacks are the consumers, flush only once they are stopped */
+    if (reading) {
+        __atomic_store_n(&fill_me, 0, __ATOMIC_RELAXED);
+        avpacket_queue_abort(&audioqueue.q);
+        avpacket_queue_abort(&videoqueue.q);
+        avpacket_queue_abort(&dataqueue.q);
+        pthread_join(th, NULL);
+    }
+    StopDecoding();
+    if (readyqueue.slots) {
+        avpacket_queue_end(&readyqueue);
+        avpacket_queue_notify_end(&ready_notify);
+    }
+    play_queue_end(&audioqueue);
+    play_queue_end(&videoqueue);
+    play_queue_end(&dataqueue);
+
     return true;
 }
 
@@ -652,6 +801,9 @@ void Player::StartRunning(int videomode)
         return;
     }
 
+    if (!StartDecoding())
+        return;
+
     // Set the audio output mode
     if (audio.st) {
         if (m_deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz,
@@ -663,8 +815,7 @@ void Player::StartRunning(int videomode)
             return;
         }
 
-        for (unsigned i = 0; i < 10; i++)
-            ScheduleNextFrame(true);
+        ScheduleFrames(decode_ahead);
 
         // Begin audio preroll.  This will begin calling our audio callback, which will start the DeckLink output stream.
     //    m_audioBufferOffset = 0;
@@ -673,8 +824,7 @@ void Player::StartRunning(int videomode)
             return;
         }
     } else {
-        for (unsigned i = 0; i < 10; i++)
-            ScheduleNextFrame(true);
+        ScheduleFrames(decode_ahead);
 
         m_deckLinkOutput->StartScheduledPlayback(0, 100, 1.0);
     }
@@ -693,57 +843,216 @@ void Player::StopRunning()
     m_deckLinkOutput->DisableVideoOutput();
 }
 
-void Player::ScheduleNextFrame(bool prerolling)
+static void release_video_frame(void *opaque, uint8_t *data)
+{
+    ((IDeckLinkMutableVideoFrame *)opaque)->Release();
+}
+
+static void *decode_frames(void *arg)
+{
+    ((Player *)arg)->DecodeFrames();
+    return NULL;
+}
+
+bool Player::StartDecoding()
+{
+    if (avpacket_queue_init(&readyqueue, decode_ahead) < 0) {
+        fprintf(stderr, "Cannot allocate the decoded frame queue\n");
+        return false;
+    }
+    avpacket_queue_notify_init(&ready_notify);
+    avpacket_queue_set_notify(&readyqueue, &ready_notify);
+
+    if (pthread_create(&m_decodeThread, NULL, decode_frames, this)) {
+        fprintf(stderr, "Cannot start the decoder thread\n");
+        return false;
+    }
+    m_decoding = true;
+
+    /*
+     * Preroll once the decoder is decode_ahead frames ahead or done with
+     * a shorter input, give up on SIGINT. The signal does not wake the
+     * wait, fill_me is checked every READY_POLL.
+     */
+    for (;;) {
+        unsigned seq = avpacket_queue_notify_seq(&ready_notify);
+
+        if (avpacket_queue_nb_packets(&readyqueue) >= decode_ahead ||
+            avpacket_queue_aborted(&readyqueue) ||
+            !__atomic_load_n(&fill_me, __ATOMIC_SEQ_CST))
+            break;
+        avpacket_queue_notify_wait_timeout(&ready_notify, seq, READY_POLL);
+    }
+
+    return true;
+}
+
+void Player::StopDecoding()
+{
+    if (!m_decoding)
+        return;
+    avpacket_queue_abort(&videoqueue.q);
+    avpacket_queue_abort(&readyqueue);
+    pthread_join(m_decodeThread, NULL);
+    m_decoding = false;
+}
+
+/*
+ * Runs on its own thread, the codec adds its frame and slice threads.
+ * Every frame out of the decoder is converted into a card frame and
+ * queued, the callback only has to schedule it. The empty packet the
+ * reader queues at the end of the input drains the frames the codec
+ * still holds, readyqueue is aborted once they are all queued.
+ */
+void Player::DecodeFrames()
 {
     AVPacket pkt;
-    void *frame;
-    int ret;
+    int64_t pts = 0, duration = 0;
 
-    if (serial_fd > 0 && packet_queue_get(&dataqueue, &pkt, 0)) {
-        if (pkt.data[0] != ' '){
-            fprintf(stderr,"written %.*s  \n", pkt.size, pkt.data);
-            write(serial_fd, pkt.data, pkt.size);
-        }
+    while (avpacket_queue_get(&videoqueue.q, &pkt, 1)) {
+        int eof = !pkt.size;
+        int ret;
+
+        if (pkt.duration)
+            duration = pkt.duration;
+
+        TRACE_BEGIN("decode");
+        ret = avcodec_send_packet(video.codec, eof ? NULL : &pkt);
+        TRACE_END("decode");
         av_packet_unref(&pkt);
+
+        while (ret >= 0) {
+            ret = avcodec_receive_frame(video.codec, avframe);
+            if (ret < 0)
+                break;
+            if (avframe->pts != AV_NOPTS_VALUE)
+                pts = avframe->pts;
+            ret = QueueFrame(avframe, pts, duration);
+            av_frame_unref(avframe);
+            if (ret < 0)
+                goto end;
+            pts += duration;
+        }
+        if (eof) {
+            __atomic_store_n(&decoded_all, 1, __ATOMIC_SEQ_CST);
+            /* the card may have completed the last frame already */
+            check_played_out();
+            break;
+        }
     }
 
-    if (packet_queue_get(&videoqueue, &pkt, 0) < 0)
-        return;
+end:
+    /* ScheduleReadyFrame() still gets what is queued */
+    avpacket_queue_abort(&readyqueue);
+}
 
+int Player::QueueFrame(AVFrame *src, int64_t pts, int64_t duration)
+{
     IDeckLinkMutableVideoFrame *videoFrame;
-    m_deckLinkOutput->CreateVideoFrame(m_frameWidth,
-                                       m_frameHeight,
-                                       m_frameWidth * 2,
-                                       pix,
-                                       bmdFrameFlagDefault,
-                                       &videoFrame);
+    AVPacket pkt;
+    uint8_t *data[4];
+    int linesize[4];
+    void *frame;
+
+    if (avpacket_queue_wait_budget(&readyqueue, ULLONG_MAX, INT64_MAX) < 0)
+        return -1;
+
+    if (m_deckLinkOutput->CreateVideoFrame(m_frameWidth,
+                                           m_frameHeight,
+                                           m_frameWidth * 2,
+                                           pix,
+                                           bmdFrameFlagDefault,
+                                           &videoFrame) != S_OK) {
+        fprintf(stderr, "Cannot allocate a video frame\n");
+        return 0;
+    }
     videoFrame->GetBytes(&frame);
 
-    avcodec_send_packet(video.codec, &pkt);
+    av_image_fill_arrays(data, linesize, (uint8_t *)frame,
+                         pix_fmt, m_frameWidth, m_frameHeight, 1);
+
+    TRACE_BEGIN("sws_scale");
+    sws_scale(sws, src->data, src->linesize, 0, src->height,
+              data, linesize);
+    TRACE_END("sws_scale");
+
+    av_init_packet(&pkt);
+    pkt.data     = (uint8_t *)frame;
+    pkt.size     = videoFrame->GetRowBytes() * m_frameHeight;
+    pkt.pts      = pts;
+    pkt.duration = duration;
+    pkt.buf      = av_buffer_create(pkt.data, pkt.size, release_video_frame,
+                                    videoFrame, AV_BUFFER_FLAG_READONLY);
+    if (!pkt.buf) {
+        videoFrame->Release();
+        return -1;
+    }
 
-    // TODO: support receiving multiple frames
-    ret = avcodec_receive_frame(video.codec, avframe);
-    if (ret >= 0) {
-        uint8_t *data[4];
-        int linesize[4];
+    if (avpacket_queue_put(&readyqueue, &pkt) < 0)
+        av_packet_unref(&pkt);
 
-        av_image_fill_arrays(data, linesize, (uint8_t *)frame,
-                             pix_fmt, m_frameWidth, m_frameHeight, 1);
+    /* the callback found nothing to schedule, do it on its behalf */
+    if (__atomic_load_n(&m_owed, __ATOMIC_SEQ_CST))
+        ScheduleFrames(0);
 
-        sws_scale(sws, avframe->data, avframe->linesize, 0, avframe->height,
-                  data, linesize);
+    return 0;
+}
 
-        if (m_deckLinkOutput->ScheduleVideoFrame(videoFrame,
-                                                 pkt.pts *
-                                                 video.st->time_base.num,
-                                                 pkt.duration *
-                                                 video.st->time_base.num,
-                                                 video.st->time_base.den) !=
-            S_OK)
-            fprintf(stderr, "Error scheduling frame\n");
+/* Called by whoever holds m_scheduling, the one consumer of readyqueue */
+bool Player::ScheduleReadyFrame()
+{
+    IDeckLinkMutableVideoFrame *videoFrame;
+    AVPacket pkt, pkt_data;
+
+    if (!avpacket_queue_get(&readyqueue, &pkt, 0))
+        return false;
+
+    if (serial_fd > 0 && avpacket_queue_get(&dataqueue.q, &pkt_data, 0)) {
+        if (pkt_data.data[0] != ' '){
+            fprintf(stderr,"written %.*s  \n", pkt_data.size, pkt_data.data);
+            write(serial_fd, pkt_data.data, pkt_data.size);
+        }
+        av_packet_unref(&pkt_data);
     }
-    videoFrame->Release();
+
+    videoFrame = (IDeckLinkMutableVideoFrame *)av_buffer_get_opaque(pkt.buf);
+    if (m_deckLinkOutput->ScheduleVideoFrame(videoFrame,
+                                             pkt.pts *
+                                             video.st->time_base.num,
+                                             pkt.duration *
+                                             video.st->time_base.num,
+                                             video.st->time_base.den) !=
+        S_OK)
+        fprintf(stderr, "Error scheduling frame\n");
+    else
+        __atomic_add_fetch(&frames_scheduled, 1, __ATOMIC_RELAXED);
     av_packet_unref(&pkt);
+
+    return true;
+}
+
+/*
+ * Schedule count more frames. The completion callback and, when the
+ * callback came up empty, the decoder both get here; m_owed keeps the
+ * frames not scheduled yet and m_scheduling lets only one of them pop
+ * at a time without either waiting on the other.
+ */
+void Player::ScheduleFrames(unsigned count)
+{
+    unsigned owed;
+
+    __atomic_add_fetch(&m_owed, count, __ATOMIC_SEQ_CST);
+    do {
+        if (__atomic_exchange_n(&m_scheduling, 1, __ATOMIC_SEQ_CST))
+            return;
+        owed = __atomic_exchange_n(&m_owed, 0, __ATOMIC_SEQ_CST);
+        while (owed && ScheduleReadyFrame())
+            owed--;
+        if (owed)
+            __atomic_add_fetch(&m_owed, owed, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&m_scheduling, 0, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&m_owed, __ATOMIC_SEQ_CST) &&
+             avpacket_queue_nb_packets(&readyqueue));
 }
 
 void Player::WriteNextAudioSamples()
@@ -759,11 +1068,13 @@ void Player::WriteNextAudioSamples()
     int samples, off = 0;
 
     m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&bufferedSamples);
+    __atomic_store_n(&buffered_audio_samples, bufferedSamples,
+                     __ATOMIC_RELAXED);
 
     if (bufferedSamples > kAudioWaterlevel)
         return;
 
-    if (!packet_queue_get(&audioqueue, &pkt, 0))
+    if (!avpacket_queue_get(&audioqueue.q, &pkt, 0))
         return;
 
     samples = pkt.size / bytes_per_sample;
@@ -788,8 +1099,15 @@ void Player::WriteNextAudioSamples()
 HRESULT Player::ScheduledFrameCompleted(IDeckLinkVideoFrame *completedFrame,
                                         BMDOutputFrameCompletionResult result)
 {
+    __atomic_add_fetch(&frames_completed, 1, __ATOMIC_RELAXED);
+    if (result == bmdOutputFrameDisplayedLate)
+        __atomic_add_fetch(&frames_late, 1, __ATOMIC_RELAXED);
+    else if (result == bmdOutputFrameDropped)
+        __atomic_add_fetch(&frames_dropped, 1, __ATOMIC_RELAXED);
+
     if (fill_me)
-        ScheduleNextFrame(false);
+        ScheduleFrames(1);
+    check_played_out();
     return S_OK;
 }
 
@@ -800,15 +1118,18 @@ HRESULT Player::ScheduledPlaybackHasStopped()
 
 HRESULT Player::RenderAudioSamples(bool preroll)
 {
+    TRACE_BEGIN("RenderAudioSamples");
     if (audio.st) {
         // Provide further audio samples to the DeckLink API until our preferred buffer waterlevel is reached
         WriteNextAudioSamples();
+        check_played_out();
 
         if (preroll) {
             // Start audio and video output
             m_deckLinkOutput->StartScheduledPlayback(0, 100, 1.0);
         }
     }
+    TRACE_END("RenderAudioSamples");
 
     return S_OK;
 }
@@ -0,0 +1,221 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+#include "clockfit.h"
+
+void clock_fit_init(ClockFit *f, int64_t min_error)
+{
+    memset(f, 0, sizeof(*f));
+    f->min_error = min_error;
+    pthread_mutex_init(&f->mutex, NULL);
+}
+
+void clock_fit_close(ClockFit *f)
+{
+    pthread_mutex_destroy(&f->mutex);
+}
+
+static void reset_locked(ClockFit *f)
+{
+    f->count    = 0;
+    f->next     = 0;
+    f->outliers = 0;
+    f->valid    = 0;
+}
+
+void clock_fit_reset(ClockFit *f)
+{
+    pthread_mutex_lock(&f->mutex);
+    reset_locked(f);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/* Relative to the newest point, the sums stay well within a double */
+static void refit_locked(ClockFit *f)
+{
+    unsigned last = (f->next + CLOCK_FIT_POINTS - 1) % CLOCK_FIT_POINTS;
+    int64_t xr    = f->x[last];
+    int64_t yr    = f->y[last];
+    double mx = 0, my = 0, sxx = 0, sxy = 0, err = 0, slope;
+
+    for (unsigned i = 0; i < f->count; i++) {
+        mx += f->x[i] - xr;
+        my += f->y[i] - yr;
+    }
+    mx /= f->count;
+    my /= f->count;
+
+    for (unsigned i = 0; i < f->count; i++) {
+        double dx = f->x[i] - xr - mx;
+        double dy = f->y[i] - yr - my;
+
+        sxx += dx * dx;
+        sxy += dx * dy;
+    }
+    if (sxx <= 0)
+        return;
+    slope = sxy / sxx;
+
+    for (unsigned i = 0; i < f->count; i++) {
+        double r = f->y[i] - yr - my - slope * (f->x[i] - xr - mx);
+        err += r * r;
+    }
+
+    f->x0    = xr;
+    f->y0    = yr + llrint(my - slope * mx);
+    f->slope = slope;
+    f->error = sqrt(err / f->count);
+    f->valid = f->count >= CLOCK_FIT_MIN;
+}
+
+static void push_locked(ClockFit *f, int64_t x, int64_t y)
+{
+    f->x[f->next] = x;
+    f->y[f->next] = y;
+    f->next       = (f->next + 1) % CLOCK_FIT_POINTS;
+    if (f->count < CLOCK_FIT_POINTS)
+        f->count++;
+    f->points++;
+}
+
+int clock_fit_add(ClockFit *f, int64_t x, int64_t y)
+{
+    pthread_mutex_lock(&f->mutex);
+
+    if (f->valid) {
+        double r     = y - f->y0 - f->slope * (x - f->x0);
+        double limit = fmax(4 * f->error, (double)f->min_error);
+
+        if (fabs(r) > limit) {
+            f->rejected++;
+            f->ox[f->outliers] = x;
+            f->oy[f->outliers] = y;
+            if (++f->outliers < CLOCK_FIT_OUTLIERS) {
+                pthread_mutex_unlock(&f->mutex);
+                return 0;
+            }
+            /* a clock stepped, the run is the start of the new line */
+            reset_locked(f);
+            f->resets++;
+            f->rejected -= CLOCK_FIT_OUTLIERS;
+            for (int i = 0; i < CLOCK_FIT_OUTLIERS - 1; i++)
+                push_locked(f, f->ox[i], f->oy[i]);
+        }
+    }
+    f->outliers = 0;
+
+    push_locked(f, x, y);
+
+    if (f->count >= 2)
+        refit_locked(f);
+
+    pthread_mutex_unlock(&f->mutex);
+
+    return 1;
+}
+
+int clock_fit_map(ClockFit *f, int64_t x, int64_t *y)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&f->mutex);
+    if (f->valid) {
+        *y  = f->y0 + llrint(f->slope * (x - f->x0));
+        ret = 0;
+    }
+    pthread_mutex_unlock(&f->mutex);
+
+    return ret;
+}
+
+void clock_fit_report(ClockFit *f, const char *name, FILE *out)
+{
+    pthread_mutex_lock(&f->mutex);
+    if (f->valid)
+        fprintf(out, "%s: %.3f ppm drift, %.1f us rms - %lu points, "
+                "%lu left out, %lu resets\n", name,
+                (f->slope - 1) * 1e6, f->error,
+                f->points, f->rejected, f->resets);
+    else
+        fprintf(out, "%s: no fit - %lu points\n", name, f->points);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+#define CHECK_CARDS 16
+
+int clock_fit_check(const char *trace, FILE *out, FILE *report)
+{
+    ClockFit hw[CHECK_CARDS], frame[CHECK_CARDS];
+    char line[256], kind[16];
+    FILE *in = fopen(trace, "r");
+    int card;
+    long long x, y;
+
+    if (!in) {
+        fprintf(report, "Cannot open %s\n", trace);
+        return -1;
+    }
+
+    for (int i = 0; i < CHECK_CARDS; i++) {
+        clock_fit_init(&hw[i], 50);
+        clock_fit_init(&frame[i], 50);
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        int64_t h, mono;
+
+        if (sscanf(line, "%d %15s %lld %lld", &card, kind, &x, &y) != 4 ||
+            card < 0 || card >= CHECK_CARDS)
+            continue;
+
+        if (!strcmp(kind, "hw")) {
+            clock_fit_add(&hw[card], x, y);
+        } else if (!strcmp(kind, "frame")) {
+            clock_fit_add(&frame[card], x, y);
+            if (clock_fit_map(&frame[card], x, &h) == 0 &&
+                clock_fit_map(&hw[card], h, &mono) == 0)
+                fprintf(out, "%d %lld %" PRId64 "\n", card, x, mono);
+        }
+    }
+    fclose(in);
+
+    for (int i = 0; i < CHECK_CARDS; i++) {
+        char name[32];
+
+        if (hw[i].points) {
+            snprintf(name, sizeof(name), "Card %d hardware clock", i);
+            clock_fit_report(&hw[i], name, report);
+        }
+        if (frame[i].points) {
+            snprintf(name, sizeof(name), "Card %d frames", i);
+            clock_fit_report(&frame[i], name, report);
+        }
+        clock_fit_close(&hw[i]);
+        clock_fit_close(&frame[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef BMDTOOLS_CLOCKFIT_H
+#define BMDTOOLS_CLOCKFIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define CLOCK_FIT_POINTS   128
+#define CLOCK_FIT_MIN      4
+#define CLOCK_FIT_OUTLIERS 8
+
+/*
+ * Least squares line y = y0 + slope * (x - x0) through the last
+ * CLOCK_FIT_POINTS points of two microsecond clocks sampled together,
+ * the slope away from 1 is their drift.
+ *
+ * A point further than 4 times the rms residual (at least min_error)
+ * from the line is left out, unless CLOCK_FIT_OUTLIERS in a row are:
+ * then one of the clocks stepped and the fit starts over from them.
+ */
+typedef struct ClockFit {
+    pthread_mutex_t mutex;
+    int64_t min_error;
+
+    int64_t x[CLOCK_FIT_POINTS], y[CLOCK_FIT_POINTS];
+    unsigned count, next;
+    /* the current run of points left out */
+    int64_t ox[CLOCK_FIT_OUTLIERS], oy[CLOCK_FIT_OUTLIERS];
+    int outliers;
+
+    int valid;
+    int64_t x0, y0;
+    double slope;
+    double error;       /* rms residual */
+
+    unsigned long points, rejected, resets;
+} ClockFit;
+
+void clock_fit_init(ClockFit *f, int64_t min_error);
+void clock_fit_close(ClockFit *f);
+void clock_fit_reset(ClockFit *f);
+/* 1 if the point was used, 0 if it was left out */
+int clock_fit_add(ClockFit *f, int64_t x, int64_t y);
+int clock_fit_map(ClockFit *f, int64_t x, int64_t *y);
+void clock_fit_report(ClockFit *f, const char *name, FILE *out);
+
+/*
+ * Refit the points recorded with -K and print the monotonic time the
+ * fits give each frame. The trace has "<card> hw <hardware> <monotonic>"
+ * and "<card> frame <stream time> <hardware>" lines, in microseconds.
+ */
+int clock_fit_check(const char *trace, FILE *out, FILE *report);
+
+#endif /* BMDTOOLS_CLOCKFIT_H */
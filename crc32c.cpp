@@ -0,0 +1,212 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78
+
+/* Slicing by 8, table[k][b] is the crc of b followed by k zero bytes */
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+
+        for (int i = 0; i < 8; i++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++)
+        for (int k = 1; k < 8; k++)
+            crc_table[k][b] = (crc_table[k - 1][b] >> 8) ^
+                              crc_table[0][crc_table[k - 1][b] & 0xff];
+}
+
+static uint32_t crc32c_c(uint32_t crc, const uint8_t *data, size_t len)
+{
+    crc = ~crc;
+
+    for (; len && ((uintptr_t)data & 7); len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+
+    for (; len >= 8; len -= 8, data += 8) {
+        uint32_t lo, hi;
+
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+
+    for (; len; len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+
+    return ~crc;
+}
+
+#if defined(HAVE_X86) && defined(__x86_64__)
+/*
+ * A single chain of crc32 on 8 byte words, bound by its 3 cycle latency
+ * it still runs at ~5 GB/s, 2160p60 v210 needs 1.3 GB/s.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len)
+{
+    uint64_t c = ~crc;
+
+    for (; len && ((uintptr_t)data & 7); len--)
+        c = _mm_crc32_u8(c, *data++);
+
+    for (; len >= 32; len -= 32, data += 32) {
+        uint64_t w[4];
+
+        memcpy(w, data, sizeof(w));
+        c = _mm_crc32_u64(c, w[0]);
+        c = _mm_crc32_u64(c, w[1]);
+        c = _mm_crc32_u64(c, w[2]);
+        c = _mm_crc32_u64(c, w[3]);
+    }
+    for (; len >= 8; len -= 8, data += 8) {
+        uint64_t w;
+
+        memcpy(&w, data, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+    }
+
+    for (; len; len--)
+        c = _mm_crc32_u8(c, *data++);
+
+    return ~(uint32_t)c;
+}
+#endif
+
+CRC32CFunc crc32c_func(const char **name)
+{
+#if defined(HAVE_X86) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        *name = "sse4.2";
+        return crc32c_sse42;
+    }
+#endif
+    pthread_once(&crc_table_once, crc_table_init);
+    *name = "c";
+    return crc32c_c;
+}
+
+static int64_t monotonic_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void write_le(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+int hash_log_open(HashLog *h, const char *path)
+{
+    static const uint8_t header[8] = { 'B', 'M', 'D', 'C', 'R', 'C', 1, 0 };
+
+    memset(h, 0, sizeof(*h));
+    h->crc = crc32c_func(&h->name);
+    h->f   = fopen(path, "wb");
+    if (!h->f) {
+        fprintf(stderr, "Cannot open the hash file %s\n", path);
+        return -1;
+    }
+    setvbuf(h->f, NULL, _IOFBF, 1 << 16);
+
+    return fwrite(header, sizeof(header), 1, h->f) == 1 ? 0 : -1;
+}
+
+int hash_log_write(HashLog *h, int stream, int64_t pts, int flags,
+                   const uint8_t *data, int size)
+{
+    uint8_t rec[HASH_LOG_RECORD_SIZE];
+    int64_t t = monotonic_time();
+    uint32_t crc = h->crc(0, data, size);
+
+    h->time += monotonic_time() - t;
+    h->packets++;
+    h->bytes += size;
+
+    write_le(rec,      crc,    4);
+    write_le(rec + 4,  size,   4);
+    write_le(rec + 8,  pts,    8);
+    write_le(rec + 16, stream, 2);
+    write_le(rec + 18, flags,  2);
+
+    if (fwrite(rec, sizeof(rec), 1, h->f) != 1) {
+        h->failed++;
+        return -1;
+    }
+
+    return 0;
+}
+
+int hash_log_close(HashLog *h)
+{
+    int ret = h->failed ? -1 : 0;
+
+    if (h->f) {
+        /* a buffered record may only fail to reach the disk here */
+        if (ferror(h->f))
+            ret = -1;
+        if (fclose(h->f))
+            ret = -1;
+    }
+    h->f = NULL;
+
+    return ret;
+}
+
+void hash_log_report(HashLog *h, FILE *f)
+{
+    if (!h->packets)
+        return;
+
+    fprintf(f, "Hashed %" PRIu64 " packets, %.1f MB (%s) - %.0f MB/s\n",
+            h->packets, h->bytes / 1048576.0, h->name,
+            h->time ? h->bytes / (double)h->time : 0.0);
+    if (h->failed)
+        fprintf(f, "Failed to log %" PRIu64 " hashes\n", h->failed);
+}
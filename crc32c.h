@@ -0,0 +1,66 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef BMDTOOLS_CRC32C_H
+#define BMDTOOLS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uint32_t (*CRC32CFunc)(uint32_t crc, const uint8_t *data, size_t len);
+
+/* Castagnoli crc, SSE4.2 crc32 instructions when the cpu has them */
+CRC32CFunc crc32c_func(const char **name);
+
+/*
+ * Sidecar with the crc of every packet handed to the muxers, so a
+ * recording can be checked without hashing it again. After the 8 byte
+ * header "BMDCRC" 0x01 0x00 every packet takes a 20 byte little endian
+ * record:
+ *
+ *   0  u32 crc32c of the payload
+ *   4  u32 payload size
+ *   8  i64 pts, in frames for video and samples for audio
+ *   16 u16 stream index
+ *   18 u16 packet flags
+ */
+#define HASH_LOG_RECORD_SIZE 20
+
+typedef struct HashLog {
+    FILE *f;
+    CRC32CFunc crc;
+    const char *name;
+
+    uint64_t packets;
+    uint64_t bytes;
+    int64_t time;       /* microseconds spent hashing */
+    uint64_t failed;    /* records that could not be written */
+} HashLog;
+
+int hash_log_open(HashLog *h, const char *path);
+int hash_log_write(HashLog *h, int stream, int64_t pts, int flags,
+                   const uint8_t *data, int size);
+int hash_log_close(HashLog *h);
+void hash_log_report(HashLog *h, FILE *f);
+
+#endif /* BMDTOOLS_CRC32C_H */
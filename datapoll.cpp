@@ -0,0 +1,251 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "datapoll.h"
+
+extern "C" {
+#include "libavutil/time.h"
+}
+
+#define MESSAGE_GAP   20000
+#define CLOCK_PERIOD 100000
+#define CLOCK_READS       4
+
+static void sample_clock(DataPoller *p)
+{
+    int64_t mono = av_gettime_relative();
+    int64_t real = av_gettime();
+
+    /* halfway between the two reads */
+    mono = (mono + av_gettime_relative()) / 2;
+    __atomic_store_n(&p->clock_offset, real - mono, __ATOMIC_RELAXED);
+}
+
+static void sample_hardware_clock(DataPoller *p)
+{
+    int64_t best = INT64_MAX, hw = 0, mono = 0;
+
+    for (int i = 0; i < CLOCK_READS; i++) {
+        int64_t before = av_gettime_relative(), after, t;
+
+        if (p->clock.read(p->clock.opaque, &t) < 0)
+            return;
+        after = av_gettime_relative();
+        if (after - before < best) {
+            best = after - before;
+            hw   = t;
+            mono = before + best / 2;
+        }
+    }
+
+    clock_fit_add(p->clock.fit, hw, mono);
+    if (p->clock.trace)
+        fprintf(p->clock.trace, "%d hw %" PRId64 " %" PRId64 "\n",
+                p->clock.card, hw, mono);
+}
+
+static void write_frame_trace(DataPoller *p)
+{
+    unsigned head = p->trace_head;
+    unsigned tail = __atomic_load_n(&p->trace_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+        fprintf(p->clock.trace, "%d frame %" PRId64 " %" PRId64 "\n",
+                p->clock.card, p->trace_t[head % DATA_TRACE_MAX],
+                p->trace_hw[head % DATA_TRACE_MAX]);
+    __atomic_store_n(&p->trace_head, head, __ATOMIC_RELEASE);
+}
+
+static void flush_message(DataPoller *p)
+{
+    AVPacket pkt;
+
+    if (!p->message_len)
+        return;
+
+    if (av_new_packet(&pkt, p->message_len) < 0) {
+        p->dropped++;
+    } else {
+        memcpy(pkt.data, p->message, p->message_len);
+        pkt.stream_index = p->stream_index;
+        pkt.flags       |= AV_PKT_FLAG_KEY;
+        if (avpacket_queue_put_stamp(p->queue, &pkt, p->message_stamp) < 0) {
+            av_packet_unref(&pkt);
+            p->dropped++;
+        } else {
+            p->messages++;
+        }
+    }
+    p->message_len = 0;
+}
+
+static void read_serial(DataPoller *p)
+{
+    char buf[512];
+    int64_t now = av_gettime_relative();
+    ssize_t n;
+
+    while ((n = read(p->serial_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            char c = buf[i];
+
+            /* a \r ends the message unless a \n follows it */
+            if (c != '\n' && p->message_len &&
+                p->message[p->message_len - 1] == '\r')
+                flush_message(p);
+            if (!p->message_len)
+                p->message_stamp = now;
+            p->message[p->message_len++] = c;
+            if (c == '\n' || p->message_len == DATA_MESSAGE_MAX)
+                flush_message(p);
+        }
+        p->last_byte = now;
+    }
+}
+
+static void *poll_data(void *ctx)
+{
+    DataPoller *p = (DataPoller *)ctx;
+    struct pollfd fds[2];
+    int nfds = p->serial_fd >= 0 ? 2 : 1;
+    int64_t last_clock = av_gettime_relative();
+
+    fds[0].fd     = p->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].fd     = p->serial_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        int64_t now;
+        int timeout = p->message_len ? MESSAGE_GAP / 1000 : CLOCK_PERIOD / 1000;
+
+        if (poll(fds, nfds, timeout) < 0 && errno != EINTR)
+            break;
+        if (fds[0].revents)
+            break;
+        if (nfds > 1 && (fds[1].revents & POLLIN))
+            read_serial(p);
+        /* a hung up device would wake every poll, keep the clock going */
+        if (nfds > 1 && (fds[1].revents & (POLLHUP | POLLERR | POLLNVAL))) {
+            fprintf(stderr, "The serial device hung up, no more messages\n");
+            flush_message(p);
+            nfds = 1;
+        }
+
+        now = av_gettime_relative();
+        if (p->message_len && now - p->last_byte >= MESSAGE_GAP)
+            flush_message(p);
+        if (now - last_clock >= CLOCK_PERIOD) {
+            sample_clock(p);
+            if (p->clock.read)
+                sample_hardware_clock(p);
+            if (p->clock.trace)
+                write_frame_trace(p);
+            last_clock = now;
+        }
+    }
+
+    flush_message(p);
+    if (p->clock.trace)
+        write_frame_trace(p);
+    return NULL;
+}
+
+int data_poller_start(DataPoller *p, int serial_fd, int stream_index,
+                      AVPacketQueue *queue, const DataClock *clock,
+                      const ThreadPlacement *placement)
+{
+    memset(p, 0, sizeof(*p));
+    p->serial_fd    = serial_fd;
+    p->stream_index = stream_index;
+    p->queue        = queue;
+    if (clock)
+        p->clock = *clock;
+    sample_clock(p);
+    if (p->clock.read)
+        sample_hardware_clock(p);
+
+    if (pipe(p->wake) < 0) {
+        fprintf(stderr, "Cannot create the data poller pipe: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    if (thread_create(&p->th, placement, poll_data, p)) {
+        close(p->wake[0]);
+        close(p->wake[1]);
+        return -1;
+    }
+    p->running = 1;
+
+    return 0;
+}
+
+void data_poller_stop(DataPoller *p)
+{
+    if (!p->running)
+        return;
+
+    if (write(p->wake[1], "", 1) < 0)
+        fprintf(stderr, "Cannot stop the data poller: %s\n", strerror(errno));
+    pthread_join(p->th, NULL);
+    close(p->wake[0]);
+    close(p->wake[1]);
+    p->running = 0;
+}
+
+/* The wallclock at a time taken with av_gettime_relative() */
+int64_t data_poller_wallclock(DataPoller *p, int64_t monotonic)
+{
+    return monotonic + __atomic_load_n(&p->clock_offset, __ATOMIC_RELAXED);
+}
+
+void data_poller_trace_frame(DataPoller *p, int64_t t, int64_t hw)
+{
+    unsigned tail = p->trace_tail;
+
+    if (!p->clock.trace)
+        return;
+    if (tail - __atomic_load_n(&p->trace_head, __ATOMIC_ACQUIRE) >=
+        DATA_TRACE_MAX) {
+        __atomic_add_fetch(&p->trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    p->trace_t[tail % DATA_TRACE_MAX]  = t;
+    p->trace_hw[tail % DATA_TRACE_MAX] = hw;
+    __atomic_store_n(&p->trace_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void data_poller_report(DataPoller *p, FILE *f)
+{
+    if (p->serial_fd < 0)
+        return;
+
+    fprintf(f, "Serial messages: %lu - dropped %lu\n",
+            p->messages, p->dropped);
+}
@@ -0,0 +1,98 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef BMDTOOLS_DATAPOLL_H
+#define BMDTOOLS_DATAPOLL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "packetqueue.h"
+#include "affinity.h"
+#include "clockfit.h"
+
+#define DATA_MESSAGE_MAX 4096
+#define DATA_TRACE_MAX    256
+
+/*
+ * Samples the side data of a card away from its capture callback.
+ *
+ * Serial messages are read as they arrive, split after line ends or on
+ * a 20 ms gap in the input, and queued with their line ends and the
+ * monotonic time of their first byte for the writer to place at the
+ * nearest video frame.
+ *
+ * The wallclock is not read per frame, the poller keeps the offset from
+ * the monotonic clock the frames are stamped with up to date instead.
+ * Given a DataClock it also samples the hardware clock of the card
+ * against the monotonic one, several times keeping the tightest read,
+ * and writes the -K trace, including the frame samples the capture
+ * callback hands over with data_poller_trace_frame().
+ */
+/* Reads the hardware reference clock of the card, in microseconds */
+typedef int (*HardwareClockFunc)(void *opaque, int64_t *hw);
+
+typedef struct DataClock {
+    HardwareClockFunc read;
+    void *opaque;
+    ClockFit *fit;              /* hardware to monotonic */
+    FILE *trace;                /* -K */
+    int card;
+} DataClock;
+
+typedef struct DataPoller {
+    int serial_fd;              /* -1 for the wallclock alone */
+    int stream_index;
+    AVPacketQueue *queue;
+
+    int wake[2];
+    pthread_t th;
+    int running;
+
+    char message[DATA_MESSAGE_MAX];
+    int message_len;
+    int64_t message_stamp;
+    int64_t last_byte;
+
+    int64_t clock_offset;       /* realtime minus monotonic, us */
+    DataClock clock;
+
+    /* single producer ring of frame samples for the trace */
+    int64_t trace_t[DATA_TRACE_MAX], trace_hw[DATA_TRACE_MAX];
+    unsigned trace_head, trace_tail;
+
+    unsigned long messages;
+    unsigned long dropped;
+    unsigned long trace_dropped;
+} DataPoller;
+
+int data_poller_start(DataPoller *p, int serial_fd, int stream_index,
+                      AVPacketQueue *queue, const DataClock *clock,
+                      const ThreadPlacement *placement);
+void data_poller_stop(DataPoller *p);
+int64_t data_poller_wallclock(DataPoller *p, int64_t monotonic);
+/* Capture callback only, never blocks, the sample is dropped if full */
+void data_poller_trace_frame(DataPoller *p, int64_t t, int64_t hw);
+void data_poller_report(DataPoller *p, FILE *f);
+
+#endif /* BMDTOOLS_DATAPOLL_H */
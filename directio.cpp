@@ -0,0 +1,462 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "directio.h"
+extern "C" {
+#include "libavutil/mem.h"
+#include "libavutil/time.h"
+}
+
+/* Covers the logical block size of anything O_DIRECT runs on */
+#define DIRECT_ALIGN   4096
+#define AVIO_BUF_SIZE  (256 * 1024)
+
+static int pwrite_all(int fd, const uint8_t *buf, size_t len, int64_t off)
+{
+    while (len) {
+        ssize_t ret = pwrite(fd, buf, len, off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+static void count_submit(DirectWriter *w)
+{
+    if (__atomic_add_fetch(&w->inflight, 1, __ATOMIC_RELAXED) > w->max_inflight)
+        w->max_inflight = w->inflight;
+    if (w->shared)
+        __atomic_add_fetch(&w->shared->inflight, 1, __ATOMIC_RELAXED);
+}
+
+static void write_done(DirectWriter *w, DirectBuffer *b, int ok)
+{
+    int64_t latency = av_gettime_relative() - b->submitted;
+
+    latency_record(&w->latency, latency);
+    if (w->shared) {
+        latency_record(&w->shared->latency, latency);
+        __atomic_sub_fetch(&w->shared->inflight, 1, __ATOMIC_RELAXED);
+        if (ok)
+            __atomic_add_fetch(&w->shared->bytes, w->buf_size,
+                               __ATOMIC_RELAXED);
+    }
+    if (ok) {
+        __atomic_add_fetch(&w->bytes, w->buf_size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->writes, 1, __ATOMIC_RELAXED);
+    } else if (!w->error) {
+        fprintf(stderr, "Direct I/O write failed at %" PRId64 ": %s\n",
+                b->offset, strerror(errno));
+        w->error = 1;
+    }
+    __atomic_sub_fetch(&w->inflight, 1, __ATOMIC_RELAXED);
+    b->busy = 0;
+}
+
+#ifdef HAVE_LIBURING
+static int submit_sqe(DirectWriter *w, DirectBuffer *b)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&w->ring);
+
+    if (!sqe)
+        return -1;
+    io_uring_prep_write(sqe, w->fd, b->data + b->done, w->buf_size - b->done,
+                        b->offset + b->done);
+    io_uring_sqe_set_data(sqe, b);
+    return io_uring_submit(&w->ring) < 0 ? -1 : 0;
+}
+
+/* Retire completions, waiting for one if wait is set */
+static void reap(DirectWriter *w, int wait)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    for (;;) {
+        ret = wait ? io_uring_wait_cqe(&w->ring, &cqe) :
+                     io_uring_peek_cqe(&w->ring, &cqe);
+        if (ret == -EINTR)
+            continue;
+        if (ret < 0)
+            return;
+        DirectBuffer *b = (DirectBuffer *)io_uring_cqe_get_data(cqe);
+        int res         = cqe->res;
+        io_uring_cqe_seen(&w->ring, cqe);
+
+        if (res > 0 && b->done + res < w->buf_size) {
+            // Short write, send the rest.
+            b->done += res;
+            if (submit_sqe(w, b) < 0)
+                write_done(w, b, 0);
+        } else {
+            if (res < 0)
+                errno = -res;
+            write_done(w, b, res > 0);
+        }
+        wait = 0;
+    }
+}
+
+static void submit(DirectWriter *w, DirectBuffer *b)
+{
+    b->busy      = 1;
+    b->done      = 0;
+    b->submitted = av_gettime_relative();
+    count_submit(w);
+    if (submit_sqe(w, b) < 0)
+        write_done(w, b, 0);
+    reap(w, 0);
+}
+
+static void wait_buffer(DirectWriter *w, DirectBuffer *b)
+{
+    while (b->busy)
+        reap(w, 1);
+}
+
+static int start_writer(DirectWriter *w)
+{
+    int ret = io_uring_queue_init(w->depth, &w->ring, 0);
+
+    if (ret < 0) {
+        fprintf(stderr, "Could not set up io_uring: %s\n", strerror(-ret));
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_writer(DirectWriter *w)
+{
+    io_uring_queue_exit(&w->ring);
+}
+#else
+/* Writes the buffers in the order they were filled */
+static void *writer_thread(void *ctx)
+{
+    DirectWriter *w = (DirectWriter *)ctx;
+
+    pthread_mutex_lock(&w->mutex);
+    for (;;) {
+        DirectBuffer *b = &w->bufs[w->next];
+
+        while (!b->busy && !w->quit)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        if (!b->busy)
+            break;
+        pthread_mutex_unlock(&w->mutex);
+
+        int ok = !pwrite_all(w->fd, b->data, w->buf_size, b->offset);
+
+        pthread_mutex_lock(&w->mutex);
+        write_done(w, b, ok);
+        w->next = (w->next + 1) % w->depth;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+static void submit(DirectWriter *w, DirectBuffer *b)
+{
+    pthread_mutex_lock(&w->mutex);
+    b->busy      = 1;
+    b->submitted = av_gettime_relative();
+    count_submit(w);
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static void wait_buffer(DirectWriter *w, DirectBuffer *b)
+{
+    pthread_mutex_lock(&w->mutex);
+    while (b->busy)
+        pthread_cond_wait(&w->cond, &w->mutex);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static int start_writer(DirectWriter *w)
+{
+    if (pthread_create(&w->th, NULL, writer_thread, w)) {
+        fprintf(stderr, "Could not start the output writer thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_writer(DirectWriter *w)
+{
+    pthread_mutex_lock(&w->mutex);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->th, NULL);
+}
+#endif
+
+static void drain(DirectWriter *w)
+{
+    for (int i = 0; i < w->depth; i++)
+        wait_buffer(w, &w->bufs[i]);
+}
+
+static void append(DirectWriter *w, const uint8_t *buf, size_t size)
+{
+    while (size) {
+        DirectBuffer *b = &w->bufs[w->cur];
+        size_t len      = FFMIN(size, w->buf_size - w->fill);
+
+        if (buf)
+            memcpy(b->data + w->fill, buf, len);
+        else
+            memset(b->data + w->fill, 0, len);
+        w->fill += len;
+        size    -= len;
+        if (buf)
+            buf += len;
+
+        if (w->fill == w->buf_size) {
+            b->offset = w->offset;
+            submit(w, b);
+            w->offset += w->buf_size;
+            w->fill    = 0;
+            w->cur     = (w->cur + 1) % w->depth;
+            wait_buffer(w, &w->bufs[w->cur]);
+        }
+    }
+}
+
+/* Rewrite data behind the append point, usually a header being patched */
+static void overwrite(DirectWriter *w, const uint8_t *buf, size_t size,
+                      int64_t pos)
+{
+    if (pos < w->offset) {
+        size_t len = FFMIN(size, (size_t)(w->offset - pos));
+
+        drain(w);
+        if (pwrite_all(w->fd_buffered, buf, len, pos) < 0 && !w->error) {
+            fprintf(stderr, "Output write failed at %" PRId64 ": %s\n",
+                    pos, strerror(errno));
+            w->error = 1;
+        }
+        buf  += len;
+        size -= len;
+        pos  += len;
+    }
+    memcpy(w->bufs[w->cur].data + pos - w->offset, buf, size);
+}
+
+static int write_packet(void *opaque, uint8_t *buf, int size)
+{
+    DirectWriter *w = (DirectWriter *)opaque;
+    int64_t end     = w->offset + w->fill;
+    size_t head;
+
+    if (w->error)
+        return AVERROR(EIO);
+
+    if (w->pos > end)
+        append(w, NULL, w->pos - end);
+    else if (w->pos < end) {
+        head = FFMIN((int64_t)size, end - w->pos);
+        overwrite(w, buf, head, w->pos);
+        buf    += head;
+        size   -= head;
+        w->pos += head;
+    }
+    append(w, buf, size);
+    w->pos += size;
+    w->size = FFMAX(w->size, w->pos);
+
+    return w->error ? AVERROR(EIO) : 0;
+}
+
+static int64_t seek(void *opaque, int64_t offset, int whence)
+{
+    DirectWriter *w = (DirectWriter *)opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return w->size;
+    case SEEK_SET:
+        w->pos = offset;
+        break;
+    case SEEK_CUR:
+        w->pos += offset;
+        break;
+    case SEEK_END:
+        w->pos = w->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    return w->pos;
+}
+
+static int open_direct(const char *path)
+{
+    int fd;
+
+#ifdef O_DIRECT
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd >= 0 || errno != EINVAL)
+        return fd;
+    fprintf(stderr, "O_DIRECT not supported for '%s', "
+            "writing through the page cache\n", path);
+#endif
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#ifdef F_NOCACHE
+    if (fd >= 0)
+        fcntl(fd, F_NOCACHE, 1);
+#endif
+    return fd;
+}
+
+int direct_writer_open(DirectWriter *w, const char *path, size_t buf_size,
+                       int depth)
+{
+    uint8_t *avio_buf;
+
+    memset(w, 0, sizeof(*w));
+    w->fd = w->fd_buffered = -1;
+    w->buf_size = FFMAX(buf_size + DIRECT_ALIGN - 1, DIRECT_ALIGN) &
+                  ~(size_t)(DIRECT_ALIGN - 1);
+    w->depth    = av_clip(depth, 2, DIRECT_MAX_DEPTH);
+    latency_init(&w->latency, "disk write");
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    w->fd = open_direct(path);
+    if (w->fd < 0) {
+        fprintf(stderr, "Could not open '%s'\n", path);
+        goto fail;
+    }
+    w->fd_buffered = open(path, O_WRONLY);
+    if (w->fd_buffered < 0) {
+        fprintf(stderr, "Could not open '%s'\n", path);
+        goto fail;
+    }
+
+    for (int i = 0; i < w->depth; i++) {
+        if (posix_memalign((void **)&w->bufs[i].data, DIRECT_ALIGN,
+                           w->buf_size)) {
+            fprintf(stderr, "Could not allocate the output buffers\n");
+            goto fail;
+        }
+    }
+
+    avio_buf = (uint8_t *)av_malloc(AVIO_BUF_SIZE);
+    if (!avio_buf)
+        goto fail;
+    w->avio = avio_alloc_context(avio_buf, AVIO_BUF_SIZE, 1, w, NULL,
+                                 write_packet, seek);
+    if (!w->avio) {
+        av_free(avio_buf);
+        goto fail;
+    }
+
+    if (start_writer(w) < 0)
+        goto fail;
+    w->running = 1;
+
+    w->report_time = av_gettime_relative();
+    return 0;
+
+fail:
+    direct_writer_close(w);
+    return -1;
+}
+
+/* Flush the muxer leftovers and the last, partial buffer */
+int direct_writer_close(DirectWriter *w)
+{
+    if (w->avio) {
+        avio_flush(w->avio);
+        av_freep(&w->avio->buffer);
+        av_freep(&w->avio);
+    }
+    if (w->running) {
+        drain(w);
+        stop_writer(w);
+        w->running = 0;
+        if (w->fill &&
+            pwrite_all(w->fd_buffered, w->bufs[w->cur].data, w->fill,
+                       w->offset) < 0) {
+            fprintf(stderr, "Output write failed at %" PRId64 ": %s\n",
+                    w->offset, strerror(errno));
+            w->error = 1;
+        }
+    }
+
+    for (int i = 0; i < DIRECT_MAX_DEPTH; i++)
+        free(w->bufs[i].data);
+    memset(w->bufs, 0, sizeof(w->bufs));
+    if (w->fd >= 0)
+        close(w->fd);
+    if (w->fd_buffered >= 0)
+        close(w->fd_buffered);
+    w->fd = w->fd_buffered = -1;
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+
+    return w->error ? -1 : 0;
+}
+
+void direct_stats_init(DirectStats *s)
+{
+    memset(s, 0, sizeof(*s));
+    latency_init(&s->latency, "disk write");
+}
+
+void direct_writer_report(DirectWriter *w, FILE *f)
+{
+    int64_t now     = av_gettime_relative();
+    uint64_t bytes  = __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+    double elapsed  = (now - w->report_time) / 1000000.0;
+
+    if (elapsed <= 0)
+        return;
+
+    fprintf(f, "Direct I/O %.1f MB/s - %d/%d writes in flight (max %d)\n",
+            (bytes - w->report_bytes) / elapsed / 1024 / 1024,
+            __atomic_load_n(&w->inflight, __ATOMIC_RELAXED), w->depth,
+            w->max_inflight);
+    latency_report(&w->latency, f);
+
+    w->report_bytes = bytes;
+    w->report_time  = now;
+}
@@ -0,0 +1,105 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_DIRECTIO_H
+#define BMDTOOLS_DIRECTIO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "latency.h"
+
+extern "C" {
+#include "libavformat/avio.h"
+}
+
+#define DIRECT_MAX_DEPTH 16
+
+/* Totals several writers can add to, e.g. the files of a segmenter */
+typedef struct DirectStats {
+    uint64_t bytes;
+    int inflight;
+    LatencyHistogram latency;
+} DirectStats;
+
+typedef struct DirectBuffer {
+    uint8_t *data;
+    int64_t offset;
+    size_t done;        /* io_uring short writes */
+    int busy;
+    int64_t submitted;
+} DirectBuffer;
+
+/*
+ * File output bypassing the page cache: the muxer output is gathered in
+ * large aligned buffers, each full buffer is written with O_DIRECT while
+ * the next one fills. Writes go through io_uring when built with
+ * HAVE_LIBURING, through a pwrite() thread otherwise.
+ *
+ * Seeking back to patch headers is supported, those writes and the
+ * unaligned tail go through a second, buffered descriptor.
+ */
+typedef struct DirectWriter {
+    int fd;             /* O_DIRECT if the filesystem accepts it */
+    int fd_buffered;
+    int direct;
+    int error;
+
+    DirectBuffer bufs[DIRECT_MAX_DEPTH];
+    int depth;
+    size_t buf_size;
+    int cur;            /* buffer being filled */
+    size_t fill;
+    int64_t offset;     /* file offset of the current buffer */
+    int64_t pos, size;  /* as seen by the muxer */
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#else
+    pthread_t th;
+    int next;           /* next buffer the thread writes */
+    int quit;
+#endif
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+
+    AVIOContext *avio;
+
+    int inflight, max_inflight;
+    uint64_t bytes, writes;
+    uint64_t report_bytes;
+    int64_t report_time;
+    LatencyHistogram latency;
+    DirectStats *shared;    /* optional, also counted there */
+} DirectWriter;
+
+int direct_writer_open(DirectWriter *w, const char *path, size_t buf_size,
+                       int depth);
+int direct_writer_close(DirectWriter *w);
+void direct_writer_report(DirectWriter *w, FILE *f);
+void direct_stats_init(DirectStats *s);
+
+#endif /* BMDTOOLS_DIRECTIO_H */
@@ -0,0 +1,278 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include "encode.h"
+extern "C" {
+#include "libavutil/time.h"
+#include "libavutil/intreadwrite.h"
+#include "libswscale/swscale.h"
+}
+
+int video_encoder_open(VideoEncoder *e, const char *name, AVDictionary **opts,
+                       const AVCodecParameters *par, AVRational time_base,
+                       AVRational frame_rate, int global_header)
+{
+    AVCodec *decoder, *encoder;
+
+    memset(e, 0, sizeof(*e));
+
+    encoder = avcodec_find_encoder_by_name(name);
+    if (!encoder) {
+        fprintf(stderr, "Unknown encoder %s\n", name);
+        return -1;
+    }
+    decoder = avcodec_find_decoder(par->codec_id);
+    if (!decoder) {
+        fprintf(stderr, "Cannot unpack the captured video\n");
+        return -1;
+    }
+
+    e->dec = avcodec_alloc_context3(decoder);
+    e->enc = avcodec_alloc_context3(encoder);
+    e->frame = av_frame_alloc();
+    e->scaled = av_frame_alloc();
+    if (!e->dec || !e->enc || !e->frame || !e->scaled)
+        goto fail;
+
+    if (avcodec_parameters_to_context(e->dec, par) < 0)
+        goto fail;
+    e->dec->pix_fmt = (enum AVPixelFormat)par->format;
+    if (avcodec_open2(e->dec, decoder, NULL) < 0) {
+        fprintf(stderr, "Cannot unpack the captured video\n");
+        goto fail;
+    }
+
+    e->enc->width       = par->width;
+    e->enc->height      = par->height;
+    e->enc->time_base   = time_base;
+    e->enc->framerate   = frame_rate;
+    e->enc->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    e->enc->thread_count = 0;
+    /* The decoded format is only known once the first frame is out,
+     * assume it matches the raw one unless the encoder cannot take it,
+     * then pick the one losing the least of it. */
+    e->enc->pix_fmt     = (enum AVPixelFormat)par->format;
+    if (encoder->pix_fmts)
+        e->enc->pix_fmt =
+            avcodec_find_best_pix_fmt_of_list(encoder->pix_fmts,
+                                              (enum AVPixelFormat)par->format,
+                                              0, NULL);
+    if (global_header)
+        e->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (avcodec_open2(e->enc, encoder, opts) < 0) {
+        fprintf(stderr, "Cannot open the %s encoder\n", name);
+        goto fail;
+    }
+
+    fprintf(stderr, "Encoding video with %s, %d threads\n",
+            name, e->enc->thread_count);
+
+    return 0;
+
+fail:
+    video_encoder_close(e);
+    return -1;
+}
+
+int packet_dimensions(const AVPacket *pkt, int *width, int *height)
+{
+    int size;
+    const uint8_t *sd = av_packet_get_side_data(pkt, AV_PKT_DATA_PARAM_CHANGE,
+                                                &size);
+
+    /* only the dimensions are ever set, they come right after the flags */
+    if (!sd || size < 12 ||
+        AV_RL32(sd) != AV_SIDE_DATA_PARAM_CHANGE_DIMENSIONS)
+        return 0;
+
+    *width  = AV_RL32(sd + 4);
+    *height = AV_RL32(sd + 8);
+    return 1;
+}
+
+int packet_set_dimensions(AVPacket *pkt, int width, int height)
+{
+    uint8_t *sd = av_packet_new_side_data(pkt, AV_PKT_DATA_PARAM_CHANGE, 12);
+
+    if (!sd)
+        return -1;
+
+    AV_WL32(sd,     AV_SIDE_DATA_PARAM_CHANGE_DIMENSIONS);
+    AV_WL32(sd + 4, width);
+    AV_WL32(sd + 8, height);
+    return 0;
+}
+
+/* The raw video changed size, the encoder keeps its own and scales */
+static int reopen_decoder(VideoEncoder *e, int width, int height)
+{
+    AVCodecContext *dec = avcodec_alloc_context3(e->dec->codec);
+
+    if (!dec)
+        return -1;
+
+    dec->width                 = width;
+    dec->height                = height;
+    dec->pix_fmt               = e->dec->pix_fmt;
+    dec->codec_tag             = e->dec->codec_tag;
+    dec->bits_per_coded_sample = e->dec->bits_per_coded_sample;
+    if (avcodec_open2(dec, e->dec->codec, NULL) < 0) {
+        avcodec_free_context(&dec);
+        return -1;
+    }
+
+    avcodec_free_context(&e->dec);
+    e->dec = dec;
+
+    if (e->sws)
+        sws_freeContext(e->sws);
+    e->sws = NULL;
+    av_frame_unref(e->scaled);
+
+    return 0;
+}
+
+static int receive_packets(VideoEncoder *e, EncodedPacketCallback cb)
+{
+    AVPacket pkt;
+    int ret;
+
+    for (;;) {
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+
+        ret = avcodec_receive_packet(e->enc, &pkt);
+        if (ret < 0)
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+
+        pkt.stream_index = e->stream_index;
+        cb(e->opaque, &pkt);
+    }
+}
+
+static int encode_frame(VideoEncoder *e, AVFrame *frame,
+                        EncodedPacketCallback cb)
+{
+    int ret;
+
+    if (frame && (frame->format != e->enc->pix_fmt ||
+                  frame->width  != e->enc->width ||
+                  frame->height != e->enc->height)) {
+        if (!e->sws) {
+            e->sws = sws_getContext(frame->width, frame->height,
+                                    (enum AVPixelFormat)frame->format,
+                                    e->enc->width, e->enc->height,
+                                    e->enc->pix_fmt,
+                                    SWS_BILINEAR, NULL, NULL, NULL);
+            e->scaled->format = e->enc->pix_fmt;
+            e->scaled->width  = e->enc->width;
+            e->scaled->height = e->enc->height;
+            if (!e->sws || av_frame_get_buffer(e->scaled, 32) < 0)
+                return -1;
+        }
+        if (av_frame_make_writable(e->scaled) < 0)
+            return -1;
+        sws_scale(e->sws, frame->data, frame->linesize, 0, frame->height,
+                  e->scaled->data, e->scaled->linesize);
+        e->scaled->pts = frame->pts;
+        frame = e->scaled;
+    }
+
+    ret = avcodec_send_frame(e->enc, frame);
+    if (ret < 0)
+        return ret;
+
+    return receive_packets(e, cb);
+}
+
+int video_encoder_encode(VideoEncoder *e, AVPacket *pkt,
+                         EncodedPacketCallback cb)
+{
+    int64_t start = av_gettime_relative();
+    int64_t pts   = pkt->pts;
+    int64_t elapsed;
+    int width, height, ret;
+
+    if (packet_dimensions(pkt, &width, &height) &&
+        (width != e->dec->width || height != e->dec->height) &&
+        reopen_decoder(e, width, height) < 0) {
+        fprintf(stderr, "Cannot unpack %dx%d video\n", width, height);
+        av_packet_unref(pkt);
+        return -1;
+    }
+
+    ret = avcodec_send_packet(e->dec, pkt);
+    av_packet_unref(pkt);
+    if (ret < 0)
+        return ret;
+
+    while ((ret = avcodec_receive_frame(e->dec, e->frame)) >= 0) {
+        e->frame->pts = pts;
+        ret = encode_frame(e, e->frame, cb);
+        av_frame_unref(e->frame);
+        if (ret < 0)
+            return ret;
+    }
+
+    elapsed = av_gettime_relative() - start;
+    e->frames++;
+    e->total_time += elapsed;
+    if (elapsed > e->max_time)
+        e->max_time = elapsed;
+
+    return 0;
+}
+
+void video_encoder_flush(VideoEncoder *e, EncodedPacketCallback cb)
+{
+    encode_frame(e, NULL, cb);
+}
+
+void video_encoder_close(VideoEncoder *e)
+{
+    avcodec_free_context(&e->dec);
+    avcodec_free_context(&e->enc);
+    av_frame_free(&e->frame);
+    av_frame_free(&e->scaled);
+    if (e->sws)
+        sws_freeContext(e->sws);
+    e->sws = NULL;
+}
+
+void video_encoder_report(VideoEncoder *e, FILE *f)
+{
+    unsigned long frames = e->frames - e->report_frames;
+
+    if (!frames)
+        return;
+
+    fprintf(f, "Encoded %lu frames - %.2f ms/frame (max %.2f ms)\n",
+            e->frames,
+            (e->total_time - e->report_total_time) / 1000.0 / frames,
+            e->max_time / 1000.0);
+
+    e->report_frames     = e->frames;
+    e->report_total_time = e->total_time;
+}
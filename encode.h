@@ -0,0 +1,71 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_ENCODE_H
+#define BMDTOOLS_ENCODE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+typedef void (*EncodedPacketCallback)(void *opaque, AVPacket *pkt);
+
+/*
+ * Turns the raw captured video packets into compressed ones.
+ *
+ * The raw packet is unpacked with the matching libavcodec decoder,
+ * converted if the encoder does not take that pixel format and encoded
+ * with frame and slice threading enabled.
+ */
+typedef struct VideoEncoder {
+    AVCodecContext *dec;
+    AVCodecContext *enc;
+    struct SwsContext *sws;
+    AVFrame *frame;
+    AVFrame *scaled;
+    int stream_index;
+    void *opaque;       /* passed to the EncodedPacketCallback */
+
+    unsigned long frames;
+    int64_t total_time;
+    int64_t max_time;
+    unsigned long report_frames;
+    int64_t report_total_time;
+} VideoEncoder;
+
+int video_encoder_open(VideoEncoder *e, const char *name, AVDictionary **opts,
+                       const AVCodecParameters *par, AVRational time_base,
+                       AVRational frame_rate, int global_header);
+int video_encoder_encode(VideoEncoder *e, AVPacket *pkt,
+                         EncodedPacketCallback cb);
+void video_encoder_flush(VideoEncoder *e, EncodedPacketCallback cb);
+void video_encoder_close(VideoEncoder *e);
+void video_encoder_report(VideoEncoder *e, FILE *f);
+
+/* Size carried by the AV_PKT_DATA_PARAM_CHANGE side data, 0 if none */
+int packet_dimensions(const AVPacket *pkt, int *width, int *height);
+int packet_set_dimensions(AVPacket *pkt, int width, int height);
+
+#endif /* BMDTOOLS_ENCODE_H */
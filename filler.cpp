@@ -0,0 +1,153 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "filler.h"
+#include "modes.h"
+
+/* white, yellow, cyan, green, magenta, red, blue, black */
+#define NB_BARS 8
+#define BLACK   (NB_BARS - 1)
+
+static const uint8_t bars_yuv[NB_BARS][3] = {
+    { 0xEA, 0x80, 0x80 }, { 0xD2, 0x10, 0x92 }, { 0xA9, 0xA5, 0x10 },
+    { 0x90, 0x35, 0x22 }, { 0x6A, 0xCA, 0xDD }, { 0x51, 0x5A, 0xEF },
+    { 0x28, 0xEF, 0x6D }, { 0x10, 0x80, 0x80 },
+};
+
+static const uint8_t bars_rgb[NB_BARS][3] = {
+    { 1, 1, 1 }, { 1, 1, 0 }, { 0, 1, 1 }, { 0, 1, 0 },
+    { 1, 0, 1 }, { 1, 0, 0 }, { 0, 0, 1 }, { 0, 0, 0 },
+};
+
+static int bar_at(int x, int width, enum FillerType type)
+{
+    if (type != FILLER_BARS || x >= width)
+        return BLACK;
+    return x * NB_BARS / width;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void fill_row_uyvy(uint8_t *p, int width, enum FillerType type)
+{
+    for (int x = 0; x < width; x += 2, p += 4) {
+        const uint8_t *c = bars_yuv[bar_at(x, width, type)];
+        p[0] = c[1];
+        p[1] = c[0];
+        p[2] = c[2];
+        p[3] = c[0];
+    }
+}
+
+/* 6 pixels per 16 bytes, see v210.cpp for the layout */
+static void fill_row_v210(uint8_t *p, int row_bytes, int width,
+                          enum FillerType type)
+{
+    for (int x = 0; x < row_bytes / 16 * 6; x += 6) {
+        uint32_t c[12];
+
+        for (int k = 0; k < 6; k += 2) {
+            const uint8_t *a = bars_yuv[bar_at(x + k,     width, type)];
+            const uint8_t *b = bars_yuv[bar_at(x + k + 1, width, type)];
+            c[2 * k]     = a[1] << 2;
+            c[2 * k + 1] = a[0] << 2;
+            c[2 * k + 2] = a[2] << 2;
+            c[2 * k + 3] = b[0] << 2;
+        }
+
+        for (int i = 0; i < 4; i++, p += 4) {
+            uint32_t w = c[3 * i] | c[3 * i + 1] << 10 | c[3 * i + 2] << 20;
+            p[0] = w;
+            p[1] = w >> 8;
+            p[2] = w >> 16;
+            p[3] = w >> 24;
+        }
+    }
+}
+
+static void fill_row_argb(uint8_t *p, int width, enum FillerType type)
+{
+    for (int x = 0; x < width; x++, p += 4) {
+        const uint8_t *c = bars_rgb[bar_at(x, width, type)];
+        p[0] = 0xFF;
+        p[1] = c[0] * 0xFF;
+        p[2] = c[1] * 0xFF;
+        p[3] = c[2] * 0xFF;
+    }
+}
+
+/* big endian 10 bit rgb in video range */
+static void fill_row_r210(uint8_t *p, int width, enum FillerType type)
+{
+    for (int x = 0; x < width; x++, p += 4) {
+        const uint8_t *c = bars_rgb[bar_at(x, width, type)];
+        uint32_t r = c[0] ? 940 : 64;
+        uint32_t g = c[1] ? 940 : 64;
+        uint32_t b = c[2] ? 940 : 64;
+        put_be32(p, r << 20 | g << 10 | b);
+    }
+}
+
+AVBufferRef *filler_frame_alloc(BMDPixelFormat pix, int width, int height,
+                                enum FillerType type)
+{
+    int row_bytes = get_row_bytes(pix, width);
+    AVBufferRef *buf;
+
+    if (row_bytes <= 0 || height <= 0)
+        return NULL;
+
+    buf = av_buffer_allocz(row_bytes * height);
+    if (!buf)
+        return NULL;
+
+    switch (pix) {
+    case bmdFormat8BitYUV:
+        fill_row_uyvy(buf->data, width, type);
+        break;
+    case bmdFormat10BitYUV:
+        fill_row_v210(buf->data, row_bytes, width, type);
+        break;
+    case bmdFormat8BitARGB:
+        fill_row_argb(buf->data, width, type);
+        break;
+    case bmdFormat10BitRGB:
+        fill_row_r210(buf->data, width, type);
+        break;
+    default:
+        av_buffer_unref(&buf);
+        return NULL;
+    }
+
+    for (int y = 1; y < height; y++)
+        memcpy(buf->data + y * row_bytes, buf->data, row_bytes);
+
+    return buf;
+}
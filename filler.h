@@ -0,0 +1,44 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_FILLER_H
+#define BMDTOOLS_FILLER_H
+
+#include "DeckLinkAPI.h"
+
+extern "C" {
+#include "libavutil/buffer.h"
+}
+
+enum FillerType {
+    FILLER_BLACK,
+    FILLER_BARS,
+    FILLER_FREEZE,
+};
+
+/*
+ * A whole frame of black or 100% colour bars in the card layout of pix,
+ * built once so no-signal packets can just take a reference to it.
+ */
+AVBufferRef *filler_frame_alloc(BMDPixelFormat pix, int width, int height,
+                                enum FillerType type);
+
+#endif /* BMDTOOLS_FILLER_H */
@@ -0,0 +1,201 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "FramePool.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define FRAME_ALIGN    4096
+
+#ifdef __linux__
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+static int bind_to_node(void *addr, size_t len, int node)
+{
+    unsigned long mask[16] = { 0 };
+
+    if (node < 0 || node >= (int)(sizeof(mask) * 8))
+        return -1;
+    mask[node / (sizeof(*mask) * 8)] = 1UL << (node % (sizeof(*mask) * 8));
+
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, mask,
+                   sizeof(mask) * 8, 0);
+}
+#else
+static int bind_to_node(void *addr, size_t len, int node)
+{
+    return -1;
+}
+#endif
+
+FramePool::FramePool(unsigned frameSize, unsigned frameCount, int numaNode)
+    : m_frameCount(frameCount), m_inUse(0), m_highWater(0), m_exhausted(0),
+      m_hugePages(false), m_locked(false), m_refCount(1), m_base(NULL),
+      m_free(NULL), m_nbFree(0)
+{
+    void *p = MAP_FAILED;
+
+    pthread_mutex_init(&m_mutex, NULL);
+
+    m_frameSize = (frameSize + FRAME_ALIGN - 1) & ~(FRAME_ALIGN - 1);
+    m_mapSize   = (size_t)m_frameSize * frameCount;
+
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, (m_mapSize + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1),
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        m_mapSize   = (m_mapSize + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        m_hugePages = true;
+    }
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Could not map %zu bytes for the frame pool\n",
+                    m_mapSize);
+            return;
+        }
+    }
+
+    if (numaNode >= 0 && bind_to_node(p, m_mapSize, numaNode) < 0)
+        fprintf(stderr, "Could not bind the frame pool to NUMA node %d\n",
+                numaNode);
+
+    m_locked = !mlock(p, m_mapSize);
+    if (!m_locked)
+        fprintf(stderr, "Could not lock the frame pool in memory, "
+                "check RLIMIT_MEMLOCK\n");
+
+    // Fault every page in now, not on the first capture.
+    memset(p, 0, m_mapSize);
+
+    m_free = (unsigned *)malloc(frameCount * sizeof(*m_free));
+    if (!m_free) {
+        munmap(p, m_mapSize);
+        return;
+    }
+    for (unsigned i = 0; i < frameCount; i++)
+        m_free[m_nbFree++] = frameCount - 1 - i;
+
+    m_base = (uint8_t *)p;
+}
+
+FramePool::~FramePool()
+{
+    if (m_base)
+        munmap(m_base, m_mapSize);
+    free(m_free);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void FramePool::PrintStats(FILE *f)
+{
+    fprintf(f, "Frame pool: %u x %u bytes%s%s - high water %u"
+            " - exhausted %u times\n",
+            m_frameCount, m_frameSize,
+            m_hugePages ? ", huge pages" : "",
+            m_locked ? ", locked" : "",
+            __atomic_load_n(&m_highWater, __ATOMIC_RELAXED),
+            __atomic_load_n(&m_exhausted, __ATOMIC_RELAXED));
+}
+
+ULONG FramePool::AddRef(void)
+{
+    return __atomic_add_fetch(&m_refCount, 1, __ATOMIC_SEQ_CST);
+}
+
+ULONG FramePool::Release(void)
+{
+    ULONG refCount = __atomic_sub_fetch(&m_refCount, 1, __ATOMIC_SEQ_CST);
+
+    if (refCount == 0)
+        delete this;
+
+    return refCount;
+}
+
+HRESULT FramePool::AllocateBuffer(uint32_t bufferSize, void **allocatedBuffer)
+{
+    unsigned index;
+
+    if (bufferSize > m_frameSize) {
+        fprintf(stderr, "Frame pool: %u bytes requested, %u available\n",
+                bufferSize, m_frameSize);
+        return E_OUTOFMEMORY;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    if (!m_nbFree) {
+        pthread_mutex_unlock(&m_mutex);
+        __atomic_fetch_add(&m_exhausted, 1, __ATOMIC_RELAXED);
+        return E_OUTOFMEMORY;
+    }
+    index = m_free[--m_nbFree];
+    if (++m_inUse > m_highWater)
+        m_highWater = m_inUse;
+    pthread_mutex_unlock(&m_mutex);
+
+    *allocatedBuffer = m_base + (size_t)index * m_frameSize;
+
+    // Outlive a replaced allocator until its last buffer comes back.
+    AddRef();
+
+    return S_OK;
+}
+
+HRESULT FramePool::ReleaseBuffer(void *buffer)
+{
+    size_t offset = (uint8_t *)buffer - m_base;
+
+    if ((uint8_t *)buffer < m_base || offset >= m_mapSize)
+        return E_INVALIDARG;
+
+    pthread_mutex_lock(&m_mutex);
+    m_free[m_nbFree++] = offset / m_frameSize;
+    m_inUse--;
+    pthread_mutex_unlock(&m_mutex);
+
+    Release();
+
+    return S_OK;
+}
+
+HRESULT FramePool::Commit(void)
+{
+    return S_OK;
+}
+
+HRESULT FramePool::Decommit(void)
+{
+    return S_OK;
+}
@@ -0,0 +1,106 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "latency.h"
+
+#define SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+
+static unsigned bucket_index(uint64_t v)
+{
+    unsigned e;
+
+    if (v < SUB_BUCKETS)
+        return v;
+
+    e = 63 - __builtin_clzll(v);
+    return (e - LATENCY_SUB_BITS + 1) * SUB_BUCKETS +
+           ((v >> (e - LATENCY_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Upper bound of the values falling in bucket i */
+static int64_t bucket_value(unsigned i)
+{
+    unsigned e;
+
+    if (i < SUB_BUCKETS)
+        return i;
+
+    e = i / SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+    return ((int64_t)(SUB_BUCKETS + i % SUB_BUCKETS + 1) <<
+            (e - LATENCY_SUB_BITS)) - 1;
+}
+
+void latency_init(LatencyHistogram *h, const char *name)
+{
+    memset(h, 0, sizeof(*h));
+    h->name = name;
+}
+
+void latency_record(LatencyHistogram *h, int64_t us)
+{
+    int64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    if (us < 0)
+        us = 0;
+
+    __atomic_fetch_add(&h->counts[bucket_index(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+
+    while (us > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, us, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+int64_t latency_percentile(LatencyHistogram *h, double p)
+{
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    uint64_t rank  = total * p / 100;
+    uint64_t seen  = 0;
+    int64_t max    = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen > rank)
+            return bucket_value(i) < max ? bucket_value(i) : max;
+    }
+
+    return max;
+}
+
+void latency_report(LatencyHistogram *h, FILE *f)
+{
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+
+    if (!total)
+        return;
+
+    fprintf(f, "Latency %-8s %8" PRIu64 " frames - p50 %.2f ms - "
+            "p99 %.2f ms - p99.9 %.2f ms - max %.2f ms\n",
+            h->name, total,
+            latency_percentile(h, 50)   / 1000.0,
+            latency_percentile(h, 99)   / 1000.0,
+            latency_percentile(h, 99.9) / 1000.0,
+            __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1000.0);
+}
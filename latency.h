@@ -0,0 +1,48 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_LATENCY_H
+#define BMDTOOLS_LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* 32 linear sub-buckets per power of two, at most 1/32 relative error */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_BUCKETS  (64 << LATENCY_SUB_BITS)
+
+/*
+ * Log-linear latency histogram in microseconds. Recording is a couple
+ * of relaxed atomic adds, it may be done from any thread.
+ */
+typedef struct LatencyHistogram {
+    const char *name;
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    int64_t max;
+} LatencyHistogram;
+
+void latency_init(LatencyHistogram *h, const char *name);
+void latency_record(LatencyHistogram *h, int64_t us);
+int64_t latency_percentile(LatencyHistogram *h, double p);
+void latency_report(LatencyHistogram *h, FILE *f);
+
+#endif /* BMDTOOLS_LATENCY_H */
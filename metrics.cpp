@@ -0,0 +1,183 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* A client going away early must not SIGPIPE the whole program */
+static void send_all(int fd, const char *buf, size_t len)
+{
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    while (len > 0) {
+        ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+        if (ret <= 0)
+            return;
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static void *metrics_thread(void *ctx)
+{
+    MetricsServer *m = (MetricsServer *)ctx;
+    struct pollfd pfd;
+
+    pfd.fd     = m->fd;
+    pfd.events = POLLIN;
+
+    while (!__atomic_load_n(&m->quit, __ATOMIC_RELAXED)) {
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *f;
+        int fd;
+
+        /* wake up now and then to notice the quit request */
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+
+        fd = accept(m->fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        f = open_memstream(&buf, &len);
+        if (f) {
+            m->writer(f);
+            fclose(f);
+            send_all(fd, buf, len);
+            free(buf);
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int metrics_server_start(MetricsServer *m, const char *path,
+                         MetricsWriter writer)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    memset(m, 0, sizeof(*m));
+    m->writer = writer;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Metrics socket path too long: %s\n", path);
+        return -1;
+    }
+
+    // A socket left behind by a previous run would make bind fail, any
+    // other file is most likely a mistyped path and is left alone.
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket, not using it for "
+                    "the metrics\n", path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    m->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m->fd < 0) {
+        fprintf(stderr, "Could not create the metrics socket\n");
+        return -1;
+    }
+
+    if (bind(m->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(m->fd, 4) < 0) {
+        fprintf(stderr, "Could not listen on the metrics socket %s\n", path);
+        goto fail;
+    }
+
+    m->path = strdup(path);
+    if (pthread_create(&m->th, NULL, metrics_thread, m)) {
+        unlink(path);
+        free(m->path);
+        m->path = NULL;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    close(m->fd);
+    m->fd = -1;
+    return -1;
+}
+
+void metrics_server_stop(MetricsServer *m)
+{
+    if (!m->path)
+        return;
+
+    __atomic_store_n(&m->quit, 1, __ATOMIC_RELAXED);
+    pthread_join(m->th, NULL);
+
+    close(m->fd);
+    unlink(m->path);
+    free(m->path);
+    m->path = NULL;
+}
+
+void metrics_counter(FILE *f, const char *name, const char *help,
+                     uint64_t value)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+            name, help, name, name, value);
+}
+
+void metrics_gauge(FILE *f, const char *name, const char *help, double value)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n",
+            name, help, name, name, value);
+}
+
+void metrics_describe(FILE *f, const char *name, const char *help,
+                      const char *type)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_sample(FILE *f, const char *name, const char *labels,
+                    double value)
+{
+    fprintf(f, "%s{%s} %.17g\n", name, labels, value);
+}
@@ -0,0 +1,63 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_METRICS_H
+#define BMDTOOLS_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+typedef void (*MetricsWriter)(FILE *f);
+
+/*
+ * Serve the metrics over a local Unix socket: every connection gets the
+ * current values in the Prometheus text format and is closed, e.g.
+ *
+ *     socat - UNIX-CONNECT:/run/bmdcapture.sock
+ *
+ * The writer runs on the server thread, the values it prints are expected
+ * to be read with relaxed atomic loads.
+ */
+typedef struct MetricsServer {
+    int fd;
+    char *path;
+    MetricsWriter writer;
+    pthread_t th;
+    int quit;
+} MetricsServer;
+
+int metrics_server_start(MetricsServer *m, const char *path,
+                         MetricsWriter writer);
+void metrics_server_stop(MetricsServer *m);
+
+void metrics_counter(FILE *f, const char *name, const char *help,
+                     uint64_t value);
+void metrics_gauge(FILE *f, const char *name, const char *help, double value);
+
+/* One metric with a sample per label set, e.g. metrics_sample(f, name,
+ * "card=\"1\"", value) after a single metrics_describe(). */
+void metrics_describe(FILE *f, const char *name, const char *help,
+                      const char *type);
+void metrics_sample(FILE *f, const char *name, const char *labels,
+                    double value);
+
+#endif /* BMDTOOLS_METRICS_H */
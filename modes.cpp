@@ -146,3 +146,19 @@ bail:
     if (deckLinkOutput != NULL)
         deckLinkOutput->Release();
 }
+
+int get_row_bytes(BMDPixelFormat pix, int width)
+{
+    switch (pix) {
+    case bmdFormat8BitYUV:
+        return width * 2;
+    case bmdFormat10BitYUV:
+        return ((width + 47) / 48) * 128;
+    case bmdFormat8BitARGB:
+        return width * 4;
+    case bmdFormat10BitRGB:
+        return ((width + 63) / 64) * 256;
+    default:
+        return width * 4;
+    }
+}
@@ -26,6 +26,7 @@
 
 void print_input_modes(IDeckLink *deckLink);
 void print_output_modes(IDeckLink *deckLink);
+int get_row_bytes(BMDPixelFormat pix, int width);
 
 #endif /* BMDTOOLS_MODES_H */
 
@@ -0,0 +1,427 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "packetqueue.h"
+#include "trace.h"
+
+extern "C" {
+#include "libavutil/time.h"
+}
+
+/* The sleeping side is a futex on Linux, a condition variable elsewhere */
+#ifdef __linux__
+#define SYNC(x) NULL, NULL
+
+static void queue_wait(pthread_mutex_t *mutex, pthread_cond_t *cond,
+                       unsigned *word, unsigned val,
+                       const struct timespec *timeout)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void queue_wake(pthread_mutex_t *mutex, pthread_cond_t *cond,
+                       unsigned *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#else
+#define SYNC(x) &(x)->mutex, &(x)->cond
+
+static void queue_wait(pthread_mutex_t *mutex, pthread_cond_t *cond,
+                       unsigned *word, unsigned val,
+                       const struct timespec *timeout)
+{
+    struct timespec abstime;
+    struct timeval now;
+
+    if (timeout) {
+        gettimeofday(&now, NULL);
+        abstime.tv_sec  = now.tv_sec + timeout->tv_sec;
+        abstime.tv_nsec = now.tv_usec * 1000 + timeout->tv_nsec;
+        if (abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(mutex);
+    while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == val) {
+        if (!timeout)
+            pthread_cond_wait(cond, mutex);
+        else if (pthread_cond_timedwait(cond, mutex, &abstime) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+static void queue_wake(pthread_mutex_t *mutex, pthread_cond_t *cond,
+                       unsigned *word)
+{
+    pthread_mutex_lock(mutex);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(mutex);
+}
+#endif
+
+/* Bump a sequence word and wake whoever is sleeping on it. */
+static void queue_signal(pthread_mutex_t *mutex, pthread_cond_t *cond,
+                         unsigned *word, int *waiting)
+{
+    __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+        queue_wake(mutex, cond, word);
+}
+
+/* Sleep on a sequence word unless it already moved past seq. */
+static void queue_sleep(pthread_mutex_t *mutex, pthread_cond_t *cond,
+                        unsigned *word, int *waiting, unsigned seq,
+                        const struct timespec *timeout)
+{
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seq)
+        queue_wait(mutex, cond, word, seq, timeout);
+    __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+static void queue_notify(AVPacketQueue *q)
+{
+    AVPacketQueueNotify *n = q->notify;
+
+    if (n)
+        queue_signal(SYNC(n), &n->seq, &n->waiting);
+}
+
+int avpacket_queue_init(AVPacketQueue *q, unsigned nb_slots)
+{
+    unsigned n = 1;
+
+    while (n < nb_slots)
+        n <<= 1;
+
+    memset(q, 0, sizeof(AVPacketQueue));
+    q->slots  = (AVPacket *)av_mallocz(n * sizeof(*q->slots));
+    q->stamps = (int64_t *)av_mallocz(n * sizeof(*q->stamps));
+    q->queued = (int64_t *)av_mallocz(n * sizeof(*q->queued));
+    if (!q->slots || !q->stamps || !q->queued) {
+        av_freep(&q->slots);
+        av_freep(&q->stamps);
+        av_freep(&q->queued);
+        return -1;
+    }
+    q->nb_slots = n;
+    q->mask     = n - 1;
+#ifndef __linux__
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+#endif
+    return 0;
+}
+
+void avpacket_queue_flush(AVPacketQueue *q)
+{
+    AVPacket pkt;
+
+    while (avpacket_queue_get(q, &pkt, 0) > 0)
+        av_packet_unref(&pkt);
+}
+
+void avpacket_queue_abort(AVPacketQueue *q)
+{
+    __atomic_store_n(&q->abort_request, 1, __ATOMIC_SEQ_CST);
+    queue_signal(SYNC(q), &q->seq, &q->waiting);
+    queue_signal(SYNC(q), &q->rseq, &q->rwaiting);
+    queue_notify(q);
+}
+
+void avpacket_queue_finish(AVPacketQueue *q)
+{
+    __atomic_store_n(&q->finish_request, 1, __ATOMIC_SEQ_CST);
+    queue_signal(SYNC(q), &q->seq, &q->waiting);
+    queue_notify(q);
+}
+
+void avpacket_queue_end(AVPacketQueue *q)
+{
+    avpacket_queue_abort(q);
+    avpacket_queue_flush(q);
+    av_freep(&q->slots);
+    av_freep(&q->stamps);
+    av_freep(&q->queued);
+#ifndef __linux__
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+#endif
+}
+
+int avpacket_queue_put(AVPacketQueue *q, AVPacket *pkt)
+{
+    return avpacket_queue_put_stamp(q, pkt, 0);
+}
+
+static int queue_put(AVPacketQueue *q, AVPacket *pkt, int64_t stamp)
+{
+    unsigned tail = q->tail;
+    unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    /* the reference moves into the slot, nothing is copied */
+    if (tail - head >= q->nb_slots || (pkt->size && !pkt->buf))
+        return -1;
+
+    q->slots[tail & q->mask]  = *pkt;
+    q->stamps[tail & q->mask] = stamp;
+    q->queued[tail & q->mask] = stamp ? av_gettime_relative() : 0;
+    q->tail_stamp             = stamp;
+    __atomic_fetch_add(&q->size, pkt->size + sizeof(*pkt), __ATOMIC_RELAXED);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    queue_signal(SYNC(q), &q->seq, &q->waiting);
+    queue_notify(q);
+    return 0;
+}
+
+int avpacket_queue_put_stamp(AVPacketQueue *q, AVPacket *pkt, int64_t stamp)
+{
+    int ret;
+
+    TRACE_BEGIN("avpacket_queue_put");
+    ret = queue_put(q, pkt, stamp);
+    TRACE_END("avpacket_queue_put");
+
+    return ret;
+}
+
+static int queue_get(AVPacketQueue *q, AVPacket *pkt, int64_t timeout_us)
+{
+    unsigned head = q->head;
+    struct timespec timeout;
+    int waited = 0;
+
+    timeout.tv_sec  = timeout_us / 1000000;
+    timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+
+    for (;;) {
+        unsigned seq  = __atomic_load_n(&q->seq, __ATOMIC_SEQ_CST);
+        /* read before the tail, the last put is visible once it is set */
+        int finished  = __atomic_load_n(&q->finish_request, __ATOMIC_SEQ_CST);
+        unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+        /* a blocking reader stops as soon as the queue is aborted, what
+         * is left is discarded by avpacket_queue_flush() */
+        if (timeout_us && __atomic_load_n(&q->abort_request, __ATOMIC_SEQ_CST))
+            return -1;
+
+        if (tail != head) {
+            AVPacket *slot = &q->slots[head & q->mask];
+            *pkt = *slot;
+            memset(slot, 0, sizeof(*slot));
+            q->last_stamp  = q->stamps[head & q->mask];
+            q->last_queued = q->queued[head & q->mask];
+            __atomic_fetch_sub(&q->size, pkt->size + sizeof(*pkt),
+                               __ATOMIC_RELAXED);
+            __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+            queue_signal(SYNC(q), &q->rseq, &q->rwaiting);
+            return 1;
+        }
+        if (timeout_us && finished)
+            return -1;
+        if (!timeout_us || (timeout_us > 0 && waited))
+            return 0;
+
+        queue_sleep(SYNC(q), &q->seq, &q->waiting, seq,
+                    timeout_us > 0 ? &timeout : NULL);
+        waited = 1;
+    }
+}
+
+/*
+ * Returns 1 with a packet, 0 if none arrived within timeout_us (-1 to
+ * wait forever) and -1 once a blocking reader sees the queue aborted, or
+ * finished and empty.
+ */
+int avpacket_queue_get_timeout(AVPacketQueue *q, AVPacket *pkt,
+                               int64_t timeout_us)
+{
+    int ret;
+
+    TRACE_BEGIN("avpacket_queue_get");
+    ret = queue_get(q, pkt, timeout_us);
+    TRACE_END("avpacket_queue_get");
+
+    return ret;
+}
+
+int avpacket_queue_get(AVPacketQueue *q, AVPacket *pkt, int block)
+{
+    return avpacket_queue_get_timeout(q, pkt, block ? -1 : 0) > 0;
+}
+
+int avpacket_queue_wait_size(AVPacketQueue *q, unsigned long long size)
+{
+    return avpacket_queue_wait_size_timeout(q, size, -1);
+}
+
+/*
+ * Returns 0 once at most size bytes are queued, 1 if that did not happen
+ * within timeout_us (-1 to wait forever) and -1 if the queue is aborted.
+ */
+int avpacket_queue_wait_size_timeout(AVPacketQueue *q, unsigned long long size,
+                                     int64_t timeout_us)
+{
+    struct timespec timeout;
+    int waited = 0;
+
+    timeout.tv_sec  = timeout_us / 1000000;
+    timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+
+    for (;;) {
+        unsigned seq = __atomic_load_n(&q->rseq, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&q->abort_request, __ATOMIC_SEQ_CST))
+            return -1;
+        if (avpacket_queue_size(q) <= size)
+            return 0;
+        if (timeout_us >= 0 && waited)
+            return 1;
+
+        queue_sleep(SYNC(q), &q->rseq, &q->rwaiting, seq,
+                    timeout_us >= 0 ? &timeout : NULL);
+        waited = 1;
+    }
+}
+
+int avpacket_queue_wait_budget(AVPacketQueue *q, unsigned long long size,
+                               int64_t span)
+{
+    for (;;) {
+        unsigned seq = __atomic_load_n(&q->rseq, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&q->abort_request, __ATOMIC_SEQ_CST))
+            return -1;
+        if (avpacket_queue_nb_packets(q) < q->nb_slots &&
+            avpacket_queue_size(q) <= size &&
+            avpacket_queue_span(q) <= span)
+            return 0;
+
+        queue_sleep(SYNC(q), &q->rseq, &q->rwaiting, seq, NULL);
+    }
+}
+
+/*
+ * The consumer never rewrites a stamp, the ones between head and tail
+ * stay put until the producer queues again.
+ */
+int64_t avpacket_queue_span(AVPacketQueue *q)
+{
+    unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    if (head == q->tail)
+        return 0;
+    return q->tail_stamp - q->stamps[head & q->mask];
+}
+
+unsigned long long avpacket_queue_size(AVPacketQueue *q)
+{
+    return __atomic_load_n(&q->size, __ATOMIC_RELAXED);
+}
+
+unsigned avpacket_queue_nb_packets(AVPacketQueue *q)
+{
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+int64_t avpacket_queue_last_stamp(AVPacketQueue *q)
+{
+    return q->last_stamp;
+}
+
+int64_t avpacket_queue_last_queued(AVPacketQueue *q)
+{
+    return q->last_queued;
+}
+
+int avpacket_queue_aborted(AVPacketQueue *q)
+{
+    return __atomic_load_n(&q->abort_request, __ATOMIC_SEQ_CST);
+}
+
+int avpacket_queue_finished(AVPacketQueue *q)
+{
+    return __atomic_load_n(&q->finish_request, __ATOMIC_SEQ_CST) &&
+           !avpacket_queue_nb_packets(q);
+}
+
+void avpacket_queue_notify_init(AVPacketQueueNotify *n)
+{
+    memset(n, 0, sizeof(*n));
+#ifndef __linux__
+    pthread_mutex_init(&n->mutex, NULL);
+    pthread_cond_init(&n->cond, NULL);
+#endif
+}
+
+void avpacket_queue_notify_end(AVPacketQueueNotify *n)
+{
+#ifndef __linux__
+    pthread_mutex_destroy(&n->mutex);
+    pthread_cond_destroy(&n->cond);
+#endif
+}
+
+/* Must be set before the producer starts */
+void avpacket_queue_set_notify(AVPacketQueue *q, AVPacketQueueNotify *n)
+{
+    q->notify = n;
+}
+
+unsigned avpacket_queue_notify_seq(AVPacketQueueNotify *n)
+{
+    return __atomic_load_n(&n->seq, __ATOMIC_SEQ_CST);
+}
+
+void avpacket_queue_notify_wait(AVPacketQueueNotify *n, unsigned seq)
+{
+    queue_sleep(SYNC(n), &n->seq, &n->waiting, seq, NULL);
+}
+
+void avpacket_queue_notify_wait_timeout(AVPacketQueueNotify *n, unsigned seq,
+                                        int64_t timeout_us)
+{
+    struct timespec timeout;
+
+    timeout.tv_sec  = timeout_us / 1000000;
+    timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+    queue_sleep(SYNC(n), &n->seq, &n->waiting, seq, &timeout);
+}
@@ -0,0 +1,142 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_PACKETQUEUE_H
+#define BMDTOOLS_PACKETQUEUE_H
+
+#include <pthread.h>
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+/*
+ * Wakes a consumer draining several queues, each queue it is attached to
+ * bumps it on put and on abort.
+ */
+typedef struct AVPacketQueueNotify {
+    unsigned seq;
+    int waiting;
+#ifndef __linux__
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+} AVPacketQueueNotify;
+
+/*
+ * Bounded single-producer/single-consumer packet ring.
+ *
+ * The slots are allocated once in avpacket_queue_init(), the producer
+ * (the DeckLink callback thread) never allocates and never takes a lock:
+ * the packet, which must be reference counted or empty, is moved into
+ * its slot as it is, the tail is published with a release store and the
+ * consumer is woken only when it is actually sleeping.
+ *
+ * put/get must each be called by a single thread, flush must be called
+ * by the consumer or once the producer is stopped.
+ */
+typedef struct AVPacketQueue {
+    AVPacket *slots;
+    int64_t *stamps;
+    int64_t *queued;    /* when stamped packets were put */
+    unsigned nb_slots;
+    unsigned mask;
+
+    /* consumer side */
+    unsigned head __attribute__((aligned(64)));
+    int64_t last_stamp;
+    int64_t last_queued;
+
+    /* producer side */
+    unsigned tail __attribute__((aligned(64)));
+    int64_t tail_stamp;
+
+    /* shared */
+    unsigned long long size __attribute__((aligned(64)));
+    unsigned seq;       /* bumped by the producer */
+    int waiting;
+    unsigned rseq;      /* bumped by the consumer */
+    int rwaiting;
+    int abort_request;
+    int finish_request;
+    AVPacketQueueNotify *notify;
+#ifndef __linux__
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+} AVPacketQueue;
+
+int avpacket_queue_init(AVPacketQueue *q, unsigned nb_slots);
+void avpacket_queue_flush(AVPacketQueue *q);
+void avpacket_queue_abort(AVPacketQueue *q);
+/*
+ * The producer is done: blocking gets still return what is queued and
+ * -1 once it is empty, unlike abort nothing is left behind.
+ */
+void avpacket_queue_finish(AVPacketQueue *q);
+void avpacket_queue_end(AVPacketQueue *q);
+/*
+ * Take over the reference of pkt, -1 if the queue is full or pkt has data
+ * that is not reference counted.
+ */
+int avpacket_queue_put(AVPacketQueue *q, AVPacket *pkt);
+/* Queue pkt along with a timestamp, returned by avpacket_queue_last_stamp() */
+int avpacket_queue_put_stamp(AVPacketQueue *q, AVPacket *pkt, int64_t stamp);
+int avpacket_queue_get(AVPacketQueue *q, AVPacket *pkt, int block);
+int avpacket_queue_get_timeout(AVPacketQueue *q, AVPacket *pkt,
+                               int64_t timeout_us);
+unsigned long long avpacket_queue_size(AVPacketQueue *q);
+unsigned avpacket_queue_nb_packets(AVPacketQueue *q);
+/* Stamp of the packet the last get returned, 0 if it had none */
+int64_t avpacket_queue_last_stamp(AVPacketQueue *q);
+/* av_gettime_relative() when that packet was put, 0 if it had no stamp */
+int64_t avpacket_queue_last_queued(AVPacketQueue *q);
+
+/* Block the producer until at most size bytes are queued, -1 if aborted */
+int avpacket_queue_wait_size(AVPacketQueue *q, unsigned long long size);
+int avpacket_queue_wait_size_timeout(AVPacketQueue *q, unsigned long long size,
+                                     int64_t timeout_us);
+/*
+ * Block the producer until a slot is free, at most size bytes are queued
+ * and the queued stamps span at most span, -1 if aborted.
+ */
+int avpacket_queue_wait_budget(AVPacketQueue *q, unsigned long long size,
+                               int64_t span);
+/* Stamp of the newest packet minus the oldest one, producer side only */
+int64_t avpacket_queue_span(AVPacketQueue *q);
+int avpacket_queue_aborted(AVPacketQueue *q);
+/* Finished and emptied by the consumer */
+int avpacket_queue_finished(AVPacketQueue *q);
+
+/*
+ * A consumer polling several queues with non-blocking gets reads the
+ * sequence first and sleeps on it only if none of them had a packet.
+ */
+void avpacket_queue_notify_init(AVPacketQueueNotify *n);
+void avpacket_queue_notify_end(AVPacketQueueNotify *n);
+void avpacket_queue_set_notify(AVPacketQueue *q, AVPacketQueueNotify *n);
+unsigned avpacket_queue_notify_seq(AVPacketQueueNotify *n);
+void avpacket_queue_notify_wait(AVPacketQueueNotify *n, unsigned seq);
+/* The same, returning after timeout_us at the latest */
+void avpacket_queue_notify_wait_timeout(AVPacketQueueNotify *n, unsigned seq,
+                                        int64_t timeout_us);
+
+#endif /* BMDTOOLS_PACKETQUEUE_H */
@@ -0,0 +1,325 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "proxy.h"
+
+/*
+ * An output macropixel U Y0 V Y1 covers factor input macropixels on
+ * factor rows, Y0 their first half of pixels, Y1 the second.
+ */
+static void scale_row_uyvy_c(ProxyScaler *s, const uint8_t *src,
+                             uint8_t *dst, int slice)
+{
+    int f = s->factor;
+    int n = f * f;
+
+    for (int k = 0; k < s->width / 2; k++, dst += 4) {
+        unsigned u = 0, v = 0, y0 = 0, y1 = 0;
+
+        for (int r = 0; r < f; r++) {
+            const uint8_t *p = src + (size_t)r * s->src_stride + k * f * 4;
+
+            for (int m = 0; m < f; m++) {
+                u  += p[4 * m];
+                v  += p[4 * m + 2];
+                y0 += p[2 * m + 1];
+                y1 += p[2 * (m + f) + 1];
+            }
+        }
+        dst[0] = (u  + n / 2) / n;
+        dst[1] = (y0 + n / 2) / n;
+        dst[2] = (v  + n / 2) / n;
+        dst[3] = (y1 + n / 2) / n;
+    }
+}
+
+#ifdef HAVE_X86
+/*
+ * Average the two rows, then split each 16 bytes in the even and odd
+ * samples of every component and average those:
+ *
+ *   U0 Y0 V0 Y1 U1 Y2 V1 Y3 ... -> U0 Y0 V0 Y2 U2 Y4 V2 Y6
+ *                                  U1 Y1 V1 Y3 U3 Y5 V3 Y7
+ */
+__attribute__((target("ssse3")))
+static void scale_row_uyvy_half_ssse3(ProxyScaler *s, const uint8_t *src,
+                                      uint8_t *dst, int slice)
+{
+    const __m128i even = _mm_setr_epi8(0, 1, 2, 5, 8, 9, 10, 13,
+                                       -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i odd  = _mm_setr_epi8(4, 3, 6, 7, 12, 11, 14, 15,
+                                       -1, -1, -1, -1, -1, -1, -1, -1);
+    const uint8_t *src2 = src + s->src_stride;
+    int bytes = s->width * 4;   /* input bytes consumed per row */
+    int x     = 0;
+
+    for (; x + 16 <= bytes; x += 16, dst += 8) {
+        __m128i v = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(src + x)),
+                                 _mm_loadu_si128((const __m128i *)(src2 + x)));
+
+        _mm_storel_epi64((__m128i *)dst,
+                         _mm_avg_epu8(_mm_shuffle_epi8(v, even),
+                                      _mm_shuffle_epi8(v, odd)));
+    }
+
+    for (; x < bytes; x += 8, dst += 4) {
+        const uint8_t *a = src + x, *b = src2 + x;
+
+        dst[0] = (a[0] + a[4] + b[0] + b[4] + 2) / 4;
+        dst[1] = (a[1] + a[3] + b[1] + b[3] + 2) / 4;
+        dst[2] = (a[2] + a[6] + b[2] + b[6] + 2) / 4;
+        dst[3] = (a[5] + a[7] + b[5] + b[7] + 2) / 4;
+    }
+}
+#endif
+
+/* Unpack factor rows and sum them, 10 bit sums are scaled back to 8 */
+static void scale_row_v210(ProxyScaler *s, const uint8_t *src,
+                           uint8_t *dst, int slice)
+{
+    int f       = s->factor;
+    int n       = 4 * f * f;
+    int cw      = s->width / 2;
+    uint16_t *y = s->planes[slice];
+    uint16_t *u = y + s->src_width + 64;
+    uint16_t *v = u + s->src_width / 2 + 64;
+    uint32_t *ys = s->sums[slice];
+    uint32_t *us = ys + s->width;
+    uint32_t *vs = us + cw;
+
+    memset(ys, 0, sizeof(*ys) * (s->width + 2 * cw));
+
+    for (int r = 0; r < f; r++) {
+        s->unpack_row((const uint32_t *)(src + (size_t)r * s->src_stride),
+                      y, u, v, s->src_width);
+
+        for (int x = 0; x < s->width; x++)
+            for (int i = 0; i < f; i++)
+                ys[x] += y[x * f + i];
+        for (int x = 0; x < cw; x++)
+            for (int i = 0; i < f; i++) {
+                us[x] += u[x * f + i];
+                vs[x] += v[x * f + i];
+            }
+    }
+
+    for (int k = 0; k < cw; k++, dst += 4) {
+        dst[0] = (us[k]         + n / 2) / n;
+        dst[1] = (ys[2 * k]     + n / 2) / n;
+        dst[2] = (vs[k]         + n / 2) / n;
+        dst[3] = (ys[2 * k + 1] + n / 2) / n;
+    }
+}
+
+static int64_t thread_cpu_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void scale_slice(ProxyScaler *s, int slice, int nb_slices)
+{
+    int start = s->height * slice / nb_slices;
+    int end   = s->height * (slice + 1) / nb_slices;
+    int64_t t = thread_cpu_time();
+
+    for (int i = start; i < end; i++)
+        s->scale_row(s, s->src + (size_t)i * s->factor * s->src_stride,
+                     s->dst + (size_t)i * s->stride, slice);
+
+    __atomic_fetch_add(&s->cpu_time, thread_cpu_time() - t, __ATOMIC_RELAXED);
+}
+
+typedef struct ProxyWorker {
+    ProxyScaler *s;
+    int index;
+} ProxyWorker;
+
+static void *scale_worker(void *arg)
+{
+    ProxyWorker *w   = (ProxyWorker *)arg;
+    ProxyScaler *s   = w->s;
+    int index        = w->index;
+    unsigned generation = 0;
+
+    free(w);
+
+    for (;;) {
+        pthread_mutex_lock(&s->mutex);
+        while (s->generation == generation && !s->quit)
+            pthread_cond_wait(&s->cond, &s->mutex);
+        generation = s->generation;
+        pthread_mutex_unlock(&s->mutex);
+
+        if (s->quit)
+            return NULL;
+
+        /* slice 0 is done by the caller */
+        scale_slice(s, index + 1, s->nb_threads + 1);
+
+        pthread_mutex_lock(&s->mutex);
+        if (!--s->pending)
+            pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+int proxy_scaler_init(ProxyScaler *s, int v210, int width, int height,
+                      int src_stride, int factor, int nb_threads)
+{
+    memset(s, 0, sizeof(*s));
+
+    s->v210       = v210;
+    s->src_width  = width;
+    s->src_height = height;
+    s->src_stride = src_stride;
+    s->factor     = factor;
+    s->width      = (width / factor) & ~1;
+    s->height     = height / factor;
+    s->stride     = s->width * 2;
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if (factor < 1 || !s->width || !s->height)
+        return -1;
+
+    if (nb_threads < 1)
+        nb_threads = 1;
+
+    if (v210) {
+        const char *name;
+
+        s->unpack_row = v210_unpack_row_func(&name);
+        s->scale_row  = scale_row_v210;
+        s->name       = name;
+
+        s->planes = (uint16_t **)calloc(nb_threads, sizeof(*s->planes));
+        s->sums   = (uint32_t **)calloc(nb_threads, sizeof(*s->sums));
+        if (!s->planes || !s->sums)
+            return -1;
+        for (int i = 0; i < nb_threads; i++) {
+            s->planes[i] = (uint16_t *)malloc(sizeof(**s->planes) *
+                                              (2 * width + 3 * 64));
+            s->sums[i]   = (uint32_t *)malloc(sizeof(**s->sums) *
+                                              2 * s->width);
+            if (!s->planes[i] || !s->sums[i])
+                return -1;
+        }
+    } else {
+        s->scale_row = scale_row_uyvy_c;
+        s->name      = "c";
+#ifdef HAVE_X86
+        __builtin_cpu_init();
+        if (factor == 2 && __builtin_cpu_supports("ssse3")) {
+            s->scale_row = scale_row_uyvy_half_ssse3;
+            s->name      = "ssse3";
+        }
+#endif
+    }
+
+    s->threads = (pthread_t *)calloc(nb_threads, sizeof(*s->threads));
+    if (!s->threads)
+        return -1;
+
+    for (int i = 0; i < nb_threads - 1; i++) {
+        ProxyWorker *w = (ProxyWorker *)malloc(sizeof(*w));
+        if (!w)
+            return -1;
+        w->s     = s;
+        w->index = i;
+        if (pthread_create(&s->threads[i], NULL, scale_worker, w)) {
+            free(w);
+            return -1;
+        }
+        s->nb_threads++;
+    }
+
+    return 0;
+}
+
+void proxy_scaler_close(ProxyScaler *s)
+{
+    pthread_mutex_lock(&s->mutex);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    for (int i = 0; i < s->nb_threads; i++)
+        pthread_join(s->threads[i], NULL);
+
+    for (int i = 0; s->planes && i < s->nb_threads + 1; i++) {
+        free(s->planes[i]);
+        free(s->sums[i]);
+    }
+    free(s->planes);
+    free(s->sums);
+    free(s->threads);
+    s->planes  = NULL;
+    s->sums    = NULL;
+    s->threads = NULL;
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+}
+
+void proxy_scale_frame(ProxyScaler *s, const uint8_t *src, uint8_t *dst)
+{
+    s->src = src;
+    s->dst = dst;
+
+    pthread_mutex_lock(&s->mutex);
+    s->pending = s->nb_threads;
+    s->generation++;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    scale_slice(s, 0, s->nb_threads + 1);
+
+    pthread_mutex_lock(&s->mutex);
+    while (s->pending)
+        pthread_cond_wait(&s->cond, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+
+    s->frames++;
+}
+
+void proxy_scaler_report(ProxyScaler *s, FILE *f)
+{
+    if (!s->frames)
+        return;
+
+    fprintf(f, "Proxy %dx%d (%s, %d threads): %lu frames - "
+            "%.1f fps per core\n", s->width, s->height, s->name,
+            s->nb_threads + 1, s->frames,
+            s->frames * 1000000.0 /
+            __atomic_load_n(&s->cpu_time, __ATOMIC_RELAXED));
+}
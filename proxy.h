@@ -0,0 +1,80 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef BMDTOOLS_PROXY_H
+#define BMDTOOLS_PROXY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "v210.h"
+
+struct ProxyScaler;
+
+typedef void (*ProxyScaleRowFunc)(struct ProxyScaler *s, const uint8_t *src,
+                                  uint8_t *dst, int slice);
+
+/*
+ * Box filters 8 bit uyvy or v210 frames down by an integer factor to
+ * 8 bit uyvy, splitting the frame in horizontal slices across a small
+ * pool of threads like the v210 unpacker.
+ *
+ * uyvy halved is averaged with SSSE3 shuffles, v210 is unpacked with the
+ * v210 row unpacker first, the other cases use the C version.
+ */
+typedef struct ProxyScaler {
+    int v210;
+    int src_width, src_height, src_stride;
+    int factor;
+    int width, height, stride;          /* output, uyvy */
+    ProxyScaleRowFunc scale_row;
+    V210UnpackRowFunc unpack_row;
+    const char *name;
+
+    /* per slice scratch for the v210 path */
+    uint16_t **planes;
+    uint32_t **sums;
+
+    int nb_threads;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned generation;
+    int pending;
+    int quit;
+
+    /* current job */
+    const uint8_t *src;
+    uint8_t *dst;
+
+    unsigned long frames;
+    int64_t cpu_time;
+} ProxyScaler;
+
+int proxy_scaler_init(ProxyScaler *s, int v210, int width, int height,
+                      int src_stride, int factor, int nb_threads);
+void proxy_scaler_close(ProxyScaler *s);
+void proxy_scale_frame(ProxyScaler *s, const uint8_t *src, uint8_t *dst);
+void proxy_scaler_report(ProxyScaler *s, FILE *f);
+
+#endif /* BMDTOOLS_PROXY_H */
@@ -0,0 +1,371 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "replay.h"
+#include "segment.h"
+
+extern "C" {
+#include "libavutil/mem.h"
+}
+
+static int64_t packet_time(ReplayRing *r, const AVPacket *pkt)
+{
+    if (r->par[pkt->stream_index]->codec_type == AVMEDIA_TYPE_AUDIO)
+        return av_rescale_q(pkt->pts, r->audio_tb, r->video_tb);
+    return pkt->pts;
+}
+
+static void drop_oldest_locked(ReplayRing *r)
+{
+    av_packet_unref(&r->slots[r->first % r->nb_slots]);
+    r->first++;
+}
+
+void replay_ring_push(ReplayRing *r, const AVPacket *pkt)
+{
+    AVPacket ref;
+    int64_t t;
+
+    if (pkt->stream_index >= r->nb_streams || pkt->pts == AV_NOPTS_VALUE)
+        return;
+
+    /* card buffers go back to the card, the window would starve it */
+    if (r->copy) {
+        if (av_new_packet(&ref, pkt->size) < 0)
+            return;
+        memcpy(ref.data, pkt->data, pkt->size);
+        ref.pts          = pkt->pts;
+        ref.dts          = pkt->dts;
+        ref.duration     = pkt->duration;
+        ref.flags        = pkt->flags;
+        ref.stream_index = pkt->stream_index;
+    } else if (av_packet_ref(&ref, pkt) < 0) {
+        return;
+    }
+    t = packet_time(r, &ref);
+
+    pthread_mutex_lock(&r->mutex);
+    if (ref.stream_index == r->video_index)
+        r->last_video = t;
+    while (r->first < r->next &&
+           (r->next - r->first == r->nb_slots ||
+            (r->last_video != AV_NOPTS_VALUE &&
+             r->last_video - r->times[r->first % r->nb_slots] > r->window)))
+        drop_oldest_locked(r);
+    r->slots[r->next % r->nb_slots] = ref;
+    r->times[r->next % r->nb_slots] = t;
+    r->next++;
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/* References to the packets from seq on, from the first video keyframe
+ * if start is not known yet and up to end */
+static int take_locked(ReplayRing *r, uint64_t *seq, AVPacket **pkts,
+                       int *nb, int *size, int64_t *start, int64_t end)
+{
+    if (*seq < r->first)
+        *seq = r->first;
+
+    for (; *seq < r->next; (*seq)++) {
+        AVPacket *pkt = &r->slots[*seq % r->nb_slots];
+        int64_t t     = r->times[*seq % r->nb_slots];
+
+        if (*start == AV_NOPTS_VALUE) {
+            if (pkt->stream_index != r->video_index ||
+                !(pkt->flags & AV_PKT_FLAG_KEY))
+                continue;
+            *start = t;
+        }
+        if (t < *start || t > end)
+            continue;
+
+        if (*nb == *size) {
+            int n      = *size ? 2 * *size : 256;
+            AVPacket *p = (AVPacket *)av_realloc(*pkts, n * sizeof(*p));
+            if (!p)
+                return -1;
+            *pkts = p;
+            *size = n;
+        }
+        if (av_packet_ref(&(*pkts)[*nb], pkt) < 0)
+            return -1;
+        (*nb)++;
+    }
+
+    return 0;
+}
+
+static void write_taken(ReplayRing *r, AVFormatContext *oc, AVPacket *pkts,
+                        int nb, int64_t start)
+{
+    int64_t audio_start = av_rescale_q(start, r->video_tb, r->audio_tb);
+
+    for (int i = 0; i < nb; i++) {
+        AVPacket *pkt = &pkts[i];
+        int audio     = r->par[pkt->stream_index]->codec_type ==
+                        AVMEDIA_TYPE_AUDIO;
+        int64_t shift = audio ? audio_start : start;
+
+        pkt->pts -= shift;
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts -= shift;
+        av_packet_rescale_ts(pkt, audio ? r->audio_tb : r->video_tb,
+                             oc->streams[pkt->stream_index]->time_base);
+        av_interleaved_write_frame(oc, pkt);
+    }
+}
+
+static AVFormatContext *dump_open(ReplayRing *r, const char *filename)
+{
+    AVFormatContext *oc = avformat_alloc_context();
+    DirectWriter *direct;
+
+    if (!oc)
+        return NULL;
+    oc->oformat = r->fmt;
+    snprintf(oc->filename, sizeof(oc->filename), "%s", filename);
+
+    pthread_mutex_lock(&r->mutex);
+    for (int i = 0; i < r->nb_streams; i++) {
+        AVStream *st = avformat_new_stream(oc, NULL);
+
+        if (!st || avcodec_parameters_copy(st->codecpar, r->par[i]) < 0) {
+            pthread_mutex_unlock(&r->mutex);
+            avformat_free_context(oc);
+            return NULL;
+        }
+        st->time_base = r->time_base[i];
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    if (output_open(oc, filename, NULL, 0, 0, &direct, NULL) < 0) {
+        if (oc->pb && !(oc->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&oc->pb);
+        avformat_free_context(oc);
+        return NULL;
+    }
+
+    return oc;
+}
+
+static void wait_locked(ReplayRing *r, int64_t us)
+{
+    struct timespec abstime;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    abstime.tv_sec  = now.tv_sec + us / 1000000;
+    abstime.tv_nsec = now.tv_usec * 1000 + (us % 1000000) * 1000;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&r->cond, &r->mutex, &abstime);
+}
+
+/*
+ * Write what the ring holds, then keep taking what is pushed until the
+ * video is post_roll past the request. The ring is only locked to take
+ * references, the live capture never waits on the file.
+ */
+static void dump(ReplayRing *r, int number)
+{
+    char filename[1024];
+    AVFormatContext *oc;
+    DirectWriter *direct = NULL;
+    AVPacket *pkts = NULL;
+    int nb = 0, size = 0;
+    int64_t start = AV_NOPTS_VALUE, end;
+    uint64_t seq, lost = 0;
+    int ret;
+
+    av_get_frame_filename(filename, sizeof(filename), r->pattern, number);
+    oc = dump_open(r, filename);
+    if (!oc) {
+        fprintf(stderr, "Could not start the replay %s\n", filename);
+        return;
+    }
+
+    pthread_mutex_lock(&r->mutex);
+    seq = r->first;
+    end = r->last_video + r->post_roll;
+    ret = take_locked(r, &seq, &pkts, &nb, &size, &start, end);
+    pthread_mutex_unlock(&r->mutex);
+
+    while (ret == 0) {
+        int64_t last;
+
+        write_taken(r, oc, pkts, nb, start);
+        nb = 0;
+
+        pthread_mutex_lock(&r->mutex);
+        last = r->last_video;
+        if (r->quit || last >= end || start == AV_NOPTS_VALUE) {
+            pthread_mutex_unlock(&r->mutex);
+            break;
+        }
+        wait_locked(r, 100000);
+        if (seq < r->first)
+            lost += r->first - seq;
+        ret = take_locked(r, &seq, &pkts, &nb, &size, &start, end);
+        pthread_mutex_unlock(&r->mutex);
+    }
+
+    for (int i = 0; i < nb; i++)
+        av_packet_unref(&pkts[i]);
+    av_free(pkts);
+
+    if (output_close(oc, &direct) < 0 || ret < 0)
+        fprintf(stderr, "Could not finish the replay %s\n", filename);
+    else
+        fprintf(stderr, "Replay written to %s%s\n", filename,
+                lost ? ", the post roll outran the ring" : "");
+    avformat_free_context(oc);
+}
+
+static void *replay_thread(void *ctx)
+{
+    ReplayRing *r = (ReplayRing *)ctx;
+
+    pthread_mutex_lock(&r->mutex);
+    for (;;) {
+        int number;
+
+        while (!r->requests && !r->quit)
+            pthread_cond_wait(&r->cond, &r->mutex);
+        if (r->quit)
+            break;
+        r->requests--;
+        number = r->number++;
+        pthread_mutex_unlock(&r->mutex);
+
+        dump(r, number);
+
+        pthread_mutex_lock(&r->mutex);
+        r->dumps++;
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    return NULL;
+}
+
+int replay_ring_open(ReplayRing *r, AVFormatContext *layout,
+                     const char *pattern, double window, double post_roll,
+                     AVRational video_tb, AVRational audio_tb,
+                     AVRational frame_rate, int copy)
+{
+    double fps = av_q2d(frame_rate);
+    double tps = av_q2d(av_inv_q(video_tb));
+
+    memset(r, 0, sizeof(*r));
+    r->pattern     = pattern;
+    r->fmt         = av_guess_format(NULL, pattern, NULL);
+    r->video_index = -1;
+    r->video_tb    = video_tb;
+    r->audio_tb    = audio_tb;
+    r->window      = window    * tps;
+    r->post_roll   = post_roll * tps;
+    r->copy        = copy;
+    r->last_video  = AV_NOPTS_VALUE;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    if (!r->fmt) {
+        fprintf(stderr, "Unable to guess the replay format from %s\n",
+                pattern);
+        return -1;
+    }
+    if (layout->nb_streams > REPLAY_MAX_STREAMS)
+        return -1;
+
+    for (unsigned i = 0; i < layout->nb_streams; i++) {
+        r->par[i] = avcodec_parameters_alloc();
+        if (!r->par[i] ||
+            avcodec_parameters_copy(r->par[i], layout->streams[i]->codecpar) < 0)
+            return -1;
+        r->time_base[i] = layout->streams[i]->time_base;
+        r->nb_streams++;
+        if (r->par[i]->codec_type == AVMEDIA_TYPE_VIDEO && r->video_index < 0)
+            r->video_index = i;
+    }
+
+    /* a packet per stream and frame, plus a second of slack */
+    r->nb_slots = (unsigned)((window + 1) * fps + 1) * (r->nb_streams + 1);
+    r->slots    = (AVPacket *)av_mallocz(r->nb_slots * sizeof(*r->slots));
+    r->times    = (int64_t *)av_mallocz(r->nb_slots * sizeof(*r->times));
+    if (!r->slots || !r->times)
+        return -1;
+
+    if (pthread_create(&r->th, NULL, replay_thread, r)) {
+        fprintf(stderr, "Could not start the replay thread\n");
+        return -1;
+    }
+    r->running = 1;
+
+    return 0;
+}
+
+void replay_ring_dump(ReplayRing *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->requests++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+void replay_ring_set_video_size(ReplayRing *r, int width, int height)
+{
+    if (r->video_index < 0)
+        return;
+
+    pthread_mutex_lock(&r->mutex);
+    r->par[r->video_index]->width  = width;
+    r->par[r->video_index]->height = height;
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/* A dump in progress stops where it is, the requests not started are lost */
+void replay_ring_close(ReplayRing *r)
+{
+    if (r->running) {
+        pthread_mutex_lock(&r->mutex);
+        r->quit = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+        pthread_join(r->th, NULL);
+        r->running = 0;
+    }
+
+    while (r->slots && r->first < r->next)
+        drop_oldest_locked(r);
+    av_freep(&r->slots);
+    av_freep(&r->times);
+    for (int i = 0; i < r->nb_streams; i++)
+        avcodec_parameters_free(&r->par[i]);
+    r->nb_streams = 0;
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->cond);
+}
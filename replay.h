@@ -0,0 +1,85 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef BMDTOOLS_REPLAY_H
+#define BMDTOOLS_REPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+#define REPLAY_MAX_STREAMS 32
+
+/*
+ * Instant replay: the last window of a card is kept in a fixed ring of
+ * packet references, and on request dumped to a new file numbered from
+ * a %d pattern by a background thread, followed by post_roll more of
+ * the live input.
+ *
+ * Packets are pushed in the capture time bases by the thread delivering
+ * them to the muxers. The oldest ones are let go as soon as the video
+ * spans more than the window or every slot is taken, so the ring never
+ * holds more than its slots. A dump starts on the first video keyframe
+ * in the ring and its timestamps start at 0.
+ */
+typedef struct ReplayRing {
+    const char *pattern;
+    AVOutputFormat *fmt;
+    AVCodecParameters *par[REPLAY_MAX_STREAMS];
+    AVRational time_base[REPLAY_MAX_STREAMS];
+    int nb_streams;
+    int video_index;
+    AVRational video_tb, audio_tb;
+    int64_t window, post_roll;  /* video time base */
+    int copy;                   /* pushed packets may hold card buffers */
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    AVPacket *slots;
+    int64_t *times;             /* of each slot, video time base */
+    unsigned nb_slots;
+    uint64_t first, next;       /* sequence of the oldest and next slot */
+    int64_t last_video;
+
+    pthread_t th;
+    int running, quit;
+    int requests;
+    int number;                 /* of the next dump */
+    unsigned long dumps;
+} ReplayRing;
+
+/* frame_rate sizes the ring, the window is counted in video_tb */
+int replay_ring_open(ReplayRing *r, AVFormatContext *layout,
+                     const char *pattern, double window, double post_roll,
+                     AVRational video_tb, AVRational audio_tb,
+                     AVRational frame_rate, int copy);
+void replay_ring_push(ReplayRing *r, const AVPacket *pkt);
+/* Dump the window, can be called from any thread but a signal handler */
+void replay_ring_dump(ReplayRing *r);
+void replay_ring_set_video_size(ReplayRing *r, int width, int height);
+void replay_ring_close(ReplayRing *r);
+
+#endif /* BMDTOOLS_REPLAY_H */
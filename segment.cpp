@@ -0,0 +1,499 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "segment.h"
+extern "C" {
+#include "libavutil/avstring.h"
+#include "libavutil/mem.h"
+}
+
+int output_open(AVFormatContext *oc, const char *filename,
+                AVDictionary **opts, size_t direct_buffer, int direct_depth,
+                DirectWriter **direct, DirectStats *stats)
+{
+    *direct = NULL;
+
+    if (oc->oformat->flags & AVFMT_NOFILE)
+        goto header;
+
+    if (direct_buffer && !strcmp(avio_find_protocol_name(filename), "file")) {
+        const char *path = filename;
+
+        av_strstart(path, "file:", &path);
+        *direct = (DirectWriter *)av_mallocz(sizeof(**direct));
+        if (!*direct ||
+            direct_writer_open(*direct, path, direct_buffer,
+                               direct_depth) < 0) {
+            av_freep(direct);
+            return -1;
+        }
+        (*direct)->shared = stats;
+        oc->pb     = (*direct)->avio;
+        oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    } else if (avio_open(&oc->pb, filename, AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "Could not open '%s'\n", filename);
+        return -1;
+    }
+
+header:
+    if (avformat_write_header(oc, opts) < 0) {
+        fprintf(stderr, "Could not write the header of '%s'\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+int output_close(AVFormatContext *oc, DirectWriter **direct)
+{
+    int ret = av_write_trailer(oc) < 0 ? -1 : 0;
+
+    if (*direct) {
+        if (direct_writer_close(*direct) < 0)
+            ret = -1;
+        av_freep(direct);
+        oc->pb = NULL;
+    } else if (!(oc->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&oc->pb);
+    }
+
+    return ret;
+}
+
+/* e.g. 3600s, 90000f, 100G or 3600s,100G */
+int segment_rule_parse(SegmentRule *rule, const char *arg)
+{
+    const char *p = arg;
+
+    memset(rule, 0, sizeof(*rule));
+
+    while (*p) {
+        char *end;
+        long long val = strtoll(p, &end, 10);
+
+        if (end == p || val <= 0)
+            return -1;
+        switch (*end) {
+        case 's': rule->duration = val * 1000000;          break;
+        case 'f': rule->frames   = val;                    break;
+        case 'M': rule->size     = val << 20;              break;
+        case 'G': rule->size     = val << 30;              break;
+        default:
+            return -1;
+        }
+        p = end + 1;
+        if (*p == ',')
+            p++;
+    }
+
+    return rule->duration || rule->frames || rule->size ? 0 : -1;
+}
+
+int segment_pattern_valid(const char *pattern)
+{
+    char buf[1024];
+
+    return av_get_frame_filename(buf, sizeof(buf), pattern, 0) >= 0;
+}
+
+static SegmentFile *segment_file_alloc(Segmenter *s, int number)
+{
+    SegmentFile *f = (SegmentFile *)av_mallocz(sizeof(*f));
+    AVFormatContext *oc;
+
+    if (!f)
+        return NULL;
+    av_get_frame_filename(f->filename, sizeof(f->filename), s->pattern, number);
+
+    oc = f->oc = avformat_alloc_context();
+    if (!oc)
+        goto fail;
+    oc->oformat = s->layout->oformat;
+    snprintf(oc->filename, sizeof(oc->filename), "%s", f->filename);
+
+    pthread_mutex_lock(&s->mutex);
+    for (unsigned i = 0; i < s->layout->nb_streams; i++) {
+        AVStream *src = s->layout->streams[i];
+        AVStream *st  = avformat_new_stream(oc, NULL);
+
+        if (!st || avcodec_parameters_copy(st->codecpar, src->codecpar) < 0) {
+            pthread_mutex_unlock(&s->mutex);
+            goto fail;
+        }
+        st->time_base = src->time_base;
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return f;
+
+fail:
+    avformat_free_context(f->oc);
+    av_free(f);
+    return NULL;
+}
+
+static SegmentFile *segment_file_open(Segmenter *s, int number)
+{
+    SegmentFile *f = segment_file_alloc(s, number);
+    AVDictionary *opts = NULL;
+    int ret;
+
+    if (!f)
+        return NULL;
+
+    av_dict_copy(&opts, s->opts, 0);
+    ret = output_open(f->oc, f->filename, &opts, s->direct_buffer,
+                      s->direct_depth, &f->direct, &s->direct_stats);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        if (f->direct) {
+            direct_writer_close(f->direct);
+            av_free(f->direct);
+        } else if (f->oc->pb && !(f->oc->flags & AVFMT_FLAG_CUSTOM_IO)) {
+            avio_closep(&f->oc->pb);
+        }
+        avformat_free_context(f->oc);
+        av_free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+static void segment_file_close(SegmentFile *f)
+{
+    if (output_close(f->oc, &f->direct) < 0)
+        fprintf(stderr, "Could not finish segment '%s'\n", f->filename);
+    if (f->discard)
+        unlink(f->filename);
+    avformat_free_context(f->oc);
+    av_free(f);
+}
+
+/* Finishes the segments left behind and opens the next one as soon as
+ * the current one starts. A discarded segment is removed before its
+ * number is opened again. */
+static void *segment_thread(void *ctx)
+{
+    Segmenter *s = (Segmenter *)ctx;
+
+    pthread_mutex_lock(&s->mutex);
+    for (;;) {
+        while (!s->quit && !s->nb_closing && s->state != SEGMENT_NONE)
+            pthread_cond_wait(&s->cond, &s->mutex);
+
+        if (s->nb_closing) {
+            SegmentFile *f = s->closing[0];
+
+            memmove(s->closing, s->closing + 1,
+                    --s->nb_closing * sizeof(*s->closing));
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->mutex);
+            segment_file_close(f);
+            pthread_mutex_lock(&s->mutex);
+        } else if (s->state == SEGMENT_NONE && !s->quit) {
+            int number = s->number++;
+
+            s->state = SEGMENT_OPENING;
+            pthread_mutex_unlock(&s->mutex);
+            SegmentFile *f = segment_file_open(s, number);
+            pthread_mutex_lock(&s->mutex);
+            if (!f)
+                fprintf(stderr, "Could not open segment %d\n", number);
+            s->next  = f;
+            s->state = f ? SEGMENT_READY : SEGMENT_FAILED;
+            pthread_cond_broadcast(&s->cond);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+/* Hand f to the thread to finish, called with the mutex held */
+static void retire_locked(Segmenter *s, SegmentFile *f)
+{
+    while (s->nb_closing == SEGMENT_MAX_CLOSING)
+        pthread_cond_wait(&s->cond, &s->mutex);
+    s->closing[s->nb_closing++] = f;
+    pthread_cond_broadcast(&s->cond);
+}
+
+static void retire(Segmenter *s, SegmentFile *f)
+{
+    pthread_mutex_lock(&s->mutex);
+    retire_locked(s, f);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+int segmenter_open(Segmenter *s, AVFormatContext *layout, const char *pattern,
+                   AVDictionary *opts, const SegmentRule *rule,
+                   size_t direct_buffer, int direct_depth,
+                   AVRational video_tb, AVRational audio_tb)
+{
+    memset(s, 0, sizeof(*s));
+    s->layout        = layout;
+    s->pattern       = pattern;
+    s->rule          = *rule;
+    s->direct_buffer = direct_buffer;
+    s->direct_depth  = direct_depth;
+    direct_stats_init(&s->direct_stats);
+    s->video_tb      = video_tb;
+    s->audio_tb      = audio_tb;
+    s->video_index   = -1;
+    s->start         = AV_NOPTS_VALUE;
+    s->split         = AV_NOPTS_VALUE;
+    av_dict_copy(&s->opts, opts, 0);
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    for (unsigned i = 0; i < layout->nb_streams; i++) {
+        AVCodecParameters *par = layout->streams[i]->codecpar;
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && s->video_index < 0)
+            s->video_index = i;
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO && i < 32 &&
+            par->channels) {
+            s->audio_streams |= 1U << i;
+            s->sample_rate    = par->sample_rate;
+        }
+    }
+
+    s->cur = segment_file_open(s, s->number++);
+    if (!s->cur)
+        return -1;
+
+    if (pthread_create(&s->th, NULL, segment_thread, s)) {
+        fprintf(stderr, "Could not start the segment thread\n");
+        return -1;
+    }
+    s->running = 1;
+
+    return 0;
+}
+
+static int boundary_reached(Segmenter *s, AVPacket *pkt)
+{
+    const SegmentRule *r = &s->rule;
+
+    if (r->frames && s->frames >= r->frames)
+        return 1;
+    if (r->size && s->bytes >= r->size)
+        return 1;
+    return r->duration &&
+           av_rescale_q(pkt->pts - s->start, s->video_tb,
+                        AV_TIME_BASE_Q) >= r->duration;
+}
+
+/*
+ * Start the segment opened ahead with the frame at pts, 0 if it is not
+ * open. With force the segment still to be opened is waited for too.
+ */
+static int switch_segment(Segmenter *s, int64_t pts, int force)
+{
+    SegmentFile *next;
+
+    pthread_mutex_lock(&s->mutex);
+    if ((s->state == SEGMENT_OPENING ||
+         (force && s->state == SEGMENT_NONE)) && !s->retrying) {
+        fprintf(stderr, "Segment %d is not open yet, waiting\n",
+                s->number - (s->state == SEGMENT_OPENING));
+        while (s->state == SEGMENT_OPENING ||
+               (force && s->state == SEGMENT_NONE))
+            pthread_cond_wait(&s->cond, &s->mutex);
+    }
+    if (s->state != SEGMENT_READY) {
+        // Keep going with the current one while it is opened again.
+        if (s->state == SEGMENT_FAILED) {
+            s->state = SEGMENT_NONE;
+            s->number--;
+        }
+        s->retrying = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+        return 0;
+    }
+
+    next     = s->next;
+    s->next  = NULL;
+    s->state = SEGMENT_NONE;
+    if (s->prev)
+        retire_locked(s, s->prev);
+    s->prev = s->cur;
+    s->cur  = next;
+    s->retrying = 0;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    s->cur->oc->output_ts_offset = -av_rescale_q(pts, s->video_tb,
+                                                 AV_TIME_BASE_Q);
+    s->start  = pts;
+    s->split  = av_rescale_q(pts, s->video_tb, s->audio_tb);
+    s->audio_split = 0;
+    s->frames = 0;
+    s->bytes  = 0;
+
+    fprintf(stderr, "Recording to %s\n", s->cur->filename);
+
+    return 1;
+}
+
+static int write_to(SegmentFile *f, AVPacket *pkt, AVRational tb)
+{
+    AVStream *st = f->oc->streams[pkt->stream_index];
+
+    av_packet_rescale_ts(pkt, tb, st->time_base);
+    return av_interleaved_write_frame(f->oc, pkt);
+}
+
+static int is_audio(Segmenter *s, int index)
+{
+    return index < 32 && (s->audio_streams & (1U << index));
+}
+
+/* Audio before the boundary still goes to the previous segment, the
+ * packet straddling it is cut to the sample. prev is done once every
+ * audio stream went past the boundary. */
+static int write_audio(Segmenter *s, AVPacket *pkt)
+{
+    AVCodecParameters *par = s->layout->streams[pkt->stream_index]->codecpar;
+    int sample_size = par->channels *
+                      av_get_bytes_per_sample((enum AVSampleFormat)par->format);
+    int nb_samples  = pkt->size / sample_size;
+    int64_t end    = pkt->pts + av_rescale_q(nb_samples,
+                                             av_make_q(1, s->sample_rate),
+                                             s->audio_tb);
+    int64_t cut;
+    AVPacket head;
+
+    if (end <= s->split)
+        return write_to(s->prev, pkt, s->audio_tb);
+
+    if (pkt->pts < s->split) {
+        cut = av_rescale_q(s->split - pkt->pts, s->audio_tb,
+                           av_make_q(1, s->sample_rate)) * sample_size;
+        if (av_packet_ref(&head, pkt) >= 0) {
+            head.size     = cut;
+            head.duration = 0;
+            write_to(s->prev, &head, s->audio_tb);
+        }
+        pkt->data     += cut;
+        pkt->size     -= cut;
+        pkt->pts       = s->split;
+        pkt->dts       = s->split;
+        pkt->duration  = 0;
+    }
+
+    s->audio_split |= 1U << pkt->stream_index;
+    if (s->audio_split == s->audio_streams) {
+        retire(s, s->prev);
+        s->prev = NULL;
+    }
+
+    return write_to(s->cur, pkt, s->audio_tb);
+}
+
+int segmenter_write(Segmenter *s, AVPacket *pkt)
+{
+    int size = pkt->size;
+    int ret;
+
+    if (pkt->stream_index == s->video_index) {
+        if (s->resized)
+            s->resized = !switch_segment(s, pkt->pts, 1);
+        else if (s->start == AV_NOPTS_VALUE)
+            s->start = pkt->pts;
+        else if ((pkt->flags & AV_PKT_FLAG_KEY) && boundary_reached(s, pkt))
+            switch_segment(s, pkt->pts, 0);
+        s->frames++;
+    }
+
+    if (is_audio(s, pkt->stream_index) && s->prev &&
+        !(s->audio_split & (1U << pkt->stream_index)))
+        ret = write_audio(s, pkt);
+    else
+        ret = write_to(s->cur, pkt, is_audio(s, pkt->stream_index) ?
+                                    s->audio_tb : s->video_tb);
+    s->bytes += size;
+
+    return ret;
+}
+
+void segmenter_set_video_size(Segmenter *s, int width, int height)
+{
+    AVCodecParameters *par;
+
+    if (s->video_index < 0)
+        return;
+
+    pthread_mutex_lock(&s->mutex);
+    par         = s->layout->streams[s->video_index]->codecpar;
+    par->width  = width;
+    par->height = height;
+    s->resized  = 1;
+
+    while (s->state == SEGMENT_OPENING)
+        pthread_cond_wait(&s->cond, &s->mutex);
+    if (s->state == SEGMENT_READY) {
+        // Reopened with the new size under the same number.
+        s->next->discard = 1;
+        retire_locked(s, s->next);
+        s->next = NULL;
+        s->number--;
+    }
+    s->state = SEGMENT_NONE;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void segmenter_close(Segmenter *s)
+{
+    if (s->running) {
+        pthread_mutex_lock(&s->mutex);
+        while (s->state == SEGMENT_OPENING)
+            pthread_cond_wait(&s->cond, &s->mutex);
+        s->quit = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+        pthread_join(s->th, NULL);
+        s->running = 0;
+    }
+
+    if (s->next) {
+        s->next->discard = 1;
+        segment_file_close(s->next);
+    }
+    if (s->prev)
+        segment_file_close(s->prev);
+    if (s->cur)
+        segment_file_close(s->cur);
+    s->next = s->prev = s->cur = NULL;
+
+    av_dict_free(&s->opts);
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+}
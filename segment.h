@@ -0,0 +1,122 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_SEGMENT_H
+#define BMDTOOLS_SEGMENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "directio.h"
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+/* Open oc on filename, through a DirectWriter if direct_buffer is set,
+ * and write the header. The writer also counts into stats if set. */
+int output_open(AVFormatContext *oc, const char *filename,
+                AVDictionary **opts, size_t direct_buffer, int direct_depth,
+                DirectWriter **direct, DirectStats *stats);
+/* Write the trailer and close what output_open() opened. */
+int output_close(AVFormatContext *oc, DirectWriter **direct);
+
+/* Rotation rule, the first limit reached starts a new segment */
+typedef struct SegmentRule {
+    int64_t duration;   /* microseconds */
+    int64_t frames;
+    int64_t size;       /* bytes */
+} SegmentRule;
+
+typedef struct SegmentFile {
+    AVFormatContext *oc;
+    DirectWriter *direct;
+    char filename[1024];
+    int discard;        /* opened ahead but never used */
+} SegmentFile;
+
+#define SEGMENT_MAX_CLOSING 4
+
+enum SegmentState {
+    SEGMENT_NONE,
+    SEGMENT_OPENING,
+    SEGMENT_READY,
+    SEGMENT_FAILED,
+};
+
+/*
+ * Split one output in numbered files, the name pattern takes a %d.
+ *
+ * Segments start on a video frame, every audio stream is cut at the same
+ * time to the sample. The next segment is opened and its header written ahead
+ * of time, the previous one is finished, on a background thread: the
+ * writer only swaps two pointers at the boundary.
+ *
+ * Packets are fed in the capture time bases and are written with the
+ * timestamps of each segment starting at 0.
+ */
+typedef struct Segmenter {
+    AVFormatContext *layout;    /* streams the segments are cloned from */
+    const char *pattern;
+    AVDictionary *opts;
+    SegmentRule rule;
+    size_t direct_buffer;
+    int direct_depth;
+    DirectStats direct_stats;   /* of every segment, for the metrics */
+    int video_index;
+    unsigned audio_streams;     /* bit per audio stream index */
+    AVRational video_tb, audio_tb;
+    int sample_rate;
+
+    SegmentFile *cur, *prev;
+    int64_t start;              /* first video pts of cur */
+    int64_t split;              /* audio pts where prev ends */
+    unsigned audio_split;       /* audio streams already past split */
+    int64_t frames, bytes;
+    int resized;                /* split at the next video frame */
+
+    pthread_t th;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running, quit;
+    int retrying;               /* the last open failed, do not wait */
+    enum SegmentState state;
+    SegmentFile *next;
+    int number;                 /* of the next segment */
+    SegmentFile *closing[SEGMENT_MAX_CLOSING];
+    int nb_closing;
+} Segmenter;
+
+int segment_rule_parse(SegmentRule *rule, const char *arg);
+int segment_pattern_valid(const char *pattern);
+
+int segmenter_open(Segmenter *s, AVFormatContext *layout, const char *pattern,
+                   AVDictionary *opts, const SegmentRule *rule,
+                   size_t direct_buffer, int direct_depth,
+                   AVRational video_tb, AVRational audio_tb);
+int segmenter_write(Segmenter *s, AVPacket *pkt);
+/* The video size changed, the next video frame starts a new segment
+ * opened with it, the header of the current one stays untouched. */
+void segmenter_set_video_size(Segmenter *s, int width, int height);
+void segmenter_close(Segmenter *s);
+
+#endif /* BMDTOOLS_SEGMENT_H */
@@ -0,0 +1,262 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "spill.h"
+extern "C" {
+#include "libavutil/time.h"
+}
+
+#define SPILL_ALIGN 64
+
+typedef struct SpillRecord {
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    int64_t stamp;          /* see avpacket_queue_put_stamp() */
+    int32_t size;           /* -1 marks a wrap to the start of the file */
+    int32_t stream_index;
+    int32_t flags;
+    int32_t side_data_size; /* type, size and payload of each entry */
+} SpillRecord;
+
+static uint64_t record_size(int size)
+{
+    return (sizeof(SpillRecord) + size + SPILL_ALIGN - 1) &
+           ~(uint64_t)(SPILL_ALIGN - 1);
+}
+
+static int side_data_size(const AVPacket *pkt)
+{
+    int size = 0;
+
+    for (int i = 0; i < pkt->side_data_elems; i++)
+        size += 2 * sizeof(int32_t) + pkt->side_data[i].size;
+
+    return size;
+}
+
+int packet_spill_open(PacketSpill *s, const char *path, uint64_t capacity)
+{
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+
+    capacity &= ~(uint64_t)(SPILL_ALIGN - 1);
+
+    s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (s->fd < 0) {
+        fprintf(stderr, "Could not open the spill file '%s'\n", path);
+        return -1;
+    }
+    // The file is only scratch space, do not leave it behind.
+    unlink(path);
+
+#ifdef __linux__
+    if (posix_fallocate(s->fd, 0, capacity)) {
+#else
+    if (ftruncate(s->fd, capacity)) {
+#endif
+        fprintf(stderr, "Could not preallocate %" PRIu64 " bytes for the "
+                "spill file\n", capacity);
+        goto fail;
+    }
+
+    s->map = (uint8_t *)mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        fprintf(stderr, "Could not map the spill file\n");
+        goto fail;
+    }
+    madvise(s->map, capacity, MADV_SEQUENTIAL);
+
+    s->capacity    = capacity;
+    s->report_time = av_gettime_relative();
+    return 0;
+
+fail:
+    close(s->fd);
+    s->fd = -1;
+    return -1;
+}
+
+void packet_spill_close(PacketSpill *s)
+{
+    if (s->map)
+        munmap(s->map, s->capacity);
+    if (s->fd >= 0)
+        close(s->fd);
+    s->map = NULL;
+    s->fd  = -1;
+}
+
+/*
+ * Append pkt, -1 if there is no room left, -2 if pkt is larger than the
+ * whole spill and would never fit.
+ */
+int packet_spill_write(PacketSpill *s, const AVPacket *pkt, int64_t stamp)
+{
+    int sd_size   = side_data_size(pkt);
+    uint64_t len  = record_size(pkt->size + sd_size);
+    uint64_t off  = s->wpos % s->capacity;
+    uint64_t skip = 0;
+    SpillRecord *rec;
+    uint8_t *p;
+
+    if (len > s->capacity)
+        return -2;
+
+    /* nothing to read, restart at the beginning instead of wrapping */
+    if (s->wpos == s->rpos && off + len > s->capacity) {
+        s->wpos += s->capacity - off;
+        s->rpos  = s->wpos;
+        off      = 0;
+    }
+
+    if (off + len > s->capacity)
+        skip = s->capacity - off;
+
+    if (s->wpos + skip + len - s->rpos > s->capacity)
+        return -1;
+
+    if (skip) {
+        rec       = (SpillRecord *)(s->map + off);
+        rec->size = -1;
+        s->wpos  += skip;
+        off       = 0;
+    }
+
+    rec               = (SpillRecord *)(s->map + off);
+    rec->pts          = pkt->pts;
+    rec->dts          = pkt->dts;
+    rec->duration     = pkt->duration;
+    rec->stamp        = stamp;
+    rec->size         = pkt->size;
+    rec->stream_index = pkt->stream_index;
+    rec->flags        = pkt->flags;
+    rec->side_data_size = sd_size;
+    memcpy(rec + 1, pkt->data, pkt->size);
+
+    p = (uint8_t *)(rec + 1) + pkt->size;
+    for (int i = 0; i < pkt->side_data_elems; i++) {
+        int32_t hdr[2] = { pkt->side_data[i].type, pkt->side_data[i].size };
+        memcpy(p, hdr, sizeof(hdr));
+        memcpy(p + sizeof(hdr), pkt->side_data[i].data, hdr[1]);
+        p += sizeof(hdr) + hdr[1];
+    }
+
+    __atomic_store_n(&s->wpos, s->wpos + len, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->nb_packets, s->nb_packets + 1, __ATOMIC_RELAXED);
+    s->bytes_written += pkt->size;
+
+    return 0;
+}
+
+/* Read back the oldest packet, 0 if the spill is empty. */
+int packet_spill_read(PacketSpill *s, AVPacket *pkt, int64_t *stamp)
+{
+    SpillRecord *rec;
+    uint8_t *p, *end;
+
+    if (s->rpos == s->wpos)
+        return 0;
+
+    rec = (SpillRecord *)(s->map + s->rpos % s->capacity);
+    if (rec->size < 0) {
+        s->rpos += s->capacity - s->rpos % s->capacity;
+        rec      = (SpillRecord *)s->map;
+    }
+
+    if (av_new_packet(pkt, rec->size) < 0)
+        return AVERROR(ENOMEM);
+
+    memcpy(pkt->data, rec + 1, rec->size);
+    pkt->pts          = rec->pts;
+    pkt->dts          = rec->dts;
+    pkt->duration     = rec->duration;
+    pkt->stream_index = rec->stream_index;
+    pkt->flags        = rec->flags;
+    *stamp            = rec->stamp;
+
+    p   = (uint8_t *)(rec + 1) + rec->size;
+    end = p + rec->side_data_size;
+    while (p < end) {
+        int32_t hdr[2];
+        uint8_t *sd;
+
+        memcpy(hdr, p, sizeof(hdr));
+        sd = av_packet_new_side_data(pkt, (enum AVPacketSideDataType)hdr[0],
+                                     hdr[1]);
+        if (!sd) {
+            av_packet_unref(pkt);
+            return AVERROR(ENOMEM);
+        }
+        memcpy(sd, p + sizeof(hdr), hdr[1]);
+        p += sizeof(hdr) + hdr[1];
+    }
+
+    __atomic_store_n(&s->rpos,
+                     s->rpos + record_size(rec->size + rec->side_data_size),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&s->nb_packets, s->nb_packets - 1, __ATOMIC_RELAXED);
+    s->bytes_read += rec->size;
+
+    return 1;
+}
+
+/* Safe to call from any thread, e.g. the metrics one */
+uint64_t packet_spill_depth(PacketSpill *s)
+{
+    return __atomic_load_n(&s->wpos, __ATOMIC_RELAXED) -
+           __atomic_load_n(&s->rpos, __ATOMIC_RELAXED);
+}
+
+unsigned packet_spill_nb_packets(PacketSpill *s)
+{
+    return __atomic_load_n(&s->nb_packets, __ATOMIC_RELAXED);
+}
+
+void packet_spill_report(PacketSpill *s, FILE *f)
+{
+    int64_t now     = av_gettime_relative();
+    double  elapsed = (now - s->report_time) / 1000000.0;
+
+    if (elapsed <= 0)
+        return;
+
+    fprintf(f, "Spill depth %u packets (%.1f MB) - "
+            "write %.1f MB/s - read %.1f MB/s - dropped %u\n",
+            s->nb_packets,
+            (double)packet_spill_depth(s) / 1024 / 1024,
+            (s->bytes_written - s->report_written) / elapsed / 1024 / 1024,
+            (s->bytes_read - s->report_read) / elapsed / 1024 / 1024,
+            s->dropped);
+
+    s->report_written = s->bytes_written;
+    s->report_read    = s->bytes_read;
+    s->report_time    = now;
+}
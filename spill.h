@@ -0,0 +1,59 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_SPILL_H
+#define BMDTOOLS_SPILL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+/*
+ * Circular packet log on a preallocated, memory-mapped file.
+ *
+ * Packets are appended and read back strictly in order, it is meant to
+ * be driven by a single thread.
+ */
+typedef struct PacketSpill {
+    int fd;
+    uint8_t *map;
+    uint64_t capacity;
+    uint64_t rpos, wpos;
+    unsigned nb_packets;
+    unsigned dropped;   /* packets it could not take, counted by the caller */
+
+    uint64_t bytes_written, bytes_read;
+    uint64_t report_written, report_read;
+    int64_t report_time;
+} PacketSpill;
+
+int packet_spill_open(PacketSpill *s, const char *path, uint64_t capacity);
+void packet_spill_close(PacketSpill *s);
+int packet_spill_write(PacketSpill *s, const AVPacket *pkt, int64_t stamp);
+int packet_spill_read(PacketSpill *s, AVPacket *pkt, int64_t *stamp);
+uint64_t packet_spill_depth(PacketSpill *s);
+unsigned packet_spill_nb_packets(PacketSpill *s);
+void packet_spill_report(PacketSpill *s, FILE *f);
+
+#endif /* BMDTOOLS_SPILL_H */
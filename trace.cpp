@@ -0,0 +1,192 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef BMDTOOLS_TRACE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define TRACE_EVENTS (1 << 16)
+
+typedef struct TraceEvent {
+    int64_t ts;
+    const char *name;
+    char phase;
+} TraceEvent;
+
+/* Written by its thread only, the oldest events are overwritten */
+typedef struct TraceBuffer {
+    TraceEvent events[TRACE_EVENTS];
+    unsigned count;
+    int tid;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+static __thread TraceBuffer *thread_buffer;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *buffers;
+static int nb_buffers;
+static char *trace_path;
+static int64_t trace_start;
+
+static int flush_pipe[2] = { -1, -1 };
+static pthread_t flush_th;
+
+static int64_t trace_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static TraceBuffer *register_thread(void)
+{
+    TraceBuffer *b = (TraceBuffer *)calloc(1, sizeof(*b));
+
+    if (!b)
+        return NULL;
+
+    pthread_mutex_lock(&trace_mutex);
+    b->tid  = ++nb_buffers;
+    b->next = buffers;
+    buffers = b;
+    pthread_mutex_unlock(&trace_mutex);
+
+    return b;
+}
+
+void trace_event(const char *name, char phase)
+{
+    TraceBuffer *b = thread_buffer;
+    TraceEvent *e;
+    unsigned count;
+
+    if (!trace_path)
+        return;
+
+    if (!b && !(b = thread_buffer = register_thread()))
+        return;
+
+    count    = b->count;
+    e        = &b->events[count % TRACE_EVENTS];
+    e->ts    = trace_clock();
+    e->name  = name;
+    e->phase = phase;
+    __atomic_store_n(&b->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/* The rings keep being written meanwhile, a wrapped one loses a few events */
+void trace_flush(void)
+{
+    FILE *f;
+    const char *sep = "";
+
+    pthread_mutex_lock(&trace_mutex);
+
+    f = fopen(trace_path, "w");
+    if (!f) {
+        fprintf(stderr, "Could not write the trace to %s\n", trace_path);
+        pthread_mutex_unlock(&trace_mutex);
+        return;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (TraceBuffer *b = buffers; b; b = b->next) {
+        unsigned count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+        unsigned first = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+
+        for (unsigned i = first; i < count; i++) {
+            TraceEvent *e = &b->events[i % TRACE_EVENTS];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d}", sep, e->name, e->phase,
+                    (e->ts - trace_start) / 1000.0, (int)getpid(), b->tid);
+            sep = ",\n";
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    pthread_mutex_unlock(&trace_mutex);
+    fprintf(stderr, "Trace written to %s\n", trace_path);
+}
+
+static void *flush_thread(void *ctx)
+{
+    char c;
+
+    while (read(flush_pipe[0], &c, 1) == 1 && c == 'f')
+        trace_flush();
+
+    return NULL;
+}
+
+static void flush_handler(int sig)
+{
+    char c = 'f';
+
+    if (write(flush_pipe[1], &c, 1) < 0)
+        return;
+}
+
+int trace_init(const char *path)
+{
+    if (pipe(flush_pipe) < 0)
+        return -1;
+
+    trace_start = trace_clock();
+    trace_path  = strdup(path);
+    if (!trace_path || pthread_create(&flush_th, NULL, flush_thread, NULL)) {
+        free(trace_path);
+        trace_path = NULL;
+        return -1;
+    }
+
+    signal(SIGUSR1, flush_handler);
+    return 0;
+}
+
+void trace_close(void)
+{
+    char c = 'q';
+
+    if (!trace_path)
+        return;
+
+    signal(SIGUSR1, SIG_DFL);
+    if (write(flush_pipe[1], &c, 1) == 1)
+        pthread_join(flush_th, NULL);
+    close(flush_pipe[0]);
+    close(flush_pipe[1]);
+
+    trace_flush();
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_TRACE_H
+#define BMDTOOLS_TRACE_H
+
+#include <stdio.h>
+
+/*
+ * Begin/end events recorded in a per-thread ring and written out as a
+ * Chrome trace (chrome://tracing, ui.perfetto.dev) on exit or SIGUSR1.
+ *
+ * Only built with make TRACE=1, otherwise the macros compile to nothing.
+ * Names must be string literals, only the pointer is stored.
+ */
+#ifdef BMDTOOLS_TRACE
+
+int trace_init(const char *path);
+void trace_event(const char *name, char phase);
+void trace_flush(void);
+void trace_close(void);
+
+#define TRACE_BEGIN(name) trace_event(name, 'B')
+#define TRACE_END(name)   trace_event(name, 'E')
+
+#else
+
+static inline int trace_init(const char *path)
+{
+    fprintf(stderr, "Tracing not available, build with make TRACE=1\n");
+    return -1;
+}
+static inline void trace_close(void) { }
+
+#define TRACE_BEGIN(name) do { } while (0)
+#define TRACE_END(name)   do { } while (0)
+
+#endif
+
+#endif /* BMDTOOLS_TRACE_H */
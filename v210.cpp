@@ -0,0 +1,413 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "v210.h"
+
+/*
+ * Every 16 bytes hold 6 pixels as 12 10-bit components,
+ * three per little endian word:
+ *
+ *   word 0: Cb0 Y0  Cr0
+ *   word 1: Y1  Cb2 Y2
+ *   word 2: Cr2 Y3  Cb4
+ *   word 3: Y4  Cr4 Y5
+ */
+static void unpack_block_c(const uint32_t *src, uint16_t *y, uint16_t *u,
+                           uint16_t *v, int pixels)
+{
+    uint16_t c[12];
+
+    for (int i = 0; i < 4; i++) {
+        c[3 * i]     =  src[i]        & 0x3ff;
+        c[3 * i + 1] = (src[i] >> 10) & 0x3ff;
+        c[3 * i + 2] = (src[i] >> 20) & 0x3ff;
+    }
+
+    for (int i = 0; i < pixels; i++)
+        y[i] = c[2 * i + 1];
+    for (int i = 0; i < (pixels + 1) / 2; i++) {
+        u[i] = c[4 * i];
+        v[i] = c[4 * i + 2];
+    }
+}
+
+static void unpack_row_c(const uint32_t *src, uint16_t *y, uint16_t *u,
+                         uint16_t *v, int width)
+{
+    for (int x = 0; x < width; x += 6, src += 4, y += 6, u += 3, v += 3)
+        unpack_block_c(src, y, u, v, width - x < 6 ? width - x : 6);
+}
+
+#ifdef HAVE_X86
+/*
+ * After masking the three fields of each word into a, b and c and packing
+ * them to 16 bits, ab holds a0..a3 b0..b3 and cc holds c0..c3 twice:
+ *
+ *   Y = b0 a1 c1 b2 a3 c3    U = a0 b1 c2    V = c0 a2 b3
+ */
+#define V210_SHUFFLES                                                       \
+    const __m128i y_ab = _mm_setr_epi8(8, 9, 2, 3, -1, -1, 12, 13,          \
+                                       6, 7, -1, -1, -1, -1, -1, -1);       \
+    const __m128i y_c  = _mm_setr_epi8(-1, -1, -1, -1, 2, 3, -1, -1,        \
+                                       -1, -1, 6, 7, -1, -1, -1, -1);       \
+    const __m128i u_ab = _mm_setr_epi8(0, 1, 10, 11, -1, -1, -1, -1,        \
+                                       -1, -1, -1, -1, -1, -1, -1, -1);     \
+    const __m128i u_c  = _mm_setr_epi8(-1, -1, -1, -1, 4, 5, -1, -1,        \
+                                       -1, -1, -1, -1, -1, -1, -1, -1);     \
+    const __m128i v_ab = _mm_setr_epi8(-1, -1, 4, 5, 14, 15, -1, -1,        \
+                                       -1, -1, -1, -1, -1, -1, -1, -1);     \
+    const __m128i v_c  = _mm_setr_epi8(0, 1, -1, -1, -1, -1, -1, -1,        \
+                                       -1, -1, -1, -1, -1, -1, -1, -1);
+
+/* The stores spill past the 6 (or 3) valid values, so the last block
+ * of each row is left to the C version. */
+__attribute__((target("sse4.1")))
+static void unpack_row_sse4(const uint32_t *src, uint16_t *y, uint16_t *u,
+                            uint16_t *v, int width)
+{
+    V210_SHUFFLES
+    const __m128i mask = _mm_set1_epi32(0x3ff);
+    int x = 0;
+
+    for (; x + 6 < width; x += 6, src += 4, y += 6, u += 3, v += 3) {
+        __m128i w  = _mm_loadu_si128((const __m128i *)src);
+        __m128i a  = _mm_and_si128(w, mask);
+        __m128i b  = _mm_and_si128(_mm_srli_epi32(w, 10), mask);
+        __m128i c  = _mm_and_si128(_mm_srli_epi32(w, 20), mask);
+        __m128i ab = _mm_packus_epi32(a, b);
+        __m128i cc = _mm_packus_epi32(c, c);
+
+        _mm_storeu_si128((__m128i *)y,
+                         _mm_or_si128(_mm_shuffle_epi8(ab, y_ab),
+                                      _mm_shuffle_epi8(cc, y_c)));
+        _mm_storel_epi64((__m128i *)u,
+                         _mm_or_si128(_mm_shuffle_epi8(ab, u_ab),
+                                      _mm_shuffle_epi8(cc, u_c)));
+        _mm_storel_epi64((__m128i *)v,
+                         _mm_or_si128(_mm_shuffle_epi8(ab, v_ab),
+                                      _mm_shuffle_epi8(cc, v_c)));
+    }
+
+    unpack_row_c(src, y, u, v, width - x);
+}
+
+/* Each 128-bit lane holds one block, the shuffles work per lane. */
+__attribute__((target("avx2")))
+static void unpack_row_avx2(const uint32_t *src, uint16_t *y, uint16_t *u,
+                            uint16_t *v, int width)
+{
+    V210_SHUFFLES
+    const __m256i mask  = _mm256_set1_epi32(0x3ff);
+    const __m256i y_ab2 = _mm256_broadcastsi128_si256(y_ab);
+    const __m256i y_c2  = _mm256_broadcastsi128_si256(y_c);
+    const __m256i u_ab2 = _mm256_broadcastsi128_si256(u_ab);
+    const __m256i u_c2  = _mm256_broadcastsi128_si256(u_c);
+    const __m256i v_ab2 = _mm256_broadcastsi128_si256(v_ab);
+    const __m256i v_c2  = _mm256_broadcastsi128_si256(v_c);
+    int x = 0;
+
+    for (; x + 12 < width; x += 12, src += 8, y += 12, u += 6, v += 6) {
+        __m256i w  = _mm256_loadu_si256((const __m256i *)src);
+        __m256i a  = _mm256_and_si256(w, mask);
+        __m256i b  = _mm256_and_si256(_mm256_srli_epi32(w, 10), mask);
+        __m256i c  = _mm256_and_si256(_mm256_srli_epi32(w, 20), mask);
+        __m256i ab = _mm256_packus_epi32(a, b);
+        __m256i cc = _mm256_packus_epi32(c, c);
+        __m256i py = _mm256_or_si256(_mm256_shuffle_epi8(ab, y_ab2),
+                                     _mm256_shuffle_epi8(cc, y_c2));
+        __m256i pu = _mm256_or_si256(_mm256_shuffle_epi8(ab, u_ab2),
+                                     _mm256_shuffle_epi8(cc, u_c2));
+        __m256i pv = _mm256_or_si256(_mm256_shuffle_epi8(ab, v_ab2),
+                                     _mm256_shuffle_epi8(cc, v_c2));
+
+        _mm_storeu_si128((__m128i *)y, _mm256_castsi256_si128(py));
+        _mm_storeu_si128((__m128i *)(y + 6), _mm256_extracti128_si256(py, 1));
+        _mm_storel_epi64((__m128i *)u, _mm256_castsi256_si128(pu));
+        _mm_storel_epi64((__m128i *)(u + 3), _mm256_extracti128_si256(pu, 1));
+        _mm_storel_epi64((__m128i *)v, _mm256_castsi256_si128(pv));
+        _mm_storel_epi64((__m128i *)(v + 3), _mm256_extracti128_si256(pv, 1));
+    }
+
+    unpack_row_sse4(src, y, u, v, width - x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void unpack_row_avx512(const uint32_t *src, uint16_t *y, uint16_t *u,
+                              uint16_t *v, int width)
+{
+    V210_SHUFFLES
+    const __m512i mask  = _mm512_set1_epi32(0x3ff);
+    const __m512i y_ab4 = _mm512_broadcast_i32x4(y_ab);
+    const __m512i y_c4  = _mm512_broadcast_i32x4(y_c);
+    const __m512i u_ab4 = _mm512_broadcast_i32x4(u_ab);
+    const __m512i u_c4  = _mm512_broadcast_i32x4(u_c);
+    const __m512i v_ab4 = _mm512_broadcast_i32x4(v_ab);
+    const __m512i v_c4  = _mm512_broadcast_i32x4(v_c);
+    int x = 0;
+
+    for (; x + 24 < width; x += 24, src += 16, y += 24, u += 12, v += 12) {
+        __m512i w  = _mm512_loadu_si512(src);
+        __m512i a  = _mm512_and_si512(w, mask);
+        __m512i b  = _mm512_and_si512(_mm512_srli_epi32(w, 10), mask);
+        __m512i c  = _mm512_and_si512(_mm512_srli_epi32(w, 20), mask);
+        __m512i ab = _mm512_packus_epi32(a, b);
+        __m512i cc = _mm512_packus_epi32(c, c);
+        __m512i py = _mm512_or_si512(_mm512_shuffle_epi8(ab, y_ab4),
+                                     _mm512_shuffle_epi8(cc, y_c4));
+        __m512i pu = _mm512_or_si512(_mm512_shuffle_epi8(ab, u_ab4),
+                                     _mm512_shuffle_epi8(cc, u_c4));
+        __m512i pv = _mm512_or_si512(_mm512_shuffle_epi8(ab, v_ab4),
+                                     _mm512_shuffle_epi8(cc, v_c4));
+
+        _mm_storeu_si128((__m128i *)y,        _mm512_extracti32x4_epi32(py, 0));
+        _mm_storeu_si128((__m128i *)(y + 6),  _mm512_extracti32x4_epi32(py, 1));
+        _mm_storeu_si128((__m128i *)(y + 12), _mm512_extracti32x4_epi32(py, 2));
+        _mm_storeu_si128((__m128i *)(y + 18), _mm512_extracti32x4_epi32(py, 3));
+        _mm_storel_epi64((__m128i *)u,        _mm512_extracti32x4_epi32(pu, 0));
+        _mm_storel_epi64((__m128i *)(u + 3),  _mm512_extracti32x4_epi32(pu, 1));
+        _mm_storel_epi64((__m128i *)(u + 6),  _mm512_extracti32x4_epi32(pu, 2));
+        _mm_storel_epi64((__m128i *)(u + 9),  _mm512_extracti32x4_epi32(pu, 3));
+        _mm_storel_epi64((__m128i *)v,        _mm512_extracti32x4_epi32(pv, 0));
+        _mm_storel_epi64((__m128i *)(v + 3),  _mm512_extracti32x4_epi32(pv, 1));
+        _mm_storel_epi64((__m128i *)(v + 6),  _mm512_extracti32x4_epi32(pv, 2));
+        _mm_storel_epi64((__m128i *)(v + 9),  _mm512_extracti32x4_epi32(pv, 3));
+    }
+
+    unpack_row_avx2(src, y, u, v, width - x);
+}
+#endif
+
+V210UnpackRowFunc v210_unpack_row_func(const char **name)
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        *name = "avx512";
+        return unpack_row_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return unpack_row_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        *name = "sse4";
+        return unpack_row_sse4;
+    }
+#endif
+    *name = "c";
+    return unpack_row_c;
+}
+
+static int64_t thread_cpu_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void unpack_slice(V210Unpacker *s, int slice, int nb_slices)
+{
+    int start = s->height * slice / nb_slices;
+    int end   = s->height * (slice + 1) / nb_slices;
+    int64_t t = thread_cpu_time();
+
+    for (int i = start; i < end; i++)
+        s->unpack_row((const uint32_t *)(s->src + (size_t)i * s->src_stride),
+                      (uint16_t *)(s->dst[0] + (size_t)i * s->dst_stride[0]),
+                      (uint16_t *)(s->dst[1] + (size_t)i * s->dst_stride[1]),
+                      (uint16_t *)(s->dst[2] + (size_t)i * s->dst_stride[2]),
+                      s->width);
+
+    __atomic_fetch_add(&s->cpu_time, thread_cpu_time() - t, __ATOMIC_RELAXED);
+}
+
+typedef struct V210Worker {
+    V210Unpacker *s;
+    int index;
+} V210Worker;
+
+static void *unpack_worker(void *arg)
+{
+    V210Worker *w    = (V210Worker *)arg;
+    V210Unpacker *s  = w->s;
+    int index        = w->index;
+    unsigned generation = 0;
+
+    free(w);
+
+    for (;;) {
+        pthread_mutex_lock(&s->mutex);
+        while (s->generation == generation && !s->quit)
+            pthread_cond_wait(&s->cond, &s->mutex);
+        generation = s->generation;
+        pthread_mutex_unlock(&s->mutex);
+
+        if (s->quit)
+            return NULL;
+
+        /* slice 0 is done by the caller */
+        unpack_slice(s, index + 1, s->nb_threads + 1);
+
+        pthread_mutex_lock(&s->mutex);
+        if (!--s->pending)
+            pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+int v210_unpacker_init(V210Unpacker *s, int nb_threads)
+{
+    memset(s, 0, sizeof(*s));
+
+    s->unpack_row = v210_unpack_row_func(&s->name);
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if (nb_threads < 1)
+        nb_threads = 1;
+
+    s->threads = (pthread_t *)calloc(nb_threads, sizeof(*s->threads));
+    if (!s->threads)
+        return -1;
+
+    for (int i = 0; i < nb_threads - 1; i++) {
+        V210Worker *w = (V210Worker *)malloc(sizeof(*w));
+        if (!w)
+            return -1;
+        w->s     = s;
+        w->index = i;
+        if (pthread_create(&s->threads[i], NULL, unpack_worker, w)) {
+            free(w);
+            return -1;
+        }
+        s->nb_threads++;
+    }
+
+    return 0;
+}
+
+void v210_unpacker_close(V210Unpacker *s)
+{
+    pthread_mutex_lock(&s->mutex);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    for (int i = 0; i < s->nb_threads; i++)
+        pthread_join(s->threads[i], NULL);
+
+    free(s->threads);
+    s->threads = NULL;
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+}
+
+void v210_unpack_frame(V210Unpacker *s, const uint8_t *src, int src_stride,
+                       uint8_t *dst[3], int dst_stride[3],
+                       int width, int height)
+{
+    s->src        = src;
+    s->src_stride = src_stride;
+    s->width      = width;
+    s->height     = height;
+    for (int i = 0; i < 3; i++) {
+        s->dst[i]        = dst[i];
+        s->dst_stride[i] = dst_stride[i];
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    s->pending = s->nb_threads;
+    s->generation++;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    unpack_slice(s, 0, s->nb_threads + 1);
+
+    pthread_mutex_lock(&s->mutex);
+    while (s->pending)
+        pthread_cond_wait(&s->cond, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+
+    s->frames++;
+}
+
+void v210_unpacker_report(V210Unpacker *s, FILE *f)
+{
+    if (!s->frames)
+        return;
+
+    fprintf(f, "v210 unpack (%s, %d threads): %lu frames - %.1f fps per core\n",
+            s->name, s->nb_threads + 1, s->frames,
+            s->frames * 1000000.0 /
+            __atomic_load_n(&s->cpu_time, __ATOMIC_RELAXED));
+}
+
+/* Unpack a mid grey frame over and over, 1080p and 2160p */
+int v210_benchmark(int nb_threads, FILE *f)
+{
+    static const int sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+    V210Unpacker s;
+
+    for (int i = 0; i < 2; i++) {
+        int width      = sizes[i][0];
+        int height     = sizes[i][1];
+        int src_stride = ((width + 47) / 48) * 128;
+        int dst_stride[3] = { width * 2, width, width };
+        uint8_t *src   = (uint8_t *)malloc((size_t)src_stride * height);
+        uint8_t *dst[3] = {
+            (uint8_t *)malloc((size_t)dst_stride[0] * height),
+            (uint8_t *)malloc((size_t)dst_stride[1] * height),
+            (uint8_t *)malloc((size_t)dst_stride[2] * height),
+        };
+        int ret = v210_unpacker_init(&s, nb_threads);
+
+        if (!ret && src && dst[0] && dst[1] && dst[2]) {
+            for (size_t j = 0; j < (size_t)src_stride * height / 4; j++)
+                ((uint32_t *)src)[j] = 0x20080200;
+            for (int j = 0; j < 200; j++)
+                v210_unpack_frame(&s, src, src_stride, dst, dst_stride,
+                                  width, height);
+            fprintf(f, "%dx%d ", width, height);
+            v210_unpacker_report(&s, f);
+        } else {
+            ret = -1;
+        }
+        v210_unpacker_close(&s);
+
+        free(src);
+        for (int j = 0; j < 3; j++)
+            free(dst[j]);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2014 Luca Barbato.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_V210_H
+#define BMDTOOLS_V210_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+typedef void (*V210UnpackRowFunc)(const uint32_t *src, uint16_t *y,
+                                  uint16_t *u, uint16_t *v, int width);
+
+/*
+ * Unpacks v210 frames to planar yuv422p10, using the widest SIMD
+ * variant the cpu supports and splitting the frame in horizontal
+ * slices across a small pool of threads.
+ */
+typedef struct V210Unpacker {
+    V210UnpackRowFunc unpack_row;
+    const char *name;
+
+    int nb_threads;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned generation;
+    int pending;
+    int quit;
+
+    /* current job */
+    const uint8_t *src;
+    int src_stride;
+    uint8_t *dst[3];
+    int dst_stride[3];
+    int width, height;
+
+    unsigned long frames;
+    int64_t cpu_time;
+} V210Unpacker;
+
+V210UnpackRowFunc v210_unpack_row_func(const char **name);
+int v210_unpacker_init(V210Unpacker *s, int nb_threads);
+void v210_unpacker_close(V210Unpacker *s);
+void v210_unpack_frame(V210Unpacker *s, const uint8_t *src, int src_stride,
+                       uint8_t *dst[3], int dst_stride[3],
+                       int width, int height);
+void v210_unpacker_report(V210Unpacker *s, FILE *f);
+int v210_benchmark(int nb_threads, FILE *f);
+
+#endif /* BMDTOOLS_V210_H */